@@ -0,0 +1,855 @@
+// heif2jpeg-bench - end-to-end benchmark driver for the heif2jpeg command-line tool
+//
+//   heif2jpeg-bench generate CORPUS_DIR
+//       Encode the synthetic corpus with libheif (skips files that already exist).
+//       The pixel content is deterministic, so every machine benchmarks the same images.
+//   heif2jpeg-bench run --corpus DIR --binary PATH --out RESULTS.json [--threads 1,8] [--repeat N]
+//       Run the converter on every corpus class (subdirectory) for each thread count and
+//       option set, and record wall time, images/s, MP/s, peak RSS and output bytes.
+//   heif2jpeg-bench compare BASELINE.json RESULTS.json [--tolerance PERCENT]
+//       Flag throughput drops and peak RSS or output size increases beyond the tolerance.
+//       Exits with 1 when something regressed.
+//   heif2jpeg-bench syscalls --corpus DIR --binary PATH [--class NAME]
+//       Count the system calls of the converter (all threads) on one corpus class (default
+//       tiny), converting into a new directory and then again with every output present.
+//       Linux only: the child is traced with ptrace.
+
+#include <iostream>       // cout, cerr
+#include <fstream>        // Results files
+#include <sstream>        // std::stringstream
+#include <string>         // std::string
+#include <vector>         // std::vector
+#include <map>            // Results by key in compare mode
+#include <filesystem>     // C++17 paths
+#include <algorithm>      // std::sort
+#include <thread>         // hardware_concurrency
+#include <cmath>          // std::sin
+#include <cstring>        // strcmp
+#include <cstdint>        // uint64_t
+#include <ctime>          // Timestamps
+
+#include <sys/resource.h> // rusage
+#include <sys/wait.h>     // wait4
+#include <fcntl.h>        // open
+#include <unistd.h>       // fork, execv, gethostname
+#ifdef __linux__
+#include <csignal>        // raise
+#include <sys/ptrace.h>   // Syscall counting
+#include <sys/uio.h>      // iovec for PTRACE_GETREGSET
+#include <sys/user.h>     // user_regs_struct
+#include <sys/syscall.h>  // SYS_* numbers
+#include <elf.h>          // NT_PRSTATUS
+#endif
+
+#include <libheif/heif.h> // Corpus encoding and image dimensions
+
+namespace fs = std::filesystem;
+
+// One class of corpus images, stored in its own subdirectory
+struct CorpusClass {
+    const char* name;
+    int width;
+    int height;
+    int count;
+    int bit_depth;      // 8 or 10
+    bool alpha;
+    bool grid;          // Encode as a grid of 512x512 tiles, like camera HEICs
+    int orientation;    // 1 = none
+    bool display_p3;    // nclx Display P3 (phone photos) instead of sRGB
+};
+
+const CorpusClass CORPUS[] = {
+    {"tiny",        64,    48, 200,  8, false, false, 1, false},
+    {"12mp-grid", 4096,  3072,   8,  8, false, true,  1, false},
+    {"12mp-p3",   4032,  3024,   4,  8, false, false, 1, true},
+    {"48mp",      8064,  6048,   2,  8, false, false, 1, false},
+    {"48mp-rot90", 8064, 6048,   2,  8, false, false, 6, false},
+    {"panorama", 16384,  3072,   2,  8, false, false, 1, false},
+    {"10bit",     4032,  3024,   4, 10, false, false, 1, false},
+    {"alpha",     2048,  1536,   6,  8, true,  false, 1, false},
+};
+
+// Converter settings benchmarked for every class
+struct OptionSet {
+    const char* name;
+    std::vector<std::string> args;
+    bool rotated_only = false;  // Only for classes with an orientation
+    bool p3_only = false;       // Only for Display P3 classes
+};
+
+const std::vector<OptionSet> OPTION_SETS = {
+    {"default",  {}},
+    {"q80",      {"-q", "80"}},
+    {"fast",     {"--profile", "fast"}},
+    {"balanced", {"--profile", "balanced"}},
+    {"smallest", {"--profile", "smallest"}},
+    {"lossless-rotate", {"--lossless-rotate"}, true},
+    {"to-srgb",  {"--to-srgb"}, false, true},
+    {"renditions", {"--rendition", "large:2048:85", "--rendition", "thumb:320:75"}},
+};
+
+// === Corpus generation ===
+
+// Small deterministic PRNG (xorshift64*) for texture noise
+struct Random {
+    uint64_t state;
+    explicit Random(uint64_t seed) : state(seed * 0x9e3779b97f4a7c15ULL + 1) {}
+    uint32_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return static_cast<uint32_t>((state * 0x2545f4914f6cdd1dULL) >> 32);
+    }
+};
+
+// Photo-like content: smooth gradients and bands plus fine noise, so neither
+// the HEVC nor the JPEG encoder sees a trivial image
+void fill_image(heif_image* image, int width, int height, int bit_depth, bool alpha,
+                int x0, int y0, int full_width, int full_height, uint64_t seed) {
+    int stride = 0;
+    uint8_t* plane = heif_image_get_plane(image, heif_channel_interleaved, &stride);
+    int channels = alpha ? 4 : 3;
+    int max_value = (1 << bit_depth) - 1;
+    Random random(seed ^ (static_cast<uint64_t>(y0) << 32) ^ static_cast<uint64_t>(x0));
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double u = double(x0 + x) / full_width;
+            double v = double(y0 + y) / full_height;
+            double base[4] = {
+                0.5 + 0.4 * std::sin(6.0 * u + 2.0 * v + seed),
+                0.5 + 0.4 * std::sin(4.0 * v - 3.0 * u + seed * 0.5),
+                0.5 + 0.4 * std::sin(9.0 * (u + v) + seed * 0.25),
+                0.75 + 0.25 * std::sin(5.0 * u),
+            };
+            for (int c = 0; c < channels; c++) {
+                double noise = c < 3 ? (int(random.next() % 17) - 8) / 255.0 : 0.0;
+                double value = std::min(1.0, std::max(0.0, base[c] + noise));
+                int sample = static_cast<int>(value * max_value + 0.5);
+                if (bit_depth > 8) {
+                    uint8_t* p = plane + static_cast<size_t>(y) * stride + (static_cast<size_t>(x) * channels + c) * 2;
+                    p[0] = sample & 0xff;
+                    p[1] = sample >> 8;
+                } else {
+                    plane[static_cast<size_t>(y) * stride + static_cast<size_t>(x) * channels + c] = static_cast<uint8_t>(sample);
+                }
+            }
+        }
+    }
+}
+
+heif_image* create_image(int width, int height, int bit_depth, bool alpha) {
+    heif_chroma chroma = bit_depth > 8 ? (alpha ? heif_chroma_interleaved_RRGGBBAA_LE : heif_chroma_interleaved_RRGGBB_LE)
+                                       : (alpha ? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB);
+    heif_image* image = nullptr;
+    heif_error err = heif_image_create(width, height, heif_colorspace_RGB, chroma, &image);
+    if (err.code != heif_error_Ok) return nullptr;
+    err = heif_image_add_plane(image, heif_channel_interleaved, width, height, bit_depth);
+    if (err.code != heif_error_Ok) {
+        heif_image_release(image);
+        return nullptr;
+    }
+    return image;
+}
+
+bool encode_corpus_file(const CorpusClass& spec, int index, const fs::path& path, std::string& error) {
+    heif_context* ctx = heif_context_alloc();
+    heif_encoder* encoder = nullptr;
+    heif_error err = heif_context_get_encoder_for_format(ctx, heif_compression_HEVC, &encoder);
+    if (err.code != heif_error_Ok) {
+        error = std::string("No HEVC encoder: ") + err.message;
+        heif_context_free(ctx);
+        return false;
+    }
+    heif_encoder_set_lossy_quality(encoder, 80);
+
+    heif_image_handle* handle = nullptr;
+    heif_encoding_options* options = heif_encoding_options_alloc();
+    options->save_alpha_channel = spec.alpha;
+#if LIBHEIF_HAVE_VERSION(1, 14, 0)
+    options->image_orientation = static_cast<heif_orientation>(spec.orientation);
+#endif
+
+    uint64_t seed = static_cast<uint64_t>(index) * 7919 + strlen(spec.name);
+    bool grid = false;
+#if LIBHEIF_HAVE_VERSION(1, 17, 0)
+    // Camera HEICs are grids of 512x512 tiles; heif_context_encode_grid appeared in 1.17
+    grid = spec.grid && spec.width % 512 == 0 && spec.height % 512 == 0;
+    if (grid) {
+        uint16_t columns = spec.width / 512;
+        uint16_t rows = spec.height / 512;
+        std::vector<heif_image*> tiles;
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < columns; c++) {
+                heif_image* tile = create_image(512, 512, spec.bit_depth, spec.alpha);
+                if (tile) {
+                    fill_image(tile, 512, 512, spec.bit_depth, spec.alpha, c * 512, r * 512, spec.width, spec.height, seed);
+                }
+                tiles.push_back(tile);
+            }
+        }
+        if (std::find(tiles.begin(), tiles.end(), nullptr) == tiles.end()) {
+            err = heif_context_encode_grid(ctx, tiles.data(), rows, columns, encoder, options, &handle);
+        } else {
+            err = {heif_error_Memory_allocation_error, heif_suberror_Unspecified, "Cannot create tile"};
+        }
+        for (heif_image* tile : tiles) {
+            if (tile) heif_image_release(tile);
+        }
+    }
+#endif
+    if (!grid) {
+        heif_image* image = create_image(spec.width, spec.height, spec.bit_depth, spec.alpha);
+        if (image) {
+            fill_image(image, spec.width, spec.height, spec.bit_depth, spec.alpha, 0, 0, spec.width, spec.height, seed);
+            if (spec.display_p3) {
+                heif_color_profile_nclx* nclx = heif_nclx_color_profile_alloc();
+                if (nclx) {
+                    heif_nclx_color_profile_set_color_primaries(nclx, heif_color_primaries_SMPTE_EG_432_1);
+                    heif_nclx_color_profile_set_transfer_characteristics(nclx, heif_transfer_characteristic_IEC_61966_2_1);
+                    heif_image_set_nclx_color_profile(image, nclx);
+                    heif_nclx_color_profile_free(nclx);
+                }
+            }
+            err = heif_context_encode_image(ctx, image, encoder, options, &handle);
+            heif_image_release(image);
+        } else {
+            err = {heif_error_Memory_allocation_error, heif_suberror_Unspecified, "Cannot create image"};
+        }
+    }
+
+    // Cameras store the orientation in Exif as well; the converter checks one against the other
+    if (err.code == heif_error_Ok && spec.orientation != 1) {
+        const uint8_t exif[] = {'M', 'M', 0, 42, 0, 0, 0, 8,                  // TIFF header, IFD0 at 8
+                                0, 1,                                         // One entry:
+                                0x01, 0x12, 0, 3, 0, 0, 0, 1,                 // Orientation, one SHORT
+                                0, static_cast<uint8_t>(spec.orientation), 0, 0,
+                                0, 0, 0, 0};                                  // No next IFD
+        err = heif_context_add_exif_metadata(ctx, handle, exif, sizeof(exif));
+    }
+    if (err.code == heif_error_Ok) {
+        err = heif_context_write_to_file(ctx, path.c_str());
+    }
+    if (err.code != heif_error_Ok) {
+        error = err.message;
+    }
+    if (handle) heif_image_handle_release(handle);
+    heif_encoding_options_free(options);
+    heif_encoder_release(encoder);
+    heif_context_free(ctx);
+    return err.code == heif_error_Ok;
+}
+
+int generate(const fs::path& corpus_dir) {
+    int created = 0;
+    for (const CorpusClass& spec : CORPUS) {
+        fs::path dir = corpus_dir / spec.name;
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        for (int i = 0; i < spec.count; i++) {
+            fs::path path = dir / (std::string(spec.name) + "_" + std::to_string(i + 1) + ".heic");
+            if (fs::exists(path)) continue;
+
+            std::string error;
+            fs::path partial = path.string() + ".tmp";
+            if (!encode_corpus_file(spec, i, partial, error)) {
+                std::cerr << "Error: Failed to encode " << path << ": " << error << std::endl;
+                fs::remove(partial, ec);
+                return 1;
+            }
+            fs::rename(partial, path, ec);
+            created++;
+        }
+        std::cout << "Corpus class " << spec.name << ": " << spec.count << " x " << spec.width << "x" << spec.height
+                  << (spec.bit_depth > 8 ? " 10-bit" : "") << (spec.alpha ? " alpha" : "") << (spec.grid ? " grid" : "")
+                  << (spec.orientation != 1 ? " orientation " + std::to_string(spec.orientation) : "")
+                  << std::endl;
+    }
+    std::cout << "Corpus ready in " << corpus_dir << " (" << created << " files created)" << std::endl;
+    return 0;
+}
+
+// === Running the converter ===
+
+struct RunResult {
+    std::string corpus_class;
+    std::string options;
+    unsigned int threads = 0;
+    int images = 0;
+    double megapixels = 0;
+    double wall_s = 0;
+    double user_s = 0;
+    double sys_s = 0;
+    long peak_rss_kb = 0;
+    uint64_t output_bytes = 0;
+    int exit_code = 0;
+};
+
+double now_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run the converter in a child process; fills wall/CPU time, peak RSS and exit code
+bool run_converter(const std::vector<std::string>& args, RunResult& result) {
+    std::vector<char*> argv;
+    for (const auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) return false;
+    result.wall_s = now_seconds() - start;
+    result.user_s = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    result.sys_s = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+    result.peak_rss_kb = usage.ru_maxrss / 1024;   // Bytes on macOS
+#else
+    result.peak_rss_kb = usage.ru_maxrss;          // Kilobytes on Linux
+#endif
+    result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return true;
+}
+
+uint64_t directory_bytes(const fs::path& dir) {
+    uint64_t total = 0;
+    std::error_code ec;
+    for (const auto& entry : fs::recursive_directory_iterator(dir, ec)) {
+        if (entry.is_regular_file(ec)) total += entry.file_size(ec);
+    }
+    return total;
+}
+
+double image_megapixels(const fs::path& path) {
+    heif_context* ctx = heif_context_alloc();
+    double megapixels = 0;
+    heif_image_handle* handle = nullptr;
+    if (heif_context_read_from_file(ctx, path.c_str(), nullptr).code == heif_error_Ok &&
+        heif_context_get_primary_image_handle(ctx, &handle).code == heif_error_Ok) {
+        megapixels = double(heif_image_handle_get_width(handle)) * heif_image_handle_get_height(handle) / 1e6;
+        heif_image_handle_release(handle);
+    }
+    heif_context_free(ctx);
+    return megapixels;
+}
+
+std::string json_escape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+// One result per line, so compare mode can read the file back line by line
+std::string result_json(const RunResult& r) {
+    std::stringstream json;
+    json.precision(6);
+    json << "{\"class\": \"" << json_escape(r.corpus_class) << "\", \"options\": \"" << json_escape(r.options)
+         << "\", \"threads\": " << r.threads << ", \"images\": " << r.images
+         << ", \"megapixels\": " << r.megapixels << ", \"wall_s\": " << r.wall_s
+         << ", \"user_s\": " << r.user_s << ", \"sys_s\": " << r.sys_s
+         << ", \"images_per_s\": " << (r.wall_s > 0 ? r.images / r.wall_s : 0)
+         << ", \"mp_per_s\": " << (r.wall_s > 0 ? r.megapixels / r.wall_s : 0)
+         << ", \"peak_rss_kb\": " << r.peak_rss_kb << ", \"output_bytes\": " << r.output_bytes
+         << ", \"exit_code\": " << r.exit_code << "}";
+    return json.str();
+}
+
+std::vector<unsigned int> parse_thread_list(const std::string& list) {
+    std::vector<unsigned int> threads;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) threads.push_back(static_cast<unsigned int>(std::stoul(item)));
+    }
+    return threads;
+}
+
+int run(const fs::path& corpus_dir, const fs::path& binary, const fs::path& out_path,
+        const std::vector<unsigned int>& thread_counts, int repeat) {
+    std::vector<RunResult> results;
+    fs::path work_dir = fs::temp_directory_path() / ("heif2jpeg-bench-" + std::to_string(getpid()));
+
+    for (const CorpusClass& spec : CORPUS) {
+        fs::path class_dir = corpus_dir / spec.name;
+        std::vector<fs::path> files;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(class_dir, ec)) {
+            if (entry.path().extension() == ".heic") files.push_back(entry.path());
+        }
+        if (files.empty()) {
+            std::cerr << "Warning: No corpus files in " << class_dir << std::endl;
+            continue;
+        }
+        std::sort(files.begin(), files.end());
+
+        double megapixels = 0;
+        for (const auto& file : files) megapixels += image_megapixels(file);
+
+        for (unsigned int threads : thread_counts) {
+            for (const OptionSet& option_set : OPTION_SETS) {
+                if (option_set.rotated_only && spec.orientation == 1) continue;
+                if (option_set.p3_only && !spec.display_p3) continue;
+                // Median wall time of the repetitions; peak RSS is the largest seen
+                std::vector<RunResult> runs;
+                for (int r = 0; r < repeat; r++) {
+                    fs::remove_all(work_dir, ec);
+                    std::vector<std::string> args = {binary.string(), "-f", "-o", work_dir.string()};
+                    if (threads > 0) {
+                        args.push_back("--threads");
+                        args.push_back(std::to_string(threads));
+                    }
+                    args.insert(args.end(), option_set.args.begin(), option_set.args.end());
+                    for (const auto& file : files) args.push_back(file.string());
+
+                    RunResult result;
+                    if (!run_converter(args, result)) {
+                        std::cerr << "Error: Cannot run " << binary << std::endl;
+                        return 1;
+                    }
+                    result.output_bytes = directory_bytes(work_dir);
+                    runs.push_back(result);
+                }
+                std::sort(runs.begin(), runs.end(),
+                          [](const RunResult& a, const RunResult& b) { return a.wall_s < b.wall_s; });
+                RunResult result = runs[runs.size() / 2];
+                for (const auto& other : runs) {
+                    result.peak_rss_kb = std::max(result.peak_rss_kb, other.peak_rss_kb);
+                    if (other.exit_code != 0) result.exit_code = other.exit_code;
+                }
+                result.corpus_class = spec.name;
+                result.options = option_set.name;
+                result.threads = threads;
+                result.images = static_cast<int>(files.size());
+                result.megapixels = megapixels;
+                results.push_back(result);
+
+                std::cout << spec.name << " / " << option_set.name << " / " << (threads ? std::to_string(threads) : "auto")
+                          << " threads: " << result.wall_s << " s, " << result.images / result.wall_s << " images/s, "
+                          << result.megapixels / result.wall_s << " MP/s, peak RSS " << result.peak_rss_kb / 1024
+                          << " MB, " << result.output_bytes << " bytes"
+                          << (result.exit_code ? " (exit code " + std::to_string(result.exit_code) + ")" : "")
+                          << std::endl;
+            }
+        }
+    }
+    std::error_code ec;
+    fs::remove_all(work_dir, ec);
+
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    time_t now = time(nullptr);
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    std::ofstream out(out_path);
+    out << "{\n  \"version\": 1,\n  \"host\": \"" << json_escape(host) << "\",\n  \"cpus\": "
+        << std::thread::hardware_concurrency() << ",\n  \"timestamp\": \"" << timestamp << "\",\n  \"binary\": \""
+        << json_escape(binary.string()) << "\",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        out << "    " << result_json(results[i]) << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    if (!out) {
+        std::cerr << "Error: Cannot write " << out_path << std::endl;
+        return 1;
+    }
+    std::cout << "Results written to " << out_path << std::endl;
+    return 0;
+}
+
+// === Counting system calls ===
+
+#ifdef __linux__
+// Names of the calls the converter's file handling makes, for the report. Calls of the
+// stat family are also summed, as are the ones that open files.
+struct SyscallName {
+    long number;
+    const char* name;
+    const char* family;     // "stat", "open" or nullptr
+};
+
+const SyscallName SYSCALL_NAMES[] = {
+#ifdef SYS_stat
+    {SYS_stat, "stat", "stat"},
+#endif
+#ifdef SYS_lstat
+    {SYS_lstat, "lstat", "stat"},
+#endif
+#ifdef SYS_access
+    {SYS_access, "access", "stat"},
+#endif
+#ifdef SYS_open
+    {SYS_open, "open", "open"},
+#endif
+#ifdef SYS_mkdir
+    {SYS_mkdir, "mkdir", nullptr},
+#endif
+#ifdef SYS_rename
+    {SYS_rename, "rename", nullptr},
+#endif
+#ifdef SYS_statx
+    {SYS_statx, "statx", "stat"},
+#endif
+    {SYS_fstat, "fstat", "stat"},
+    {SYS_newfstatat, "newfstatat", "stat"},
+    {SYS_faccessat, "faccessat", "stat"},
+    {SYS_openat, "openat", "open"},
+    {SYS_mkdirat, "mkdirat", nullptr},
+    {SYS_renameat, "renameat", nullptr},
+#ifdef SYS_renameat2
+    {SYS_renameat2, "renameat2", nullptr},
+#endif
+    {SYS_getdents64, "getdents64", nullptr},
+    {SYS_getcwd, "getcwd", nullptr},
+    {SYS_close, "close", nullptr},
+    {SYS_read, "read", nullptr},
+    {SYS_write, "write", nullptr},
+    {SYS_pread64, "pread64", nullptr},
+    {SYS_lseek, "lseek", nullptr},
+    {SYS_mmap, "mmap", nullptr},
+    {SYS_munmap, "munmap", nullptr},
+    {SYS_madvise, "madvise", nullptr},
+    {SYS_unlinkat, "unlinkat", nullptr},
+    {SYS_ioctl, "ioctl", nullptr},
+    {SYS_mprotect, "mprotect", nullptr},
+    {SYS_brk, "brk", nullptr},
+    {SYS_futex, "futex", nullptr},
+    {SYS_clone, "clone", nullptr},
+#ifdef SYS_clone3
+    {SYS_clone3, "clone3", nullptr},
+#endif
+    {SYS_execve, "execve", nullptr},
+    {SYS_getpid, "getpid", nullptr},
+    {SYS_rt_sigaction, "rt_sigaction", nullptr},
+    {SYS_rt_sigprocmask, "rt_sigprocmask", nullptr},
+    {SYS_set_robust_list, "set_robust_list", nullptr},
+    {SYS_prlimit64, "prlimit64", nullptr},
+    {SYS_getrandom, "getrandom", nullptr},
+    {SYS_exit, "exit", nullptr},
+    {SYS_exit_group, "exit_group", nullptr},
+};
+
+// Syscall number at a syscall-entry stop
+long traced_syscall_number(pid_t tid) {
+    user_regs_struct regs;
+    iovec io = {&regs, sizeof(regs)};
+    if (ptrace(PTRACE_GETREGSET, tid, reinterpret_cast<void*>(NT_PRSTATUS), &io) != 0) return -1;
+#if defined(__x86_64__)
+    return static_cast<long>(regs.orig_rax);
+#elif defined(__aarch64__)
+    return static_cast<long>(regs.regs[8]);
+#else
+    return -1;
+#endif
+}
+
+// Run the converter under ptrace, following its threads, and count its system calls by
+// number. Returns the exit code, or -1 when it could not be run.
+int count_syscalls(const std::vector<std::string>& args, std::map<long, uint64_t>& counts) {
+    std::vector<char*> argv;
+    for (const auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        raise(SIGSTOP);     // Let the parent set its options before exec
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)) return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, nullptr,
+           reinterpret_cast<void*>(static_cast<long>(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+                                                     PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC |
+                                                     PTRACE_O_EXITKILL)));
+    ptrace(PTRACE_SYSCALL, pid, nullptr, nullptr);
+
+    // Every thread alternates entry and exit stops; only entries are counted (from the
+    // execve() that starts the converter on)
+    std::map<pid_t, bool> in_syscall = {{pid, false}};
+    int exit_code = -1;
+    while (true) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) break;     // No traced threads left
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid) exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            in_syscall.erase(tid);
+            continue;
+        }
+        if (!WIFSTOPPED(status)) continue;
+
+        int signal = WSTOPSIG(status);
+        long deliver = 0;
+        if (signal == (SIGTRAP | 0x80)) {
+            bool& inside = in_syscall[tid];
+            if (!inside) counts[traced_syscall_number(tid)]++;
+            inside = !inside;
+        } else if (status >> 16 != 0) {
+            // Clone, fork or exec event; new threads are picked up by waitpid(-1)
+        } else if (signal == SIGSTOP && !in_syscall.count(tid)) {
+            in_syscall[tid] = false;    // A new thread's initial stop
+        } else {
+            deliver = signal;
+        }
+        ptrace(PTRACE_SYSCALL, tid, nullptr, reinterpret_cast<void*>(deliver));
+    }
+    return exit_code;
+}
+
+void print_syscall_counts(const std::string& title, const std::map<long, uint64_t>& counts) {
+    uint64_t total = 0, stat_family = 0, open_family = 0;
+    std::vector<std::pair<uint64_t, std::string>> named;
+    for (const auto& entry : counts) {
+        total += entry.second;
+        std::string name = "syscall " + std::to_string(entry.first);
+        for (const SyscallName& known : SYSCALL_NAMES) {
+            if (known.number != entry.first) continue;
+            name = known.name;
+            if (known.family && strcmp(known.family, "stat") == 0) stat_family += entry.second;
+            if (known.family && strcmp(known.family, "open") == 0) open_family += entry.second;
+        }
+        named.push_back({entry.second, name});
+    }
+    std::sort(named.rbegin(), named.rend());
+
+    std::cout << title << ": " << total << " syscalls, stat family " << stat_family << ", open "
+              << open_family << std::endl;
+    for (const auto& entry : named) {
+        std::cout << "  " << entry.second << std::string(entry.second.size() < 18 ? 18 - entry.second.size() : 1, ' ')
+                  << entry.first << std::endl;
+    }
+}
+#endif
+
+// Count the converter's system calls on one corpus class: a fresh run into a new output
+// directory, then a rerun in which every output already exists
+int syscalls(const fs::path& corpus_dir, const fs::path& binary, const std::string& class_name) {
+#ifdef __linux__
+    std::vector<std::string> args = {binary.string(), "-o", ""};
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(corpus_dir / class_name, ec)) {
+        if (entry.path().extension() == ".heic") args.push_back(entry.path().string());
+    }
+    if (args.size() == 3) {
+        std::cerr << "Error: No corpus files in " << corpus_dir / class_name << std::endl;
+        return 1;
+    }
+    std::sort(args.begin() + 3, args.end());
+
+    fs::path work_dir = fs::temp_directory_path() / ("heif2jpeg-bench-" + std::to_string(getpid()));
+    fs::remove_all(work_dir, ec);
+    args[2] = (work_dir / "out").string();
+    std::cout << args.size() - 3 << " inputs of class " << class_name << ", output to a new directory" << std::endl;
+
+    int result = 0;
+    const char* titles[] = {"Fresh run", "Rerun (all outputs exist)"};
+    for (const char* title : titles) {
+        std::map<long, uint64_t> counts;
+        int exit_code = count_syscalls(args, counts);
+        if (exit_code < 0) {
+            std::cerr << "Error: Cannot trace " << binary << std::endl;
+            result = 1;
+            break;
+        }
+        print_syscall_counts(title, counts);
+        if (exit_code != 0) {
+            std::cout << "  (exit code " << exit_code << ")" << std::endl;
+            result = 1;
+        }
+    }
+    fs::remove_all(work_dir, ec);
+    return result;
+#else
+    (void)corpus_dir;
+    (void)binary;
+    (void)class_name;
+    std::cerr << "Error: Counting system calls needs Linux (ptrace)" << std::endl;
+    return 1;
+#endif
+}
+
+// === Comparing against a baseline ===
+
+// Value of "key": in one result line (string or number, as text)
+std::string json_field(const std::string& line, const std::string& key) {
+    std::string pattern = "\"" + key + "\": ";
+    size_t start = line.find(pattern);
+    if (start == std::string::npos) return std::string();
+    start += pattern.size();
+    if (line[start] == '"') {
+        size_t end = line.find('"', start + 1);
+        return line.substr(start + 1, end - start - 1);
+    }
+    size_t end = line.find_first_of(",}", start);
+    return line.substr(start, end - start);
+}
+
+std::map<std::string, std::string> load_results(const fs::path& path) {
+    std::map<std::string, std::string> results;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find("\"class\": ") == std::string::npos) continue;
+        std::string key = json_field(line, "class") + " / " + json_field(line, "options") + " / " +
+                          json_field(line, "threads") + " threads";
+        results[key] = line;
+    }
+    return results;
+}
+
+int compare(const fs::path& baseline_path, const fs::path& results_path, double tolerance_percent) {
+    std::map<std::string, std::string> baseline = load_results(baseline_path);
+    std::map<std::string, std::string> current = load_results(results_path);
+    if (baseline.empty() || current.empty()) {
+        std::cerr << "Error: No results in " << (baseline.empty() ? baseline_path : results_path) << std::endl;
+        return 1;
+    }
+
+    int regressions = 0;
+    double tolerance = tolerance_percent / 100.0;
+    for (const auto& entry : current) {
+        auto it = baseline.find(entry.first);
+        if (it == baseline.end()) {
+            std::cout << "  new        " << entry.first << std::endl;
+            continue;
+        }
+
+        auto value = [](const std::string& line, const char* key) {
+            std::string text = json_field(line, key);
+            return text.empty() ? 0.0 : std::stod(text);
+        };
+        double old_rate = value(it->second, "images_per_s"), new_rate = value(entry.second, "images_per_s");
+        double old_rss = value(it->second, "peak_rss_kb"), new_rss = value(entry.second, "peak_rss_kb");
+        double old_bytes = value(it->second, "output_bytes"), new_bytes = value(entry.second, "output_bytes");
+
+        std::vector<std::string> problems;
+        if (value(entry.second, "exit_code") != 0) {
+            problems.push_back("converter failed");
+        }
+        if (old_rate > 0 && new_rate < old_rate * (1 - tolerance)) {
+            std::stringstream problem;
+            problem.precision(4);
+            problem << "images/s " << old_rate << " -> " << new_rate;
+            problems.push_back(problem.str());
+        }
+        if (old_rss > 0 && new_rss > old_rss * (1 + tolerance)) {
+            problems.push_back("peak RSS " + std::to_string(long(old_rss / 1024)) + " -> " +
+                               std::to_string(long(new_rss / 1024)) + " MB");
+        }
+        if (old_bytes > 0 && new_bytes > old_bytes * (1 + tolerance)) {
+            problems.push_back("output bytes " + std::to_string(uint64_t(old_bytes)) + " -> " +
+                               std::to_string(uint64_t(new_bytes)));
+        }
+
+        double change = old_rate > 0 ? (new_rate / old_rate - 1) * 100 : 0;
+        std::stringstream line;
+        line.precision(1);
+        line << std::fixed << (problems.empty() ? "  ok         " : "  REGRESSION ") << entry.first
+             << " (" << (change >= 0 ? "+" : "") << change << "% images/s)";
+        for (const auto& problem : problems) line << "; " << problem;
+        std::cout << line.str() << std::endl;
+        if (!problems.empty()) regressions++;
+    }
+    for (const auto& entry : baseline) {
+        if (!current.count(entry.first)) std::cout << "  missing    " << entry.first << std::endl;
+    }
+
+    std::cout << regressions << " regression(s) beyond " << tolerance_percent << "% against " << baseline_path << std::endl;
+    return regressions > 0 ? 1 : 0;
+}
+
+void usage(const char* program) {
+    std::cout << "Usage: " << program << " generate CORPUS_DIR" << std::endl;
+    std::cout << "       " << program << " run --corpus DIR --binary PATH --out RESULTS.json [--threads 1,8] [--repeat N]" << std::endl;
+    std::cout << "       " << program << " compare BASELINE.json RESULTS.json [--tolerance PERCENT]" << std::endl;
+    std::cout << "       " << program << " syscalls --corpus DIR --binary PATH [--class NAME]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string command = argv[1];
+
+    if (command == "generate") {
+        return generate(argv[2]);
+    }
+
+    if (command == "run") {
+        fs::path corpus_dir, binary = "./heif2jpeg", out_path = "bench-results.json";
+        std::vector<unsigned int> threads = {1, std::max(1u, std::thread::hardware_concurrency())};
+        int repeat = 3;
+        for (int i = 2; i + 1 < argc; i += 2) {
+            std::string arg = argv[i];
+            if (arg == "--corpus") corpus_dir = argv[i + 1];
+            else if (arg == "--binary") binary = argv[i + 1];
+            else if (arg == "--out") out_path = argv[i + 1];
+            else if (arg == "--threads") threads = parse_thread_list(argv[i + 1]);
+            else if (arg == "--repeat") repeat = std::max(1, std::atoi(argv[i + 1]));
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        if (corpus_dir.empty() || threads.empty()) {
+            usage(argv[0]);
+            return 1;
+        }
+        return run(corpus_dir, binary, out_path, threads, repeat);
+    }
+
+    if (command == "syscalls") {
+        fs::path corpus_dir, binary = "./heif2jpeg";
+        std::string class_name = "tiny";
+        for (int i = 2; i + 1 < argc; i += 2) {
+            std::string arg = argv[i];
+            if (arg == "--corpus") corpus_dir = argv[i + 1];
+            else if (arg == "--binary") binary = argv[i + 1];
+            else if (arg == "--class") class_name = argv[i + 1];
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        if (corpus_dir.empty()) {
+            usage(argv[0]);
+            return 1;
+        }
+        return syscalls(corpus_dir, binary, class_name);
+    }
+
+    if (command == "compare" && argc >= 4) {
+        double tolerance = 5.0;
+        if (argc >= 6 && strcmp(argv[4], "--tolerance") == 0) tolerance = std::atof(argv[5]);
+        return compare(argv[2], argv[3], tolerance);
+    }
+
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,242 @@
+// libheif2jpeg - HEIF/HEIC to JPEG conversion library
+//
+// The library produces no console output. Progress and error messages are
+// passed to the handler installed with set_log_handler().
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace heif2jpeg {
+
+namespace fs = std::filesystem;
+
+// JPEG encoder trade-off between CPU time and output size
+enum class Profile {
+    Default,    // Accurate integer DCT, standard Huffman tables
+    Fast,       // Fast integer DCT, standard Huffman tables
+    Balanced,   // Accurate integer DCT, Huffman tables optimized per image (one extra pass)
+    Smallest    // Progressive scans with optimized tables; trellis quantization with mozjpeg
+};
+
+// Reduction of sources with more than 8 bits per sample (10-bit HDR HEICs)
+enum class HdrMode {
+    Auto,       // ToneMap for PQ and HLG transfers, Clip otherwise
+    Clip,       // Keep the code values, rounded to 8 bits
+    Gamma,      // Linear light, clipped at reference white, gamma 2.2 curve
+    ToneMap     // Linear light, highlights rolled off above reference white, sRGB curve
+};
+
+// Resampling filter for images downscaled to fit the dimension limits
+enum class ResizeFilter {
+    Lanczos,    // Lanczos3: sharp, for photos
+    Area        // Average of the covered source pixels: faster, softer
+};
+
+// An extra, smaller JPEG of every converted image, written next to it as name_<name>.jpg
+struct Rendition {
+    std::string name;           // Output name suffix (letters, digits, '-' and '_')
+    int max_side = 0;           // Longest side in pixels; 0 (or not smaller than the image) = full size
+    int quality = 85;           // JPEG quality (1-100)
+};
+
+// Per-image conversion settings
+struct Options {
+    int quality = 95;           // JPEG quality (1-100)
+    Profile profile = Profile::Default;
+    HdrMode hdr_mode = HdrMode::Auto;
+    uint32_t background = 0xFFFFFF; // 0xRRGGBB under transparent pixels of images with alpha
+    bool to_srgb = false;           // Convert colors to sRGB instead of writing their ICC profile
+    bool keep_orientation = false;  // Encode pixels as stored, rotated by the Exif orientation tag (libheif 1.18+)
+    bool lossless_rotate = false;   // Apply the Exif orientation to DCT coefficients, not decoded pixels (libheif 1.18+)
+    bool extract_auxiliary = false; // Also write depth maps and auxiliary images (file conversions only)
+    size_t target_size = 0;     // Highest quality up to 'quality' whose JPEG fits in this many bytes (0 = off)
+    double target_ssim = 0;     // Lowest quality up to 'quality' whose luma SSIM reaches this (0 = off)
+    int max_width = 0;          // Reject wider images (0 = unlimited)
+    int max_height = 0;         // Reject taller images (0 = unlimited)
+    bool fit = false;           // Downscale images beyond max_width/max_height to fit instead of rejecting them
+    ResizeFilter resize_filter = ResizeFilter::Lanczos;
+    size_t max_memory_mb = 0;   // Reject images estimated to need more memory (0 = unlimited)
+    std::vector<Rendition> renditions; // Also encoded from the same decode (file conversions only)
+};
+
+// Sample order of the records of a tensor shard
+enum class TensorLayout {
+    NHWC,       // Interleaved: height x width x RGB
+    CHW         // Planar: the red plane, then green, then blue
+};
+
+// Raw pixel output for ML ingestion: the decoded images of a batch as uint8 RGB records of
+// one shard file, instead of JPEGs (format in the README)
+struct TensorOptions {
+    fs::path shard_path;        // Shard to write (empty = JPEG output)
+    TensorLayout layout = TensorLayout::NHWC;
+    int width = 0;              // Scale to cover width x height and center-crop (0 = decoded size)
+    int height = 0;
+};
+
+// Settings for a batch of file conversions
+struct BatchOptions {
+    Options image;                  // Applied to every image of the batch
+    bool force_overwrite = false;   // Overwrite existing outputs
+    fs::path journal_path;          // Completion journal for resumable runs (empty = none)
+    bool dedup = false;             // Convert byte-identical inputs once, link the other outputs
+                                    // (not with image.extract_auxiliary)
+    bool all_images = false;        // Convert every top-level image of multi-image files to name_N.jpg
+    TensorOptions tensor;           // Write raw pixels to a shard instead (no journal, dedup or all_images)
+};
+
+struct BatchItem {
+    fs::path input_path;
+    fs::path output_path;
+    
+    // Optional open descriptors used instead of the paths (which then only name the job).
+    // The input may be a regular file or memfd (read from offset 0) or a pipe; the JPEG is
+    // written at the output's current offset. Descriptors stay owned by the caller.
+    int input_fd = -1;
+    int output_fd = -1;
+    
+    uint64_t tag = 0;           // Caller-defined, passed back in JobResult
+};
+
+enum class JobStatus {
+    Converted,  // Output written
+    Linked,     // Output linked to the output of identical content
+    Skipped,    // Output already present (or input not a HEIF file)
+    Failed
+};
+
+struct JobResult {
+    fs::path input_path;
+    fs::path output_path;
+    JobStatus status;
+    std::string message;        // Reason for skips and failures
+    uint64_t tag = 0;           // BatchItem::tag of the job
+    uint64_t output_size = 0;   // Bytes written (converted and linked jobs)
+};
+
+struct BatchSummary {
+    int converted = 0;
+    int linked = 0;
+    int skipped = 0;
+    int failed = 0;
+};
+
+// Invoked from worker threads as each job of a batch finishes
+using CompletionCallback = std::function<void(const JobResult&)>;
+using LogCallback = std::function<void(const std::string&)>;
+
+// Thrown by the in-memory API when an image cannot be converted
+class ConversionError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class Converter {
+public:
+    // threads: worker count for batches (0 = number of performance cores)
+    // memory_budget_mb: shared by all workers (0 = 75% of available memory)
+    explicit Converter(unsigned int threads = 0, size_t memory_budget_mb = 0);
+
+    unsigned int thread_count() const { return threads; }
+    size_t memory_budget_mb() const { return memory_budget; }
+
+    // Convert an in-memory HEIF image to an in-memory JPEG (runs on the calling thread).
+    // The input buffer is not copied and must stay valid for the duration of the call.
+    std::vector<uint8_t> convert(const uint8_t* heif_data, size_t heif_size, const Options& options = {}) const;
+    std::vector<uint8_t> convert(const std::vector<uint8_t>& heif_data, const Options& options = {}) const;
+
+    // Convert files on the worker pool, smallest images first. Blocks until all are done.
+    // Throws std::runtime_error if the journal or tensor shard cannot be opened or written.
+    BatchSummary convert_batch(const std::vector<BatchItem>& items, const BatchOptions& options,
+                               const CompletionCallback& on_complete = nullptr) const;
+
+private:
+    unsigned int threads;
+    size_t memory_budget;
+};
+
+// Worker pool that stays up between jobs, for long-running processes such as a server.
+// Threads are started once and wait for work; queued jobs still run smallest first.
+// The journal, dedup, all_images and tensor settings of BatchOptions are not used, and output
+// existence is checked against the live filesystem rather than a snapshot taken at startup.
+class ConversionService {
+public:
+    // on_complete is invoked from worker threads as each submitted job finishes
+    ConversionService(const Converter& converter, const BatchOptions& options, CompletionCallback on_complete);
+    ~ConversionService();   // Finishes the queued jobs, then stops the workers
+
+    ConversionService(const ConversionService&) = delete;
+    ConversionService& operator=(const ConversionService&) = delete;
+
+    // Queue a job and return immediately (thread-safe)
+    void submit(const BatchItem& item);
+
+    // Jobs waiting for a worker
+    size_t queued() const;
+
+    BatchSummary summary() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Route library messages (progress, warnings, errors). Process-wide; default discards them.
+void set_log_handler(LogCallback handler);
+
+// Latency distribution of one stage (or of whole jobs) in milliseconds
+struct LatencyStats {
+    uint64_t count = 0;
+    double p50_ms = 0;
+    double p90_ms = 0;
+    double p99_ms = 0;
+    double max_ms = 0;
+};
+
+struct StageLatency {
+    std::string stage;          // read, metadata, decode, encode, write or job
+    std::string size_bucket;    // all, <1MP, 1-8MP, 8-24MP or >=24MP
+    LatencyStats latency;
+};
+
+// Throughput and latency of the converted images since set_metrics(true)
+struct RunMetrics {
+    uint64_t images = 0;
+    double megapixels = 0;
+    uint64_t output_bytes = 0;
+    double active_seconds = 0;          // First job start to last job end
+    double images_per_second = 0;       // Sustained over active_seconds
+    double megapixels_per_second = 0;
+    unsigned int workers = 0;
+    double worker_utilization = 0;      // Time spent in jobs / (workers * active_seconds)
+    LatencyStats queue_wait;            // Queued until picked up by a worker (all jobs)
+    std::vector<StageLatency> latencies; // Every stage over all sizes, then jobs per size bucket
+};
+
+// Collect run metrics (histograms with ~3% resolution). Process-wide; off by default.
+// Enabling again resets them, so call it between batches.
+void set_metrics(bool enabled);
+RunMetrics run_metrics();
+
+// Stage timing. While enabled, every conversion records scoped timers per job and per
+// thread (read, metadata, decode, encode, write; estimate and hash while queueing).
+// Process-wide; off by default. Enabling again discards the events recorded so far.
+void set_tracing(bool enabled);
+
+// Write the recorded events as Chrome/Perfetto trace-event JSON (chrome://tracing,
+// ui.perfetto.dev). Throws std::runtime_error if the file cannot be written.
+void write_trace(const fs::path& path);
+
+// System probes used for the defaults above
+unsigned int performance_core_count();
+size_t available_memory_mb();
+
+} // namespace heif2jpeg
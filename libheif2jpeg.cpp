@@ -0,0 +1,5552 @@
+#include "heif2jpeg.h"
+
+#include <vector>         // std::vector
+#include <string>         // std::string
+#include <filesystem>     // C++17 paths
+#include <stdexcept>      // Exceptions
+#include <algorithm>      // std::transform
+#include <cctype>         // ::tolower
+#include <thread>         // std::thread
+#include <mutex>          // std::mutex
+#include <condition_variable> // Idle workers of a long-running pool
+#include <atomic>         // std::atomic
+#include <sstream>        // std::stringstream
+#include <queue>          // std::priority_queue
+#include <deque>          // Helper pool tickets
+#include <cmath>          // std::ceil
+#include <cstring>        // memcpy, strlen
+#include <unordered_map>  // journal index
+#include <unordered_set>  // output directory listings
+#include <memory>         // std::unique_ptr
+#include <functional>     // std::function
+#include <cinttypes>      // PRIx64 for journal records
+#include <chrono>         // Stage timers
+#include <fstream>        // Trace output
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>   // for sysctlbyname (macOS specific)
+#include <mach/mach.h>    // for memory stats on macOS
+#endif
+
+#include <sys/stat.h>     // stat (single syscall for size + mtime)
+#include <sys/mman.h>     // mmap of inputs and for content hashing
+#include <sys/ioctl.h>    // ioctl (reflink clones on Linux)
+#include <fcntl.h>        // open
+#include <unistd.h>       // close, read, write
+#include <dirent.h>       // opendir/readdir
+
+#ifdef __APPLE__
+#include <sys/clonefile.h> // clonefile (APFS reflinks)
+#endif
+#ifdef __linux__
+#include <linux/fs.h>     // FICLONE
+#endif
+
+#include <libheif/heif.h> // HEIF decoding
+#if LIBHEIF_HAVE_VERSION(1, 18, 0)
+#include <libheif/heif_properties.h> // irot/imir/clap of an image item
+#endif
+#include <jpeglib.h>      // JPEG encoding
+#include <jerror.h>       // libjpeg error codes (pooled memory manager)
+#if defined(__SSE2__)
+#include <emmintrin.h>    // SSE2 sample reduction and alpha compositing
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>     // NEON sample reduction and alpha compositing
+#endif
+#include <cstdio>         // fopen, fclose
+#include <csetjmp>        // libjpeg error handling
+#include <cerrno>         // errno
+#include <csignal>        // kill (owners of temporary outputs)
+
+namespace heif2jpeg {
+
+// Thread-safe log output, forwarded to the handler installed with set_log_handler()
+std::mutex console_mutex;
+LogCallback log_handler;
+std::atomic<bool> has_log_handler{false};
+
+void set_log_handler(LogCallback handler) {
+    std::lock_guard<std::mutex> lock(console_mutex);
+    has_log_handler = static_cast<bool>(handler);
+    log_handler = std::move(handler);
+}
+
+// Per-job progress messages are only formatted when someone is listening
+bool log_enabled() {
+    return has_log_handler.load(std::memory_order_relaxed);
+}
+
+void thread_safe_print(const std::string& message) {
+    std::lock_guard<std::mutex> lock(console_mutex);
+    if (log_handler) log_handler(message);
+}
+
+// Custom error handler for libjpeg. Nothing goes to stderr: the message of a fatal error is
+// kept for the job's error, and warnings go to the log handler.
+struct JpegErrorManager {
+    jpeg_error_mgr pub;  // Standard error manager
+    jmp_buf setjmp_buffer; // For longjmp on error
+    char message[JMSG_LENGTH_MAX] = "";  // Text of the last error
+};
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+    // Retrieve the custom error manager
+    JpegErrorManager* err = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+    // Keep the message for the caller
+    (*cinfo->err->format_message)(cinfo, err->message);
+    // Jump back to the setjmp point
+    longjmp(err->setjmp_buffer, 1);
+}
+
+// Warnings that libjpeg's emit_message() chooses to show
+void jpeg_output_message(j_common_ptr cinfo) {
+    char text[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, text);
+    thread_safe_print(std::string("Warning: libjpeg: ") + text);
+}
+
+// The job error for a failed libjpeg call, with libjpeg's own message
+std::string libjpeg_error(const JpegErrorManager& jerr, const std::string& during) {
+    std::string error = "libjpeg encountered an error " + during;
+    return jerr.message[0] ? error + ": " + jerr.message : error + ".";
+}
+
+// === Stage timing: trace events and run metrics ===
+// Scoped timers around each stage of a job. With tracing on they record complete events
+// into per-thread buffers, which write_trace() emits as Chrome trace-event JSON. With
+// metrics on, the stage times of each converted job go into latency histograms by image
+// size. While both are off a timer costs two atomic loads.
+
+// Stages of a job; timers with a name only (estimate, hash) appear in the trace alone
+enum Stage { STAGE_READ, STAGE_METADATA, STAGE_DECODE, STAGE_ENCODE, STAGE_WRITE, STAGE_JOB, STAGE_COUNT };
+const char* const STAGE_NAMES[STAGE_COUNT] = {"read", "metadata", "decode", "encode", "write", "job"};
+
+// Image size buckets of the latency histograms (megapixels)
+const int SIZE_BUCKET_COUNT = 4;
+const char* const SIZE_BUCKET_NAMES[SIZE_BUCKET_COUNT] = {"<1MP", "1-8MP", "8-24MP", ">=24MP"};
+
+int size_bucket(double megapixels) {
+    return megapixels < 1 ? 0 : megapixels < 8 ? 1 : megapixels < 24 ? 2 : 3;
+}
+
+uint64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear histogram of microsecond values in the style of HdrHistogram: 32 linear
+// sub-buckets per power of two, so any recorded value is known to within 3%.
+// Recording is a relaxed atomic increment and safe from any thread.
+class LatencyHistogram {
+private:
+    static const int SUB_BITS = 5;
+    static const int BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> max_value{0};
+
+    static int index_of(uint64_t value) {
+        if (value < (1u << SUB_BITS)) return static_cast<int>(value);
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift << SUB_BITS) + static_cast<int>(value >> shift);
+    }
+
+    // Largest value that falls into a bucket
+    static uint64_t highest_in(int index) {
+        if (index < (2 << SUB_BITS)) return static_cast<uint64_t>(index);
+        int shift = (index >> SUB_BITS) - 1;
+        uint64_t mantissa = static_cast<uint64_t>(index - (shift << SUB_BITS));
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() { clear(); }
+
+    void clear() {
+        for (auto& count : counts) count.store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        max_value.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t value_us) {
+        counts[index_of(value_us)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        uint64_t previous = max_value.load(std::memory_order_relaxed);
+        while (value_us > previous &&
+               !max_value.compare_exchange_weak(previous, value_us, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Percentiles of the given histograms merged into one
+    static LatencyStats stats(const std::vector<const LatencyHistogram*>& histograms) {
+        LatencyStats stats;
+        std::vector<uint64_t> merged(BUCKETS, 0);
+        uint64_t max_us = 0;
+        for (const LatencyHistogram* histogram : histograms) {
+            for (int i = 0; i < BUCKETS; i++) {
+                merged[i] += histogram->counts[i].load(std::memory_order_relaxed);
+            }
+            max_us = std::max(max_us, histogram->max_value.load(std::memory_order_relaxed));
+        }
+        for (uint64_t count : merged) stats.count += count;
+        if (stats.count == 0) return stats;
+
+        const double percentiles[3] = {0.50, 0.90, 0.99};
+        double* results[3] = {&stats.p50_ms, &stats.p90_ms, &stats.p99_ms};
+        for (int p = 0; p < 3; p++) {
+            uint64_t rank = static_cast<uint64_t>(std::ceil(percentiles[p] * stats.count));
+            uint64_t seen = 0;
+            for (int i = 0; i < BUCKETS; i++) {
+                seen += merged[i];
+                if (seen >= rank) {
+                    *results[p] = std::min(highest_in(i), max_us) / 1000.0;
+                    break;
+                }
+            }
+        }
+        stats.max_ms = max_us / 1000.0;
+        return stats;
+    }
+};
+
+// Process-wide run metrics, reset by set_metrics(true)
+struct MetricsState {
+    std::atomic<bool> enabled{false};
+    LatencyHistogram stages[STAGE_COUNT][SIZE_BUCKET_COUNT];
+    LatencyHistogram queue_wait;
+    std::atomic<uint64_t> images{0};
+    std::atomic<uint64_t> kilopixels{0};
+    std::atomic<uint64_t> output_bytes{0};
+    std::atomic<uint64_t> busy_ns{0};               // Sum of job times on all workers
+    std::atomic<uint64_t> first_start_ns{UINT64_MAX};
+    std::atomic<uint64_t> last_end_ns{0};
+    std::atomic<unsigned int> workers{0};
+};
+
+MetricsState& metrics_state() {
+    static MetricsState state;
+    return state;
+}
+
+bool metrics_enabled() {
+    return metrics_state().enabled.load(std::memory_order_acquire);
+}
+
+// Stage times of the job running on this thread, committed when its job timer ends
+struct JobTiming {
+    uint64_t stage_ns[STAGE_COUNT];
+    double megapixels;
+    uint64_t output_bytes;
+    bool converted;
+};
+
+JobTiming& current_job_timing() {
+    thread_local JobTiming timing;
+    return timing;
+}
+
+// Called once a job's output is complete; only converted jobs count towards latencies
+void mark_job_converted(uint64_t output_bytes) {
+    JobTiming& timing = current_job_timing();
+    timing.converted = true;
+    timing.output_bytes = output_bytes;
+}
+
+void commit_job_timing(uint64_t start_ns, uint64_t end_ns) {
+    JobTiming& timing = current_job_timing();
+    MetricsState& metrics = metrics_state();
+    metrics.busy_ns.fetch_add(end_ns - start_ns, std::memory_order_relaxed);
+    uint64_t previous = metrics.first_start_ns.load(std::memory_order_relaxed);
+    while (start_ns < previous &&
+           !metrics.first_start_ns.compare_exchange_weak(previous, start_ns, std::memory_order_relaxed)) {
+    }
+    previous = metrics.last_end_ns.load(std::memory_order_relaxed);
+    while (end_ns > previous &&
+           !metrics.last_end_ns.compare_exchange_weak(previous, end_ns, std::memory_order_relaxed)) {
+    }
+    if (!timing.converted) return;
+
+    int bucket = size_bucket(timing.megapixels);
+    timing.stage_ns[STAGE_JOB] = end_ns - start_ns;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        metrics.stages[stage][bucket].record(timing.stage_ns[stage] / 1000);
+    }
+    metrics.images.fetch_add(1, std::memory_order_relaxed);
+    metrics.kilopixels.fetch_add(static_cast<uint64_t>(timing.megapixels * 1000), std::memory_order_relaxed);
+    metrics.output_bytes.fetch_add(timing.output_bytes, std::memory_order_relaxed);
+}
+
+// Workers of the current batch, for the utilization figure
+void note_worker_count(unsigned int workers) {
+    std::atomic<unsigned int>& current = metrics_state().workers;
+    unsigned int previous = current.load(std::memory_order_relaxed);
+    while (workers > previous && !current.compare_exchange_weak(previous, workers, std::memory_order_relaxed)) {
+    }
+}
+
+void record_queue_wait(uint64_t queued_ns) {
+    if (queued_ns == 0 || !metrics_enabled()) return;
+    metrics_state().queue_wait.record((monotonic_ns() - queued_ns) / 1000);
+}
+
+void set_metrics(bool enabled) {
+    MetricsState& metrics = metrics_state();
+    if (enabled) {
+        for (auto& stage : metrics.stages) {
+            for (auto& histogram : stage) histogram.clear();
+        }
+        metrics.queue_wait.clear();
+        metrics.images = 0;
+        metrics.kilopixels = 0;
+        metrics.output_bytes = 0;
+        metrics.busy_ns = 0;
+        metrics.first_start_ns = UINT64_MAX;
+        metrics.last_end_ns = 0;
+        metrics.workers = 0;
+    }
+    metrics.enabled.store(enabled, std::memory_order_release);
+}
+
+RunMetrics run_metrics() {
+    MetricsState& state = metrics_state();
+    RunMetrics metrics;
+    metrics.images = state.images.load();
+    metrics.megapixels = state.kilopixels.load() / 1000.0;
+    metrics.output_bytes = state.output_bytes.load();
+    metrics.workers = state.workers.load();
+    uint64_t first = state.first_start_ns.load(), last = state.last_end_ns.load();
+    if (last > first) {
+        metrics.active_seconds = (last - first) / 1e9;
+        metrics.images_per_second = metrics.images / metrics.active_seconds;
+        metrics.megapixels_per_second = metrics.megapixels / metrics.active_seconds;
+        if (metrics.workers > 0) {
+            metrics.worker_utilization = state.busy_ns.load() / (1e9 * metrics.active_seconds * metrics.workers);
+        }
+    }
+    metrics.queue_wait = LatencyHistogram::stats({&state.queue_wait});
+
+    // Each stage over all sizes, then the whole job per size bucket
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        std::vector<const LatencyHistogram*> all_sizes;
+        for (int bucket = 0; bucket < SIZE_BUCKET_COUNT; bucket++) all_sizes.push_back(&state.stages[stage][bucket]);
+        metrics.latencies.push_back({STAGE_NAMES[stage], "all", LatencyHistogram::stats(all_sizes)});
+    }
+    for (int bucket = 0; bucket < SIZE_BUCKET_COUNT; bucket++) {
+        LatencyStats stats = LatencyHistogram::stats({&state.stages[STAGE_JOB][bucket]});
+        if (stats.count > 0) metrics.latencies.push_back({"job", SIZE_BUCKET_NAMES[bucket], stats});
+    }
+    return metrics;
+}
+
+struct TraceEvent {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    std::string detail;     // Input file of job, estimate and hash events
+};
+
+struct TraceBuffer {
+    std::mutex mutex;       // Only contended while the trace is being written
+    std::vector<TraceEvent> events;
+    int tid = 0;
+};
+
+std::atomic<bool> tracing_enabled{false};
+std::mutex trace_registry_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;   // Never shrinks: threads keep pointers
+std::atomic<uint64_t> trace_epoch_ns{0};
+
+bool tracing() {
+    return tracing_enabled.load(std::memory_order_acquire);
+}
+
+TraceBuffer& thread_trace_buffer() {
+    thread_local TraceBuffer* buffer = nullptr;
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(trace_registry_mutex);
+        trace_buffers.push_back(std::make_unique<TraceBuffer>());
+        buffer = trace_buffers.back().get();
+        buffer->tid = static_cast<int>(trace_buffers.size());
+    }
+    return *buffer;
+}
+
+// Times the enclosing scope. Must not be crossed by a libjpeg longjmp, so timers
+// around compression are declared before setjmp().
+class TraceScope {
+private:
+    const char* name;
+    int stage = -1;         // Stage for the run metrics (-1 = trace only)
+    uint64_t start_ns = 0;
+    bool trace;
+    bool metrics;
+    std::string detail;
+
+public:
+    explicit TraceScope(const char* name) : name(name), trace(tracing()), metrics(false) {
+        if (trace) start_ns = monotonic_ns();
+    }
+    TraceScope(const char* name, const fs::path& file) : TraceScope(name) {
+        if (trace) detail = file.string();
+    }
+    explicit TraceScope(Stage job_stage) : name(STAGE_NAMES[job_stage]), stage(job_stage),
+                                           trace(tracing()), metrics(metrics_enabled()) {
+        if (trace || metrics) start_ns = monotonic_ns();
+        if (metrics && stage == STAGE_JOB) {
+            current_job_timing() = JobTiming{};
+        }
+    }
+    // Job timer: the input names the job in the trace
+    TraceScope(Stage job_stage, const fs::path& file) : TraceScope(job_stage) {
+        if (trace) detail = file.string();
+    }
+    ~TraceScope() { end(); }
+
+    // Record the stage now rather than at the end of the scope
+    void end() {
+        if (!trace && !metrics) return;
+        uint64_t end_ns = monotonic_ns();
+        if (metrics) {
+            metrics = false;
+            if (stage == STAGE_JOB) {
+                commit_job_timing(start_ns, end_ns);
+            } else {
+                current_job_timing().stage_ns[stage] += end_ns - start_ns;
+            }
+        }
+        if (trace) {
+            trace = false;
+            uint64_t epoch_ns = trace_epoch_ns.load(std::memory_order_relaxed);
+            uint64_t relative_ns = start_ns > epoch_ns ? start_ns - epoch_ns : 0;
+            TraceBuffer& buffer = thread_trace_buffer();
+            std::lock_guard<std::mutex> lock(buffer.mutex);
+            buffer.events.push_back({name, relative_ns, end_ns - start_ns, std::move(detail)});
+        }
+    }
+    // Prevent copying
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+void set_tracing(bool enabled) {
+    if (enabled) {
+        std::lock_guard<std::mutex> lock(trace_registry_mutex);
+        for (auto& buffer : trace_buffers) {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            buffer->events.clear();
+        }
+        trace_epoch_ns.store(monotonic_ns(), std::memory_order_relaxed);
+    }
+    tracing_enabled.store(enabled, std::memory_order_release);
+}
+
+std::string json_escape(const std::string& text) {
+    std::string out;
+    out.reserve(text.size());
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    return out;
+}
+
+void write_trace(const fs::path& path) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Cannot open trace file '" + path.string() + "': " + std::strerror(errno));
+    }
+
+    int pid = static_cast<int>(getpid());
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    char line[256];
+    std::lock_guard<std::mutex> lock(trace_registry_mutex);
+    for (auto& buffer : trace_buffers) {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        if (buffer->events.empty()) continue;
+        snprintf(line, sizeof(line),
+                 "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                 first ? "" : ",", pid, buffer->tid, buffer->tid);
+        out << line;
+        first = false;
+        for (const auto& event : buffer->events) {
+            // Microsecond timestamps with nanosecond fractions
+            snprintf(line, sizeof(line),
+                     ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                     event.name, strcmp(event.name, "job") == 0 ? "job" : "stage", pid, buffer->tid,
+                     event.start_ns / 1000.0, event.duration_ns / 1000.0);
+            out << line;
+            if (!event.detail.empty()) {
+                out << ",\"args\":{\"input\":\"" << json_escape(event.detail) << "\"}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+    out.flush();
+    if (!out) {
+        throw std::runtime_error("Failed to write trace file '" + path.string() + "'");
+    }
+}
+
+// Bump allocator for per-image scratch data. reset() makes all of it reusable for
+// the next image, so once a worker has seen its largest image it stops allocating.
+class ScratchArena {
+private:
+    struct Block {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t block_index = 0;   // Block currently being filled
+    size_t offset = 0;        // Bytes used in that block
+
+public:
+    // 16-byte aligned, valid until the next reset()
+    uint8_t* allocate(size_t size) {
+        size = (size + 15) & ~static_cast<size_t>(15);
+        while (block_index < blocks.size()) {
+            if (offset + size <= blocks[block_index].size) {
+                uint8_t* p = blocks[block_index].data.get() + offset;
+                offset += size;
+                return p;
+            }
+            block_index++;
+            offset = 0;
+        }
+        size_t block_size = std::max<size_t>(size, blocks.empty() ? 64 * 1024 : blocks.back().size * 2);
+        blocks.push_back({std::unique_ptr<uint8_t[]>(new uint8_t[block_size]), block_size});
+        block_index = blocks.size() - 1;
+        offset = size;
+        return blocks.back().data.get();
+    }
+
+    size_t capacity() const {
+        size_t total = 0;
+        for (const auto& block : blocks) total += block.size;
+        return total;
+    }
+
+    // Free the blocks themselves (between images)
+    void release() {
+        blocks.clear();
+        block_index = 0;
+        offset = 0;
+    }
+
+    // Release everything at once. An image that needed several blocks leaves one block
+    // of their combined size behind, so the next image of that size fits in it.
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t total = 0;
+            for (const auto& block : blocks) total += block.size;
+            blocks.clear();
+            blocks.push_back({std::unique_ptr<uint8_t[]>(new uint8_t[total]), total});
+        }
+        block_index = 0;
+        offset = 0;
+    }
+};
+
+// Metadata block ready to be written as one JPEG marker
+struct MetadataBlock {
+    int marker;                 // JPEG_APP0 + n
+    uint8_t* data;              // Marker payload in arena storage, header included
+    size_t size;
+};
+
+const char XMP_NAMESPACE[] = "http://ns.adobe.com/xap/1.0/";   // Written with its NUL terminator
+const size_t MAX_MARKER_PAYLOAD = 65533;                        // 0xFFFF minus the length field
+
+bool is_tiff_header(const uint8_t* p, size_t size) {
+    return size >= 4 && ((p[0] == 'I' && p[1] == 'I' && p[2] == 42 && p[3] == 0) ||
+                         (p[0] == 'M' && p[1] == 'M' && p[2] == 0 && p[3] == 42));
+}
+
+// Reads the Exif, XMP and IPTC blocks of the image into 'arena' (replacing the contents of
+// 'metadata_blocks'). Each block is read once, into a buffer with room for its marker header
+// in front, so it can be written with a single jpeg_write_marker() without further copies.
+void extract_metadata(heif_image_handle* handle, const std::string& source, ScratchArena& arena,
+                      std::vector<heif_item_id>& metadata_ids, std::vector<MetadataBlock>& metadata_blocks) {
+    metadata_blocks.clear();
+
+    int num_metadata_blocks = heif_image_handle_get_number_of_metadata_blocks(handle, nullptr);
+    if (num_metadata_blocks > 0) {
+        metadata_ids.resize(num_metadata_blocks);
+        heif_image_handle_get_list_of_metadata_block_IDs(handle, nullptr, metadata_ids.data(), num_metadata_blocks);
+
+        for (int i = 0; i < num_metadata_blocks; i++) {
+            heif_item_id metadata_id = metadata_ids[i];
+            const char* metadata_type = heif_image_handle_get_metadata_type(handle, metadata_id);
+            if (!metadata_type) continue;
+
+            // XMP is stored as a 'mime' item with an RDF/XML content type
+            bool is_exif = strcmp(metadata_type, "Exif") == 0;
+            bool is_xmp = strcmp(metadata_type, "XMP") == 0;
+            if (strcmp(metadata_type, "mime") == 0) {
+                const char* content_type = heif_image_handle_get_metadata_content_type(handle, metadata_id);
+                is_xmp = content_type && strcmp(content_type, "application/rdf+xml") == 0;
+            }
+            bool is_iptc = strcmp(metadata_type, "IPTC") == 0;
+            if (!is_exif && !is_xmp && !is_iptc) continue;
+
+            size_t metadata_size = heif_image_handle_get_metadata_size(handle, metadata_id);
+            if (metadata_size == 0) continue;
+
+            size_t header_size = is_exif ? 6 : is_xmp ? sizeof(XMP_NAMESPACE) : 0;
+            uint8_t* buffer = arena.allocate(header_size + metadata_size);
+            uint8_t* metadata_data = buffer + header_size;
+            heif_error err = heif_image_handle_get_metadata(handle, metadata_id, metadata_data);
+            if (err.code != heif_error_Ok) continue;
+
+            MetadataBlock block{JPEG_APP0 + 1, buffer, header_size + metadata_size};
+            if (is_exif) {
+                // HEIF Exif starts with a 4-byte big-endian offset to the TIFF header;
+                // APP1 wants "Exif\0\0" immediately followed by the TIFF header
+                size_t tiff_start = 0;
+                if (metadata_size >= 4) {
+                    uint32_t offset = (uint32_t(metadata_data[0]) << 24) | (uint32_t(metadata_data[1]) << 16) |
+                                      (uint32_t(metadata_data[2]) << 8) | metadata_data[3];
+                    if (offset <= metadata_size - 4 &&
+                        is_tiff_header(metadata_data + 4 + offset, metadata_size - 4 - offset)) {
+                        tiff_start = 4 + offset;
+                    }
+                }
+                if (tiff_start == 0 && metadata_size >= 6 && memcmp(metadata_data, "Exif\0\0", 6) == 0) {
+                    block.data = metadata_data;         // Already has the APP1 header
+                    block.size = metadata_size;
+                } else if (tiff_start > 0 || is_tiff_header(metadata_data, metadata_size)) {
+                    uint8_t* header = metadata_data + tiff_start - 6;   // Inside the reserved space
+                    memcpy(header, "Exif\0\0", 6);
+                    block.data = header;
+                    block.size = 6 + metadata_size - tiff_start;
+                } else {
+                    thread_safe_print("Warning: Dropping unrecognized Exif block of '" + source + "'");
+                    continue;
+                }
+            } else if (is_xmp) {
+                memcpy(buffer, XMP_NAMESPACE, sizeof(XMP_NAMESPACE));
+            } else {
+                block.marker = JPEG_APP0 + 13;
+                block.data = metadata_data;
+                block.size = metadata_size;
+            }
+
+            // One marker segment holds at most 65533 bytes; libjpeg rejects larger ones
+            if (block.size > MAX_MARKER_PAYLOAD) {
+                thread_safe_print("Warning: Dropping " + std::string(is_exif ? "Exif" : is_xmp ? "XMP" : "IPTC") +
+                                  " block of '" + source + "' (" + std::to_string(block.size) +
+                                  " bytes does not fit in a JPEG marker)");
+                continue;
+            }
+            metadata_blocks.push_back(block);
+        }
+    }
+}
+
+// The Orientation tag (0x0112) of an Exif block, read and patched in place
+struct ExifOrientation {
+    uint8_t* value = nullptr;   // The tag's SHORT value in the block, nullptr without one
+    bool big_endian = false;
+
+    int get() const { return big_endian ? (value[0] << 8) | value[1] : (value[1] << 8) | value[0]; }
+    void set(int orientation) {
+        value[big_endian ? 1 : 0] = static_cast<uint8_t>(orientation);
+        value[big_endian ? 0 : 1] = 0;
+    }
+};
+
+// Finds the Orientation tag in IFD0 of the Exif block among 'metadata_blocks'
+ExifOrientation find_exif_orientation(const std::vector<MetadataBlock>& metadata_blocks) {
+    ExifOrientation orientation;
+    for (const auto& block : metadata_blocks) {
+        if (block.marker != JPEG_APP0 + 1 || block.size < 6 + 8 || memcmp(block.data, "Exif\0\0", 6) != 0) continue;
+        uint8_t* tiff = block.data + 6;
+        size_t size = block.size - 6;
+        bool big_endian = tiff[0] == 'M';
+        auto u16 = [&](size_t at) {
+            return big_endian ? (tiff[at] << 8) | tiff[at + 1] : (tiff[at + 1] << 8) | tiff[at];
+        };
+        auto u32 = [&](size_t at) {
+            return big_endian ? (uint32_t(u16(at)) << 16) | u16(at + 2) : (uint32_t(u16(at + 2)) << 16) | u16(at);
+        };
+        size_t ifd = u32(4);
+        if (ifd > size - 2) continue;
+        size_t entries = u16(ifd);
+        for (size_t i = 0; i < entries && ifd + 2 + 12 * (i + 1) <= size; i++) {
+            size_t entry = ifd + 2 + 12 * i;
+            if (u16(entry) == 0x0112 && u16(entry + 2) == 3 && u32(entry + 4) == 1) {   // One SHORT
+                orientation.value = tiff + entry + 8;
+                orientation.big_endian = big_endian;
+                return orientation;
+            }
+        }
+    }
+    return orientation;
+}
+
+#if LIBHEIF_HAVE_VERSION(1, 18, 0)
+// Matrices mapping stored to displayed pixel coordinates (y down), by Exif orientation
+const int ORIENTATION_MATRICES[9][4] = {
+    {0, 0, 0, 0}, {1, 0, 0, 1}, {-1, 0, 0, 1}, {-1, 0, 0, -1}, {1, 0, 0, -1},
+    {0, 1, 1, 0}, {0, -1, 1, 0}, {0, -1, -1, 0}, {0, 1, -1, 0}};
+
+// The Exif orientation of applying 'first', then 'second'
+int compose_orientations(int first, int second) {
+    const int* a = ORIENTATION_MATRICES[second];
+    const int* b = ORIENTATION_MATRICES[first];
+    int m[4] = {a[0] * b[0] + a[1] * b[2], a[0] * b[1] + a[1] * b[3],
+                a[2] * b[0] + a[3] * b[2], a[2] * b[1] + a[3] * b[3]};
+    for (int value = 1; value <= 8; value++) {
+        if (std::equal(m, m + 4, ORIENTATION_MATRICES[value])) return value;
+    }
+    return 0;
+}
+
+// The irot/imir properties of an image item as one Exif orientation, in the order libheif
+// applies them; 0 with a crop (clap) or a property it cannot read
+int container_orientation(const heif_context* ctx, heif_item_id id) {
+    heif_property_id properties[8];
+    int count = heif_item_get_transformation_properties(ctx, id, properties, 8);
+    if (count >= 8) return 0;
+    int orientation = 1;
+    for (int i = 0; i < count; i++) {
+        int step = 0;
+        switch (heif_item_get_property_type(ctx, id, properties[i])) {
+        case heif_item_property_type_transform_rotation:
+            switch (heif_item_get_property_transform_rotation_ccw(ctx, id, properties[i])) {
+            case 0: step = 1; break;
+            case 90: step = 8; break;
+            case 180: step = 3; break;
+            case 270: step = 6; break;
+            }
+            break;
+        case heif_item_property_type_transform_mirror:
+            switch (heif_item_get_property_transform_mirror(ctx, id, properties[i])) {
+            case heif_transform_mirror_direction_horizontal: step = 2; break;
+            case heif_transform_mirror_direction_vertical: step = 4; break;
+            default: break;
+            }
+            break;
+        default:
+            break;
+        }
+        if (step == 0) return 0;
+        orientation = compose_orientations(orientation, step);
+    }
+    return orientation;
+}
+#endif
+
+// The Exif orientation when it describes how the image's stored pixels are to be displayed,
+// so decoding them with transformations ignored and applying the tag shows the same image;
+// 0 otherwise, and libheif applies the transformations. The tag is compared with the
+// irot/imir properties, which libheif reports from 1.18 on. Older versions give only the
+// stored (ispe) size, and a transposed size cannot tell orientations 5-8 apart, so there the
+// transformations are always left to libheif.
+int stored_orientation(heif_context* ctx, heif_image_handle* handle, const ExifOrientation& orientation) {
+#if LIBHEIF_HAVE_VERSION(1, 18, 0)
+    if (!orientation.value) return 0;
+    int value = orientation.get();
+    if (value < 1 || value > 8) return 0;
+    return container_orientation(ctx, heif_image_handle_get_item_id(handle)) == value ? value : 0;
+#else
+    (void)ctx;
+    (void)handle;
+    (void)orientation;
+    return 0;
+#endif
+}
+
+// Preserve metadata in JPEG
+void preserve_metadata(jpeg_compress_struct& cinfo, const std::vector<MetadataBlock>& metadata_blocks) {
+    for (const auto& block : metadata_blocks) {
+        jpeg_write_marker(&cinfo, block.marker, block.data, static_cast<unsigned int>(block.size));
+    }
+}
+
+// Add these RAII-style wrappers for safer resource management
+class HeifContextGuard {
+private:
+    heif_context* ctx;
+public:
+    HeifContextGuard() : ctx(heif_context_alloc()) {}
+    ~HeifContextGuard() { if (ctx) heif_context_free(ctx); }
+    heif_context* get() { return ctx; }
+    operator bool() const { return ctx != nullptr; }
+    // Prevent copying
+    HeifContextGuard(const HeifContextGuard&) = delete;
+    HeifContextGuard& operator=(const HeifContextGuard&) = delete;
+};
+
+class HeifImageHandleGuard {
+private:
+    heif_image_handle* handle;
+public:
+    HeifImageHandleGuard() : handle(nullptr) {}
+    explicit HeifImageHandleGuard(heif_image_handle* h) : handle(h) {}
+    ~HeifImageHandleGuard() { if (handle) heif_image_handle_release(handle); }
+    heif_image_handle* get() { return handle; }
+    operator bool() const { return handle != nullptr; }
+    void reset(heif_image_handle* h) { 
+        if (handle) heif_image_handle_release(handle);
+        handle = h;
+    }
+    // Prevent copying
+    HeifImageHandleGuard(const HeifImageHandleGuard&) = delete;
+    HeifImageHandleGuard& operator=(const HeifImageHandleGuard&) = delete;
+};
+
+class HeifImageGuard {
+private:
+    heif_image* image;
+public:
+    HeifImageGuard() : image(nullptr) {}
+    explicit HeifImageGuard(heif_image* img) : image(img) {}
+    ~HeifImageGuard() { if (image) heif_image_release(image); }
+    heif_image* get() { return image; }
+    operator bool() const { return image != nullptr; }
+    void reset(heif_image* img) {
+        if (image) heif_image_release(image);
+        image = img;
+    }
+    // Prevent copying
+    HeifImageGuard(const HeifImageGuard&) = delete;
+    HeifImageGuard& operator=(const HeifImageGuard&) = delete;
+};
+
+class FileGuard {
+private:
+    FILE* file;
+public:
+    explicit FileGuard(FILE* f) : file(f) {}
+    ~FileGuard() { if (file) fclose(file); }
+    FILE* get() { return file; }
+    operator bool() const { return file != nullptr; }
+    // Prevent copying
+    FileGuard(const FileGuard&) = delete;
+    FileGuard& operator=(const FileGuard&) = delete;
+};
+
+class MappingGuard {
+private:
+    void* addr;
+    size_t length;
+public:
+    MappingGuard(void* a, size_t len) : addr(a), length(len) {}
+    ~MappingGuard() { if (addr != MAP_FAILED) munmap(addr, length); }
+    const uint8_t* data() const { return static_cast<const uint8_t*>(addr); }
+    size_t size() const { return length; }
+    // Prevent copying
+    MappingGuard(const MappingGuard&) = delete;
+    MappingGuard& operator=(const MappingGuard&) = delete;
+};
+
+// A HEIF file mapped and parsed once, shared by the jobs converting its images
+// (--all-images). libheif reads the mapping in place, so the context is freed first.
+struct SharedHeif {
+    MappingGuard mapping;
+    HeifContextGuard ctx;
+
+    SharedHeif(void* data, size_t size) : mapping(data, size) {}
+};
+
+// Structure to hold image processing information with memory requirements
+struct ImageJob {
+    fs::path input_path;
+    fs::path output_path;
+    size_t estimated_memory_mb = 0;
+    
+    // Caller-owned descriptors replacing the paths (-1 = use the paths)
+    int input_fd = -1;
+    int output_fd = -1;
+    uint64_t tag = 0;
+    uint64_t queued_ns = 0;          // When the job entered the queue (run metrics)
+
+    // Input identity captured at queue time (for the completion journal)
+    std::string journal_key;
+    uint64_t input_size = 0;
+    int64_t input_mtime_ns = 0;
+    uint64_t content_hash = 0;       // Set when deduplication is enabled
+
+    // Byte-identical inputs whose outputs are linked to this job's output
+    std::vector<ImageJob> duplicates;
+
+    // One image of a multi-image file (--all-images): the parsed file shared by the jobs of
+    // its images, and the image's item ID
+    std::shared_ptr<SharedHeif> container;
+    heif_item_id image_id = 0;
+
+    size_t record = 0;               // Tensor shard record the job writes (tensor output)
+
+    // For sorting in priority queue (process smaller images first)
+    bool operator<(const ImageJob& other) const {
+        return estimated_memory_mb > other.estimated_memory_mb;
+    }
+};
+
+// Get available system memory in MB
+size_t available_memory_mb() {
+    size_t available_memory = 0;
+    
+#ifdef __APPLE__
+    // macOS implementation
+    mach_port_t host_port = mach_host_self();
+    mach_msg_type_number_t host_size = sizeof(vm_statistics64_data_t) / sizeof(integer_t);
+    vm_size_t page_size;
+    vm_statistics64_data_t vm_stats;
+    
+    host_page_size(host_port, &page_size);
+    if (host_statistics64(host_port, HOST_VM_INFO64, 
+                        (host_info64_t)&vm_stats, &host_size) == KERN_SUCCESS) {
+        available_memory = (vm_stats.free_count + vm_stats.inactive_count) * page_size;
+    }
+#else
+    // Fallback for non-macOS: assume 8GB system with 4GB available
+    available_memory = 4ULL * 1024 * 1024 * 1024;
+#endif
+
+    // Convert to MB and return
+    return available_memory / (1024 * 1024);
+}
+
+// Estimate memory needed for converting one image of a parsed file
+size_t estimate_image_memory(heif_image_handle* handle, bool saved_coefficients,
+                             const std::vector<Rendition>& renditions = {}) {
+    // Get dimensions
+    int width = heif_image_handle_get_width(handle);
+    int height = heif_image_handle_get_height(handle);
+    
+    // Calculate memory requirements
+    // 1. RGB decoded image: width * height * 3 bytes (4 with alpha), twice that above 8 bits
+    //    per sample (reduced to 8 bits a band at a time while encoding)
+    size_t sample_bytes = heif_image_handle_get_luma_bits_per_pixel(handle) > 8 ? 2 : 1;
+    size_t channels = heif_image_handle_has_alpha_channel(handle) ? 4 : 3;
+    size_t rgb_memory = static_cast<size_t>(width) * height * channels * sample_bytes;
+    
+    // 2. JPEG compression buffer (conservative estimate)
+    size_t jpeg_memory = width * height * 4; // Usually smaller, but allocate extra space
+    
+    // 3. Metadata and additional overhead (estimate: 10MB)
+    size_t overhead_memory = 10 * 1024 * 1024;
+    
+    // 4. Target size/SSIM search and lossless rotation: the coefficients of the image are held
+    //    twice (saved copy and libjpeg's arrays, 2 bytes each, 1.5 per pixel with 4:2:0), plus
+    //    a second JPEG
+    if (saved_coefficients) {
+        overhead_memory += static_cast<size_t>(width) * height * (3 + 3 + 4);
+    }
+
+    // 5. Renditions: a downscaled RGB copy and a JPEG buffer each (full-size ones encode from
+    //    the decoded image)
+    for (const auto& rendition : renditions) {
+        double scale = rendition.max_side > 0 ? std::min(1.0, static_cast<double>(rendition.max_side) /
+                                                                  std::max(width, height)) : 1.0;
+        size_t pixels = static_cast<size_t>(width * scale) * static_cast<size_t>(height * scale);
+        overhead_memory += pixels * (scale < 1 ? 3 + 4 : 4);
+    }
+    
+    // Convert to MB with some safety margin (1.5x)
+    return static_cast<size_t>(
+        std::ceil((rgb_memory + jpeg_memory + overhead_memory) * 1.5 / (1024 * 1024))
+    );
+}
+
+// Estimate memory needed for processing an image
+size_t estimate_memory_requirement(const fs::path& image_path, heif_context* ctx = nullptr,
+                                   bool saved_coefficients = false, const std::vector<Rendition>& renditions = {}) {
+    size_t total_memory_mb = 0;
+    
+    // Create a context if one wasn't provided
+    HeifContextGuard local_ctx;
+    if (!ctx) {
+        ctx = local_ctx.get();
+        if (!ctx) return 0;
+        
+        heif_error err = heif_context_read_from_file(ctx, image_path.c_str(), nullptr);
+        if (err.code != heif_error_Ok) return 0;
+    }
+    
+    // Get primary image handle
+    heif_image_handle* handle = nullptr;
+    heif_error err = heif_context_get_primary_image_handle(ctx, &handle);
+    if (err.code != heif_error_Ok || !handle) {
+        if (handle) heif_image_handle_release(handle);
+        return 0;
+    }
+    
+    total_memory_mb = estimate_image_memory(handle, saved_coefficients, renditions);
+    
+    // Clean up if locally created
+    if (handle) heif_image_handle_release(handle);
+    
+    return total_memory_mb;
+}
+
+// libjpeg memory manager that serves the per-image pool from a reusable slab.
+// libjpeg allocates its working buffers (component rows, coefficient buffers, and the
+// whole-image coefficient arrays of progressive and optimized output) in JPOOL_IMAGE and
+// frees them with free_pool() once the image is done. Here those requests are bump
+// allocations in one slab owned by the thread's conversion context. Requests that do not
+// fit are served separately for that image, and the slab then grows to the largest
+// image seen, so steady-state encoding makes no allocator calls; release_slab() returns it
+// when the thread keeps more than its share of memory (see trim_conversion_context()). Large
+// slabs are backed by transparent huge pages where available. Virtual arrays are always kept
+// in memory.
+// The permanent pool (tables) stays with libjpeg's own manager.
+class PooledJpegMemory {
+private:
+    // A virtual array, realized as an ordinary in-memory array
+    struct VirtualArray {
+        void** rows = nullptr;          // JSAMPROW or JBLOCKROW pointers
+        size_t row_bytes = 0;
+        JDIMENSION row_count = 0;
+        bool pre_zero = false;
+        bool blocks = false;            // Coefficient (JBLOCK) array
+        VirtualArray* next = nullptr;
+    };
+
+    jpeg_memory_mgr pub;                    // Must stay first: libjpeg only sees this
+    jpeg_memory_mgr* original = nullptr;    // libjpeg's manager, kept for the permanent pool
+
+    uint8_t* slab = nullptr;
+    size_t slab_size = 0;
+    size_t slab_mapping_size = 0;
+    void* slab_mapping = nullptr;
+    size_t slab_used = 0;
+    size_t image_bytes = 0;                 // Requested by the current image
+    size_t high_water = 0;                  // Requested by the largest image so far
+    std::vector<void*> overflow;            // Current image's requests that missed the slab
+    VirtualArray* virtual_arrays = nullptr; // Current image's virtual arrays
+
+    static const size_t ALIGNMENT = 64;     // Cache line; covers libjpeg-turbo's SIMD alignment
+    static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+    static PooledJpegMemory* self(j_common_ptr cinfo) {
+        return reinterpret_cast<PooledJpegMemory*>(cinfo->mem);
+    }
+
+    // Call libjpeg's manager, which expects to find itself in cinfo->mem.
+    // (No RAII restore: libjpeg errors longjmp past destructors; reattach() covers that case.)
+    template <typename Call>
+    auto delegate(j_common_ptr cinfo, Call call) -> decltype(call(original)) {
+        cinfo->mem = original;
+        auto result = call(original);
+        cinfo->mem = &pub;
+        return result;
+    }
+
+    void* allocate(j_common_ptr cinfo, size_t size) {
+        size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        image_bytes += size;
+        if (slab_used + size <= slab_size) {
+            void* p = slab + slab_used;
+            slab_used += size;
+            return p;
+        }
+        void* p = nullptr;
+        if (posix_memalign(&p, ALIGNMENT, size) != 0) {
+            ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+        }
+        overflow.push_back(p);
+        return p;
+    }
+
+    void unmap_slab() {
+        if (slab_mapping) munmap(slab_mapping, slab_mapping_size);
+        slab = nullptr;
+        slab_mapping = nullptr;
+        slab_size = slab_mapping_size = 0;
+    }
+
+    // Replace the slab with one that holds 'size' bytes
+    void grow_slab(size_t size) {
+        unmap_slab();
+        bool huge = size >= HUGE_PAGE;
+        size_t granule = huge ? HUGE_PAGE : 64 * 1024;
+        size = (size + granule - 1) / granule * granule;
+
+        // Over-map by one huge page so the slab can start on a huge page boundary
+        size_t mapping_size = huge ? size + HUGE_PAGE : size;
+        void* mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) return;  // Requests keep being served one by one
+
+        uintptr_t start = reinterpret_cast<uintptr_t>(mapping);
+        if (huge) {
+            start = (start + HUGE_PAGE - 1) & ~(static_cast<uintptr_t>(HUGE_PAGE) - 1);
+#ifdef MADV_HUGEPAGE
+            madvise(reinterpret_cast<void*>(start), size, MADV_HUGEPAGE);
+#endif
+        }
+        slab_mapping = mapping;
+        slab_mapping_size = mapping_size;
+        slab = reinterpret_cast<uint8_t*>(start);
+        slab_size = size;
+    }
+
+    // End of an image: everything in the image pool goes at once
+    void release_image_pool() {
+        for (void* p : overflow) free(p);
+        overflow.clear();
+        high_water = std::max(high_water, image_bytes);
+        if (high_water > slab_size) {
+            grow_slab(high_water);
+        }
+        slab_used = 0;
+        image_bytes = 0;
+        virtual_arrays = nullptr;
+    }
+
+    void** allocate_rows(j_common_ptr cinfo, size_t row_bytes, JDIMENSION row_count) {
+        row_bytes = (row_bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        void** rows = static_cast<void**>(allocate(cinfo, sizeof(void*) * row_count));
+        uint8_t* data = static_cast<uint8_t*>(allocate(cinfo, row_bytes * row_count));
+        for (JDIMENSION i = 0; i < row_count; i++) {
+            rows[i] = data + row_bytes * i;
+        }
+        return rows;
+    }
+
+    VirtualArray* request_virtual(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                  size_t row_bytes, JDIMENSION row_count, bool blocks) {
+        if (pool_id != JPOOL_IMAGE) {
+            ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+        }
+        VirtualArray* array = static_cast<VirtualArray*>(allocate(cinfo, sizeof(VirtualArray)));
+        *array = VirtualArray();
+        array->row_bytes = row_bytes;
+        array->row_count = row_count;
+        array->pre_zero = pre_zero;
+        array->blocks = blocks;
+        array->next = virtual_arrays;
+        virtual_arrays = array;
+        return array;
+    }
+
+    static void** access_virtual(j_common_ptr cinfo, void* handle, JDIMENSION start_row, JDIMENSION num_rows) {
+        VirtualArray* array = static_cast<VirtualArray*>(handle);
+        if (!array->rows || start_row + num_rows > array->row_count) {
+            ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+        }
+        return array->rows + start_row;
+    }
+
+    // === jpeg_memory_mgr methods ===
+
+    static void* alloc_small(j_common_ptr cinfo, int pool_id, size_t size) {
+        PooledJpegMemory* mem = self(cinfo);
+        if (pool_id != JPOOL_IMAGE) {
+            return mem->delegate(cinfo, [&](jpeg_memory_mgr* m) { return m->alloc_small(cinfo, pool_id, size); });
+        }
+        return mem->allocate(cinfo, size);
+    }
+
+    static void* alloc_large(j_common_ptr cinfo, int pool_id, size_t size) {
+        PooledJpegMemory* mem = self(cinfo);
+        if (pool_id != JPOOL_IMAGE) {
+            return mem->delegate(cinfo, [&](jpeg_memory_mgr* m) { return m->alloc_large(cinfo, pool_id, size); });
+        }
+        return mem->allocate(cinfo, size);
+    }
+
+    static JSAMPARRAY alloc_sarray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow, JDIMENSION numrows) {
+        PooledJpegMemory* mem = self(cinfo);
+        if (pool_id != JPOOL_IMAGE) {
+            return mem->delegate(cinfo, [&](jpeg_memory_mgr* m) {
+                return m->alloc_sarray(cinfo, pool_id, samplesperrow, numrows);
+            });
+        }
+        return reinterpret_cast<JSAMPARRAY>(mem->allocate_rows(cinfo, sizeof(JSAMPLE) * samplesperrow, numrows));
+    }
+
+    static JBLOCKARRAY alloc_barray(j_common_ptr cinfo, int pool_id, JDIMENSION blocksperrow, JDIMENSION numrows) {
+        PooledJpegMemory* mem = self(cinfo);
+        if (pool_id != JPOOL_IMAGE) {
+            return mem->delegate(cinfo, [&](jpeg_memory_mgr* m) {
+                return m->alloc_barray(cinfo, pool_id, blocksperrow, numrows);
+            });
+        }
+        return reinterpret_cast<JBLOCKARRAY>(mem->allocate_rows(cinfo, sizeof(JBLOCK) * blocksperrow, numrows));
+    }
+
+    static jvirt_sarray_ptr request_virt_sarray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                                JDIMENSION samplesperrow, JDIMENSION numrows, JDIMENSION) {
+        return reinterpret_cast<jvirt_sarray_ptr>(
+            self(cinfo)->request_virtual(cinfo, pool_id, pre_zero, sizeof(JSAMPLE) * samplesperrow, numrows, false));
+    }
+
+    static jvirt_barray_ptr request_virt_barray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                                JDIMENSION blocksperrow, JDIMENSION numrows, JDIMENSION) {
+        return reinterpret_cast<jvirt_barray_ptr>(
+            self(cinfo)->request_virtual(cinfo, pool_id, pre_zero, sizeof(JBLOCK) * blocksperrow, numrows, true));
+    }
+
+    static void realize_virt_arrays(j_common_ptr cinfo) {
+        PooledJpegMemory* mem = self(cinfo);
+        for (VirtualArray* array = mem->virtual_arrays; array; array = array->next) {
+            if (array->rows) continue;
+            array->rows = mem->allocate_rows(cinfo, array->row_bytes, array->row_count);
+            if (array->pre_zero) {
+                for (JDIMENSION i = 0; i < array->row_count; i++) {
+                    memset(array->rows[i], 0, array->row_bytes);
+                }
+            }
+        }
+    }
+
+    static JSAMPARRAY access_virt_sarray(j_common_ptr cinfo, jvirt_sarray_ptr ptr, JDIMENSION start_row,
+                                         JDIMENSION num_rows, boolean) {
+        return reinterpret_cast<JSAMPARRAY>(access_virtual(cinfo, ptr, start_row, num_rows));
+    }
+
+    static JBLOCKARRAY access_virt_barray(j_common_ptr cinfo, jvirt_barray_ptr ptr, JDIMENSION start_row,
+                                          JDIMENSION num_rows, boolean) {
+        return reinterpret_cast<JBLOCKARRAY>(access_virtual(cinfo, ptr, start_row, num_rows));
+    }
+
+    static void free_pool(j_common_ptr cinfo, int pool_id) {
+        PooledJpegMemory* mem = self(cinfo);
+        if (pool_id != JPOOL_IMAGE) {
+            mem->delegate(cinfo, [&](jpeg_memory_mgr* m) { m->free_pool(cinfo, pool_id); return 0; });
+            return;
+        }
+        mem->release_image_pool();
+    }
+
+    static void self_destruct(j_common_ptr cinfo) {
+        PooledJpegMemory* mem = self(cinfo);
+        mem->release_image_pool();
+        // libjpeg's manager frees the permanent pool and itself, and clears cinfo->mem
+        cinfo->mem = mem->original;
+        mem->original->self_destruct(cinfo);
+        mem->original = nullptr;
+    }
+
+public:
+    PooledJpegMemory() = default;
+    ~PooledJpegMemory() {
+        for (void* p : overflow) free(p);
+        unmap_slab();
+    }
+    // Prevent copying
+    PooledJpegMemory(const PooledJpegMemory&) = delete;
+    PooledJpegMemory& operator=(const PooledJpegMemory&) = delete;
+
+    // Take over a freshly created compressor's memory manager
+    void install(j_common_ptr cinfo) {
+        original = cinfo->mem;
+        pub.alloc_small = alloc_small;
+        pub.alloc_large = alloc_large;
+        pub.alloc_sarray = alloc_sarray;
+        pub.alloc_barray = alloc_barray;
+        pub.request_virt_sarray = request_virt_sarray;
+        pub.request_virt_barray = request_virt_barray;
+        pub.realize_virt_arrays = realize_virt_arrays;
+        pub.access_virt_sarray = access_virt_sarray;
+        pub.access_virt_barray = access_virt_barray;
+        pub.free_pool = free_pool;
+        pub.self_destruct = self_destruct;
+        pub.max_memory_to_use = original->max_memory_to_use;
+        pub.max_alloc_chunk = original->max_alloc_chunk;
+        cinfo->mem = &pub;
+    }
+
+    // Coefficient arrays of the current image in the order they were requested, up to
+    // 'max'. While compressing, these are the full-image buffer (one per component) that
+    // libjpeg keeps when it makes more than one pass. Returns the number of arrays.
+    int block_arrays(jvirt_barray_ptr* out, int max) const {
+        int count = 0;
+        for (VirtualArray* array = virtual_arrays; array; array = array->next) {
+            if (array->blocks) count++;
+        }
+        int index = count;
+        for (VirtualArray* array = virtual_arrays; array; array = array->next) {
+            if (array->blocks && --index < max) out[index] = reinterpret_cast<jvirt_barray_ptr>(array);
+        }
+        return std::min(count, max);
+    }
+
+    // Point the first 'rows' rows of a realized coefficient array at caller memory holding
+    // them back to back, 'row_blocks' blocks each, instead of copying them into the array
+    static void adopt_block_rows(jvirt_barray_ptr handle, JBLOCKROW first, JDIMENSION row_blocks, JDIMENSION rows) {
+        VirtualArray* array = reinterpret_cast<VirtualArray*>(handle);
+        for (JDIMENSION i = 0; i < rows && i < array->row_count; i++) {
+            array->rows[i] = first + static_cast<size_t>(row_blocks) * i;
+        }
+    }
+
+    // Bytes mapped for the slab
+    size_t retained_bytes() const { return slab_mapping_size; }
+
+    // Between images: unmap the slab and forget the largest image, so the next one starts
+    // from a slab of its own size
+    void release_slab() {
+        for (void* p : overflow) free(p);
+        overflow.clear();
+        unmap_slab();
+        slab_used = 0;
+        image_bytes = 0;
+        high_water = 0;
+        virtual_arrays = nullptr;
+    }
+
+    // Before each image: an error inside a delegated call may have left libjpeg's manager
+    // installed, and the image pool was then not released through us
+    void reattach(j_common_ptr cinfo) {
+        if (cinfo->mem != &pub) {
+            cinfo->mem = &pub;
+            release_image_pool();
+        }
+    }
+};
+
+// libjpeg destination manager that writes into a growable std::vector
+struct VectorDestination {
+    jpeg_destination_mgr pub;
+    std::vector<uint8_t>* buffer;
+};
+
+void vector_init_destination(j_compress_ptr cinfo) {
+    VectorDestination* dest = reinterpret_cast<VectorDestination*>(cinfo->dest);
+    // Start from the buffer's current size: a reused buffer is not cleared, so its bytes
+    // need not be zero-filled again
+    dest->buffer->resize(std::max<size_t>(dest->buffer->size(), 64 * 1024));
+    dest->pub.next_output_byte = dest->buffer->data();
+    dest->pub.free_in_buffer = dest->buffer->size();
+}
+
+boolean vector_empty_output_buffer(j_compress_ptr cinfo) {
+    // Called only when the whole buffer is full
+    VectorDestination* dest = reinterpret_cast<VectorDestination*>(cinfo->dest);
+    size_t used = dest->buffer->size();
+    dest->buffer->resize(used * 2);
+    dest->pub.next_output_byte = dest->buffer->data() + used;
+    dest->pub.free_in_buffer = dest->buffer->size() - used;
+    return TRUE;
+}
+
+void vector_term_destination(j_compress_ptr cinfo) {
+    VectorDestination* dest = reinterpret_cast<VectorDestination*>(cinfo->dest);
+    dest->buffer->resize(dest->buffer->size() - dest->pub.free_in_buffer);
+}
+
+// Reduction of 16-bit samples (the low 'bits' of each significant) to 8 bits: a rounding
+// shift, or a lookup table for curves that depend on the transfer function
+struct SampleReduction {
+    int bits = 0;
+    bool shift = true;
+    std::vector<uint8_t> table;             // 1 << bits entries unless 'shift'
+    HdrMode mode = HdrMode::Auto;           // What the table was built for
+    int transfer = -1;
+};
+
+// Conversion of 8-bit samples to sRGB (see "Conversion to sRGB"). The matrix is folded into
+// the curves: an entry holds what the code value of its channel adds to linear R, G and B,
+// in steps of the sRGB curve's table.
+struct GamutConversion {
+    bool needed = false;                    // False for sources that are sRGB already
+    alignas(16) float contribution[3][256][4]; // Channel, code value; R, G, B and 0
+};
+
+// The decoded image as libjpeg reads it. 8-bit RGB rows are passed straight from libheif's
+// image. Rows of wider samples are reduced, converted to sRGB when asked, and rows with
+// alpha composited onto the background, a band at a time as they are fed, fused with the encode instead of a separate
+// pass over the frame.
+struct RowFeed {
+    std::vector<JSAMPROW> rows;             // Row starts in the decoded image
+    const SampleReduction* reduction = nullptr; // Set for wide samples
+    const GamutConversion* gamut = nullptr; // Set to convert colors to sRGB
+    int width = 0;
+    bool alpha = false;                     // RGBA rows; fed to libjpeg as RGBX
+    bool gray = false;                      // One sample per pixel (auxiliary images)
+    bool premultiplied = false;             // Color already multiplied by alpha
+    uint8_t background[3] = {255, 255, 255};
+};
+
+// Long-lived conversion state owned by each thread. The compressor is created once and
+// reset with jpeg_abort_compress() after a failure instead of being destroyed; row
+// pointers, metadata and the output buffer keep their capacity from image to image, up to
+// the thread's retention limit (see trim_conversion_context()).
+struct ConversionContext {
+    jpeg_compress_struct cinfo;
+    JpegErrorManager jerr;
+    VectorDestination dest;
+    RowFeed feed;                           // Rows of the current image
+    std::vector<uint8_t> band;              // Reduced or composited rows of a feed (any image's)
+    std::vector<JSAMPROW> band_rows;
+    SampleReduction reduction;              // Last one built, reused while it matches
+    std::vector<heif_item_id> metadata_ids;
+    std::vector<MetadataBlock> metadata;    // Block data lives in 'arena'
+    std::vector<uint8_t> output;            // JPEG of the current file job
+    ScratchArena arena;                     // Reset at the start of every image
+    PooledJpegMemory memory;                // libjpeg's per-image allocations
+    std::vector<uint8_t> candidate;         // Output of the current target search step
+    std::vector<JCOEF> coefficients;        // Saved DCT coefficients (target search, rotation)
+    std::vector<uint8_t> resized;           // Downscaled image of the current file job
+    std::vector<int16_t> resample;          // Vertically filtered row of a downscaling band
+    std::vector<std::vector<uint8_t>> pyramid; // Renditions (or the tensor) of the current file job
+    std::vector<RowFeed> pyramid_feeds;     // Their rows
+
+    ConversionContext() {
+        cinfo.err = jpeg_std_error(&jerr.pub);
+        jerr.pub.error_exit = jpeg_error_exit;
+        jerr.pub.output_message = jpeg_output_message;
+        jpeg_create_compress(&cinfo);
+        memory.install(reinterpret_cast<j_common_ptr>(&cinfo));
+        dest.pub.init_destination = vector_init_destination;
+        dest.pub.empty_output_buffer = vector_empty_output_buffer;
+        dest.pub.term_destination = vector_term_destination;
+        dest.buffer = nullptr;
+    }
+    ~ConversionContext() { jpeg_destroy_compress(&cinfo); }
+    // Prevent copying
+    ConversionContext(const ConversionContext&) = delete;
+    ConversionContext& operator=(const ConversionContext&) = delete;
+
+    // Bytes kept for the next image
+    size_t retained_bytes() const {
+        size_t total = band.capacity() + output.capacity() + candidate.capacity() + resized.capacity() +
+                       band_rows.capacity() * sizeof(JSAMPROW) + feed.rows.capacity() * sizeof(JSAMPROW) +
+                       coefficients.capacity() * sizeof(JCOEF) + resample.capacity() * sizeof(int16_t) +
+                       metadata.capacity() * sizeof(MetadataBlock) + arena.capacity() + memory.retained_bytes();
+        for (const auto& level : pyramid) total += level.capacity();
+        for (const auto& level : pyramid_feeds) total += level.rows.capacity() * sizeof(JSAMPROW);
+        return total;
+    }
+
+    // Free the buffers sized by past images (between images)
+    void release_buffers() {
+        std::vector<uint8_t>().swap(band);
+        std::vector<uint8_t>().swap(output);
+        std::vector<uint8_t>().swap(candidate);
+        std::vector<uint8_t>().swap(resized);
+        std::vector<JSAMPROW>().swap(band_rows);
+        std::vector<JSAMPROW>().swap(feed.rows);
+        std::vector<JCOEF>().swap(coefficients);
+        std::vector<int16_t>().swap(resample);
+        std::vector<MetadataBlock>().swap(metadata);
+        std::vector<std::vector<uint8_t>>().swap(pyramid);
+        std::vector<RowFeed>().swap(pyramid_feeds);
+        arena.release();
+        memory.release_slab();
+    }
+};
+
+ConversionContext& thread_conversion_context() {
+    thread_local ConversionContext context;
+    return context;
+}
+
+// Bytes this thread's conversion context may keep between images. Workers set it to their
+// share of the memory budget (see retained_context_mb()); helper threads take the limit of
+// the thread whose subtasks they run.
+thread_local size_t context_retention_limit = 64 * 1024 * 1024;
+
+// Part of a thread's memory budget its conversion context may keep between images; the
+// rest is what a single image may be estimated to need
+size_t retained_context_mb(size_t memory_per_thread_mb) {
+    return memory_per_thread_mb / 4;
+}
+
+// After an image: when the context keeps more than the thread's limit (a large image came
+// through), its buffers are freed so that it does not hold that image's peak for good
+void trim_conversion_context() {
+    ConversionContext& context = thread_conversion_context();
+    if (context.retained_bytes() > context_retention_limit) {
+        context.release_buffers();
+    }
+}
+
+// === Sources above 8 bits per sample ===
+// 10-bit (and 12-bit) images are decoded at their native depth as 16-bit RGB and reduced to
+// 8 bits while they are fed to the encoder. Clipping keeps the code values (a rounding
+// shift, vectorized); the gamma and tone mapping modes convert to linear light through the
+// transfer function of the nclx color profile (PQ, HLG or SDR) and back, via a lookup table
+// per bit depth, mode and transfer. Curves apply per channel; primaries are converted only
+// with 'to_srgb' (see "Conversion to sRGB").
+
+// 16-bit samples in host byte order
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+const heif_chroma WIDE_RGB_CHROMA = heif_chroma_interleaved_RRGGBB_BE;
+const heif_chroma WIDE_RGBA_CHROMA = heif_chroma_interleaved_RRGGBBAA_BE;
+#else
+const heif_chroma WIDE_RGB_CHROMA = heif_chroma_interleaved_RRGGBB_LE;
+const heif_chroma WIDE_RGBA_CHROMA = heif_chroma_interleaved_RRGGBBAA_LE;
+#endif
+
+const int FEED_BAND_ROWS = 16;              // One MCU row with 4:2:0 sampling
+const double REFERENCE_WHITE_NITS = 203;    // HDR reference white (ITU-R BT.2408)
+const double TONEMAP_KNEE = 0.75;           // Relative luminance where the roll-off starts
+
+bool hdr_transfer(int transfer) {
+    return transfer == heif_transfer_characteristic_ITU_R_BT_2100_0_PQ ||
+           transfer == heif_transfer_characteristic_ITU_R_BT_2100_0_HLG;
+}
+
+// Transfer characteristics of the image's nclx color profile, or -1 without one
+int transfer_characteristics(const heif_image_handle* handle) {
+    heif_color_profile_nclx* nclx = nullptr;
+    heif_error err = heif_image_handle_get_nclx_color_profile(handle, &nclx);
+    if (err.code != heif_error_Ok || !nclx) return -1;
+    int transfer = nclx->transfer_characteristics;
+    heif_nclx_color_profile_free(nclx);
+    return transfer;
+}
+
+// Code value in [0, 1] to linear light relative to reference white (1.0 = SDR white)
+double to_linear(double value, int transfer) {
+    if (transfer == heif_transfer_characteristic_ITU_R_BT_2100_0_PQ) {
+        // SMPTE ST 2084 EOTF: absolute luminance up to 10000 nits
+        const double m1 = 2610.0 / 16384, m2 = 2523.0 / 4096 * 128;
+        const double c1 = 3424.0 / 4096, c2 = 2413.0 / 4096 * 32, c3 = 2392.0 / 4096 * 32;
+        double p = std::pow(value, 1 / m2);
+        double nits = 10000 * std::pow(std::max(p - c1, 0.0) / (c2 - c3 * p), 1 / m1);
+        return nits / REFERENCE_WHITE_NITS;
+    }
+    if (transfer == heif_transfer_characteristic_ITU_R_BT_2100_0_HLG) {
+        // ARIB STD-B67 inverse OETF, then the BT.2100 OOTF for a 1000 nit display
+        // (system gamma 1.2), per channel
+        const double a = 0.17883277, b = 1 - 4 * a, c = 0.5 - a * std::log(4 * a);
+        double scene = value <= 0.5 ? value * value / 3 : (std::exp((value - c) / a) + b) / 12;
+        return 1000 * std::pow(scene, 1.2) / REFERENCE_WHITE_NITS;
+    }
+    // SDR transfers (BT.709, sRGB, unspecified): the sRGB curve
+    return value <= 0.04045 ? value / 12.92 : std::pow((value + 0.055) / 1.055, 2.4);
+}
+
+double srgb_encode(double linear) {
+    return linear <= 0.0031308 ? linear * 12.92 : 1.055 * std::pow(linear, 1 / 2.4) - 0.055;
+}
+
+// Rebuild 'reduction' for samples of 'bits' bits unless it already matches
+void prepare_reduction(SampleReduction& reduction, int bits, HdrMode mode, int transfer) {
+    if (mode == HdrMode::Auto) {
+        mode = hdr_transfer(transfer) ? HdrMode::ToneMap : HdrMode::Clip;
+    }
+    if (mode == HdrMode::ToneMap && !hdr_transfer(transfer)) {
+        mode = HdrMode::Clip;               // No highlights above reference white to map
+    }
+    if (reduction.bits == bits && reduction.mode == mode && reduction.transfer == transfer) return;
+
+    reduction.bits = bits;
+    reduction.mode = mode;
+    reduction.transfer = transfer;
+    reduction.shift = mode == HdrMode::Clip;
+    if (reduction.shift) {
+        reduction.table.clear();
+        return;
+    }
+
+    size_t size = static_cast<size_t>(1) << bits;
+    reduction.table.resize(size);
+    for (size_t code = 0; code < size; code++) {
+        double linear = to_linear(static_cast<double>(code) / (size - 1), transfer);
+        double encoded;
+        if (mode == HdrMode::Gamma) {
+            encoded = std::pow(std::min(linear, 1.0), 1 / 2.2);
+        } else {
+            // Identity up to the knee, then a curve with the same slope there that
+            // approaches white asymptotically
+            if (linear > TONEMAP_KNEE) {
+                double t = (linear - TONEMAP_KNEE) / (1 - TONEMAP_KNEE);
+                linear = TONEMAP_KNEE + (1 - TONEMAP_KNEE) * t / (1 + t);
+            }
+            encoded = srgb_encode(linear);
+        }
+        reduction.table[code] = static_cast<uint8_t>(std::lround(std::min(std::max(encoded, 0.0), 1.0) * 255));
+    }
+}
+
+// Reduce 'count' samples to 8 bits
+void reduce_samples(const uint16_t* in, uint8_t* out, size_t count, const SampleReduction& reduction) {
+    size_t i = 0;
+    if (reduction.shift) {
+        int shift = reduction.bits - 8;
+        unsigned int round = (1u << shift) >> 1;
+#if defined(__SSE2__)
+        const __m128i round_vector = _mm_set1_epi16(static_cast<short>(round));
+        const __m128i shift_count = _mm_cvtsi32_si128(shift);
+        for (; i + 16 <= count; i += 16) {
+            __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8));
+            low = _mm_srl_epi16(_mm_adds_epu16(low, round_vector), shift_count);
+            high = _mm_srl_epi16(_mm_adds_epu16(high, round_vector), shift_count);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(low, high));  // Saturates
+        }
+#elif defined(__ARM_NEON)
+        const int16x8_t shift_vector = vdupq_n_s16(static_cast<int16_t>(-shift));  // Rounding right shift
+        for (; i + 16 <= count; i += 16) {
+            uint16x8_t low = vrshlq_u16(vld1q_u16(in + i), shift_vector);
+            uint16x8_t high = vrshlq_u16(vld1q_u16(in + i + 8), shift_vector);
+            vst1q_u8(out + i, vcombine_u8(vqmovn_u16(low), vqmovn_u16(high)));       // Saturates
+        }
+#endif
+        for (; i < count; i++) {
+            out[i] = static_cast<uint8_t>(std::min((in[i] + round) >> shift, 255u));
+        }
+        return;
+    }
+    const uint8_t* table = reduction.table.data();
+    const unsigned int mask = (1u << reduction.bits) - 1;
+    for (; i < count; i++) {
+        out[i] = table[in[i] & mask];
+    }
+}
+
+// Rounding division of a composite sum by 255, exact for sums up to 255 * 255
+inline unsigned int divide_by_255(unsigned int sum) {
+    sum = std::min(sum, 255u * 255) + 128;
+    return (sum + (sum >> 8)) >> 8;
+}
+
+// Reduce the alpha samples of 'width' 16-bit RGBA pixels into 'out' (8-bit RGBA) with a
+// rounding shift; reduce_samples() ran them through the color table with the rest
+void reduce_alpha(const uint16_t* in, uint8_t* out, int width, int bits) {
+    int shift = bits - 8;
+    unsigned int round = (1u << shift) >> 1;
+    for (int x = 0; x < width; x++) {
+        out[x * 4 + 3] = static_cast<uint8_t>(std::min((in[x * 4 + 3] + round) >> shift, 255u));
+    }
+}
+
+// Composite 'width' RGBA pixels onto the feed's background into 'out' as RGBX (the fourth
+// byte is left undefined). 'in' and 'out' may be the same row.
+void composite_row(const uint8_t* in, uint8_t* out, int width, const RowFeed& feed) {
+    const unsigned int red = feed.background[0], green = feed.background[1], blue = feed.background[2];
+    int x = 0;
+#if defined(__SSE2__)
+    // Four pixels per half vector: color * alpha + background * (255 - alpha), in 16 bits
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opaque = _mm_set1_epi16(255);
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i background = _mm_setr_epi16(static_cast<short>(red), static_cast<short>(green),
+                                              static_cast<short>(blue), 0, static_cast<short>(red),
+                                              static_cast<short>(green), static_cast<short>(blue), 0);
+    auto blend = [&](__m128i pixels) {
+        __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, 0xFF), 0xFF);
+        __m128i color = _mm_mullo_epi16(pixels, feed.premultiplied ? opaque : alpha);
+        __m128i sum = _mm_adds_epu16(color, _mm_mullo_epi16(background, _mm_sub_epi16(opaque, alpha)));
+        sum = _mm_adds_epu16(sum, round);                                    // Saturates
+        return _mm_srli_epi16(_mm_adds_epu16(sum, _mm_srli_epi16(sum, 8)), 8);
+    };
+    for (; x + 4 <= width; x += 4) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + x * 4));
+        __m128i low = blend(_mm_unpacklo_epi8(pixels, zero));
+        __m128i high = blend(_mm_unpackhi_epi8(pixels, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * 4), _mm_packus_epi16(low, high));
+    }
+#elif defined(__ARM_NEON)
+    // Sixteen pixels per iteration, deinterleaved into planes
+    const uint8x16_t opaque = vdupq_n_u8(255);
+    const uint8x8_t background[3] = {vdup_n_u8(static_cast<uint8_t>(red)), vdup_n_u8(static_cast<uint8_t>(green)),
+                                     vdup_n_u8(static_cast<uint8_t>(blue))};
+    const uint16x8_t limit = vdupq_n_u16(255 * 255);
+    auto blend = [&](uint8x8_t color, uint8x8_t weight, uint8x8_t inverse, uint8x8_t under) {
+        uint16x8_t sum = vminq_u16(vqaddq_u16(vmull_u8(color, weight), vmull_u8(under, inverse)), limit);
+        return vraddhn_u16(sum, vrshrq_n_u16(sum, 8));
+    };
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t pixels = vld4q_u8(in + x * 4);
+        uint8x16_t weight = feed.premultiplied ? opaque : pixels.val[3];
+        uint8x16_t inverse = vsubq_u8(opaque, pixels.val[3]);
+        for (int c = 0; c < 3; c++) {
+            pixels.val[c] = vcombine_u8(
+                blend(vget_low_u8(pixels.val[c]), vget_low_u8(weight), vget_low_u8(inverse), background[c]),
+                blend(vget_high_u8(pixels.val[c]), vget_high_u8(weight), vget_high_u8(inverse), background[c]));
+        }
+        vst4q_u8(out + x * 4, pixels);
+    }
+#endif
+    for (; x < width; x++) {
+        const uint8_t* pixel = in + x * 4;
+        unsigned int alpha = pixel[3];
+        unsigned int weight = feed.premultiplied ? 255 : alpha;
+        out[x * 4] = static_cast<uint8_t>(divide_by_255(pixel[0] * weight + red * (255 - alpha)));
+        out[x * 4 + 1] = static_cast<uint8_t>(divide_by_255(pixel[1] * weight + green * (255 - alpha)));
+        out[x * 4 + 2] = static_cast<uint8_t>(divide_by_255(pixel[2] * weight + blue * (255 - alpha)));
+    }
+}
+
+const int SRGB_TABLE_SIZE = 16384;          // Steps of linear light; under 0.2 of a code value apart
+
+// sRGB code values of linear light in SRGB_TABLE_SIZE steps
+const uint8_t* srgb_encode_table() {
+    static const std::vector<uint8_t> table = [] {
+        std::vector<uint8_t> values(SRGB_TABLE_SIZE);
+        for (int i = 0; i < SRGB_TABLE_SIZE; i++) {
+            values[i] = static_cast<uint8_t>(std::lround(srgb_encode(static_cast<double>(i) / (SRGB_TABLE_SIZE - 1)) * 255));
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+// Convert 'width' pixels of 'channels' (3, or 4 with alpha, which is copied) samples to sRGB
+// into 'out': the contributions of a pixel's code values are summed (vectorized), clipped and
+// looked up in the sRGB curve. 'in' and 'out' may be the same row.
+void convert_to_srgb(const uint8_t* in, uint8_t* out, int width, int channels, const GamutConversion& gamut) {
+    const uint8_t* encode = srgb_encode_table();
+    const float top = SRGB_TABLE_SIZE - 1;
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps(), limit = _mm_set1_ps(top), half = _mm_set1_ps(0.5f);
+    auto steps = [&](const uint8_t* pixel) {
+        __m128 sum = _mm_add_ps(_mm_add_ps(_mm_load_ps(gamut.contribution[0][pixel[0]]),
+                                           _mm_load_ps(gamut.contribution[1][pixel[1]])),
+                                _mm_load_ps(gamut.contribution[2][pixel[2]]));
+        return _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(sum, zero), limit), half));
+    };
+    // Two pixels per iteration, their steps packed into 16-bit lanes
+    for (; x + 2 <= width; x += 2) {
+        const uint8_t* pixel = in + static_cast<size_t>(x) * channels;
+        uint8_t* target = out + static_cast<size_t>(x) * channels;
+        __m128i both = _mm_packs_epi32(steps(pixel), steps(pixel + channels));
+        if (channels == 4) {
+            target[3] = pixel[3];
+            target[7] = pixel[7];
+        }
+        target[0] = encode[_mm_extract_epi16(both, 0)];
+        target[1] = encode[_mm_extract_epi16(both, 1)];
+        target[2] = encode[_mm_extract_epi16(both, 2)];
+        target[channels] = encode[_mm_extract_epi16(both, 4)];
+        target[channels + 1] = encode[_mm_extract_epi16(both, 5)];
+        target[channels + 2] = encode[_mm_extract_epi16(both, 6)];
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t zero = vdupq_n_f32(0), limit = vdupq_n_f32(top), half = vdupq_n_f32(0.5f);
+    for (; x < width; x++) {
+        const uint8_t* pixel = in + static_cast<size_t>(x) * channels;
+        uint8_t* target = out + static_cast<size_t>(x) * channels;
+        float32x4_t sum = vaddq_f32(vaddq_f32(vld1q_f32(gamut.contribution[0][pixel[0]]),
+                                              vld1q_f32(gamut.contribution[1][pixel[1]])),
+                                    vld1q_f32(gamut.contribution[2][pixel[2]]));
+        int32x4_t steps = vcvtq_s32_f32(vaddq_f32(vminq_f32(vmaxq_f32(sum, zero), limit), half));
+        if (channels == 4) target[3] = pixel[3];
+        target[0] = encode[vgetq_lane_s32(steps, 0)];
+        target[1] = encode[vgetq_lane_s32(steps, 1)];
+        target[2] = encode[vgetq_lane_s32(steps, 2)];
+    }
+#endif
+    for (; x < width; x++) {
+        const uint8_t* pixel = in + static_cast<size_t>(x) * channels;
+        uint8_t* target = out + static_cast<size_t>(x) * channels;
+        float sums[3];
+        for (int c = 0; c < 3; c++) {
+            float sum = gamut.contribution[0][pixel[0]][c] + gamut.contribution[1][pixel[1]][c] +
+                        gamut.contribution[2][pixel[2]][c];
+            sums[c] = std::min(std::max(sum, 0.0f), top) + 0.5f;
+        }
+        if (channels == 4) target[3] = pixel[3];
+        for (int c = 0; c < 3; c++) target[c] = encode[static_cast<int>(sums[c])];
+    }
+}
+
+// Samples per pixel libjpeg reads from a feed
+int fed_components(const RowFeed& feed) {
+    return feed.gray ? 1 : feed.alpha ? 4 : 3;
+}
+
+// Decoded row 'row' of 'feed' as libjpeg reads it (fed_components() samples per pixel): the
+// row itself for 8-bit RGB, else reduced, converted to sRGB and composited into 'scratch'
+const uint8_t* fed_row(const RowFeed& feed, const uint8_t* row, uint8_t* scratch) {
+    if (feed.reduction) {
+        const uint16_t* wide_row = reinterpret_cast<const uint16_t*>(row);
+        reduce_samples(wide_row, scratch, static_cast<size_t>(feed.width) * fed_components(feed), *feed.reduction);
+        if (feed.alpha && !feed.reduction->shift) {
+            reduce_alpha(wide_row, scratch, feed.width, feed.reduction->bits);
+        }
+        row = scratch;
+    }
+    if (feed.gamut) {
+        convert_to_srgb(row, scratch, feed.width, feed.alpha ? 4 : 3, *feed.gamut);
+        row = scratch;
+    }
+    if (feed.alpha) {
+        composite_row(row, scratch, feed.width, feed);
+        row = scratch;
+    }
+    return row;
+}
+
+// Whether fed_row() passes the decoded rows through unchanged
+bool plain_rows(const RowFeed& feed) {
+    return !feed.reduction && !feed.alpha && !feed.gamut;
+}
+
+// Write rows [first_row, first_row + cinfo.image_height) of 'feed' to the started compressor.
+// Rows that need it are prepared by fed_row() in 'context' (the calling thread's) band
+// buffer. Runs under the caller's setjmp().
+void feed_rows(jpeg_compress_struct& cinfo, const RowFeed& feed, int first_row, ConversionContext& context) {
+    const JSAMPROW* rows = feed.rows.data() + first_row;
+    if (plain_rows(feed)) {
+        while (cinfo.next_scanline < cinfo.image_height) {
+            jpeg_write_scanlines(&cinfo, const_cast<JSAMPARRAY>(rows + cinfo.next_scanline),
+                                 cinfo.image_height - cinfo.next_scanline);
+        }
+        return;
+    }
+
+    size_t row_samples = static_cast<size_t>(feed.width) * fed_components(feed);
+    context.band.resize(row_samples * FEED_BAND_ROWS);
+    context.band_rows.resize(FEED_BAND_ROWS);
+    for (int i = 0; i < FEED_BAND_ROWS; i++) {
+        context.band_rows[i] = context.band.data() + row_samples * i;
+    }
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JDIMENSION first = cinfo.next_scanline;
+        JDIMENSION count = std::min<JDIMENSION>(FEED_BAND_ROWS, cinfo.image_height - first);
+        for (JDIMENSION i = 0; i < count; i++) {
+            fed_row(feed, rows[first + i], context.band_rows[i]);
+        }
+        JDIMENSION written = 0;
+        while (written < count) {
+            written += jpeg_write_scanlines(&cinfo, context.band_rows.data() + written, count - written);
+        }
+    }
+}
+
+// Encoder settings of a profile, applied after jpeg_set_defaults()
+void apply_profile(jpeg_compress_struct& cinfo, Profile profile) {
+    switch (profile) {
+        case Profile::Default:
+            break;
+        case Profile::Fast:
+            cinfo.dct_method = JDCT_IFAST;
+            cinfo.optimize_coding = FALSE;
+            break;
+        case Profile::Balanced:
+            cinfo.optimize_coding = TRUE;
+            break;
+        case Profile::Smallest:
+            cinfo.optimize_coding = TRUE;
+            jpeg_simple_progression(&cinfo);   // Script is kept in the permanent pool and reused
+#ifdef JPEG_C_PARAM_SUPPORTED
+            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_QUANT, TRUE);
+#endif
+            break;
+    }
+}
+
+// The coefficient arrays of a capturing compress_rows() pass, one per component
+void captured_arrays(ConversionContext& context, jvirt_barray_ptr* arrays) {
+    if (context.memory.block_arrays(arrays, MAX_COMPONENTS) != context.cinfo.num_components) {
+        ERREXIT(&context.cinfo, JERR_NOT_COMPILED);
+    }
+}
+
+// Copy the coefficients of all components from the compressor's 'arrays' into
+// context.coefficients, luma first
+void save_coefficients(ConversionContext& context, jvirt_barray_ptr* arrays) {
+    jpeg_compress_struct& cinfo = context.cinfo;
+    size_t total_blocks = 0;
+    for (int c = 0; c < cinfo.num_components; c++) {
+        total_blocks += static_cast<size_t>(cinfo.comp_info[c].width_in_blocks) * cinfo.comp_info[c].height_in_blocks;
+    }
+    context.coefficients.resize(total_blocks * DCTSIZE2);
+
+    JCOEF* out = context.coefficients.data();
+    for (int c = 0; c < cinfo.num_components; c++) {
+        jpeg_component_info* component = &cinfo.comp_info[c];
+        size_t row_values = static_cast<size_t>(component->width_in_blocks) * DCTSIZE2;
+        for (JDIMENSION row = 0; row < component->height_in_blocks; row++) {
+            JBLOCKARRAY blocks = (*cinfo.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&cinfo), arrays[c],
+                                                                  row, 1, FALSE);
+            memcpy(out, blocks[0], row_values * sizeof(JCOEF));
+            out += row_values;
+        }
+    }
+}
+
+// Sets image and compression parameters for an encode at 'quality' into 'out'
+void configure_compressor(ConversionContext& context, const RowFeed& feed, int height, int quality,
+                          Profile profile, bool capture, std::vector<uint8_t>& out) {
+    jpeg_compress_struct& cinfo = context.cinfo;
+
+    // Set output destination
+    context.dest.buffer = &out;
+    cinfo.dest = &context.dest.pub;
+
+    // Set JPEG image parameters
+    cinfo.image_width = feed.width;
+    cinfo.image_height = height;
+    cinfo.input_components = fed_components(feed);
+    cinfo.in_color_space = feed.gray ? JCS_GRAYSCALE
+                         : feed.alpha ? JCS_EXT_RGBX : JCS_RGB; // Composited rows keep 4 bytes per pixel
+
+    // Set compression parameters
+#ifdef JPEG_C_PARAM_SUPPORTED
+    // mozjpeg chooses its defaults by compression profile, which outlives the image in the
+    // reused compressor, so it is set every time. Its own default is maximum compression.
+    bool fastest = capture || profile == Profile::Fast || profile == Profile::Balanced;
+    jpeg_c_set_int_param(&cinfo, JINT_COMPRESS_PROFILE, fastest ? JCP_FASTEST : JCP_MAX_COMPRESSION);
+#endif
+    jpeg_set_defaults(&cinfo);            // Default JPEG params
+    jpeg_set_quality(&cinfo, quality, TRUE); // Set quality [1-100]
+    if (capture) {
+        jpeg_simple_progression(&cinfo); // Full-image coefficient buffer
+    } else {
+        apply_profile(cinfo, profile);
+    }
+}
+
+// Encodes the decoded image in context.feed at 'quality' into 'out'. With 'capture' the pass
+// stops once the forward DCT is done: in progressive mode libjpeg keeps all (quantized)
+// coefficients of the image for the later scans, and the caller takes them from there (see
+// captured_arrays()) before abandoning the compression with jpeg_abort_compress(). Only the
+// first (DC) scan gets entropy-coded. Runs under the caller's setjmp(), so it holds no
+// objects with destructors.
+void compress_rows(ConversionContext& context, int height, int quality, Profile profile, bool capture,
+                   std::vector<uint8_t>& out) {
+    jpeg_compress_struct& cinfo = context.cinfo;
+    configure_compressor(context, context.feed, height, quality, profile, capture, out);
+
+    // Start compression process
+    jpeg_start_compress(&cinfo, TRUE);
+
+    // Write metadata blocks to JPEG
+    if (!capture) {
+        preserve_metadata(cinfo, context.metadata);
+    }
+
+    // Write scanlines
+    feed_rows(cinfo, context.feed, 0, context);
+
+    if (capture) {
+        return;
+    }
+
+    // Finish compression
+    jpeg_finish_compress(&cinfo);
+}
+
+// === Color profiles ===
+// JPEG has no color signaling of its own: untagged, an image is taken for sRGB, and the
+// Display P3 or BT.2020 colors of camera HEICs come out shifted. The image's ICC profile is
+// copied as is; an nclx description becomes a matrix/TRC ICC profile for the pixels as they
+// are encoded (after any reduction of wide samples), built once per distinct description
+// and kept for the process. Either is written as APP2 ICC_PROFILE markers, split into
+// chunks when larger than one marker. sRGB is left untagged. Pixels are left as they are
+// unless converted to sRGB instead (see "Conversion to sRGB").
+
+const char ICC_MARKER_NAME[] = "ICC_PROFILE";                   // Written with its NUL terminator
+const size_t ICC_HEADER_SIZE = sizeof(ICC_MARKER_NAME) + 2;     // Plus chunk number and count
+const size_t ICC_CHUNK_SIZE = MAX_MARKER_PAYLOAD - ICC_HEADER_SIZE;
+const size_t ICC_MAX_CHUNKS = 255;
+const float BT709_PRIMARIES[8] = {0.64f, 0.33f, 0.30f, 0.60f, 0.15f, 0.06f, 0.3127f, 0.3290f}; // Also sRGB's
+
+// Color of an nclx description as an ICC profile describes it. Plain floats and ints only
+// (no padding), so the bytes are the cache key.
+struct IccColor {
+    int32_t primaries_code;                 // nclx color_primaries (names the profile)
+    float primaries[8];                     // Red, green, blue and white x, y
+    int32_t curve_type;                     // ICC parametricCurveType function type
+    float curve[5];                         // Its parameters g, a, b, c, d
+};
+
+// Describes the encoded samples of an image with an nclx profile, or returns false when they
+// need no profile (sRGB) or no ICC curve describes them (HDR code values kept by clipping).
+// 'reduction' is the reduction of wide samples, if any.
+bool nclx_icc_color(const heif_color_profile_nclx& nclx, const SampleReduction* reduction, IccColor& color) {
+    color = IccColor{};
+    color.primaries_code = nclx.color_primaries;
+    bool bt709_primaries = nclx.color_primaries == heif_color_primaries_ITU_R_BT_709_5 ||
+                           nclx.color_primaries == heif_color_primaries_unspecified ||
+                           nclx.color_primary_red_x <= 0;
+    if (bt709_primaries) {
+        color.primaries_code = heif_color_primaries_ITU_R_BT_709_5;
+        std::copy(BT709_PRIMARIES, BT709_PRIMARIES + 8, color.primaries);
+    } else {
+        const float xy[8] = {nclx.color_primary_red_x, nclx.color_primary_red_y, nclx.color_primary_green_x,
+                             nclx.color_primary_green_y, nclx.color_primary_blue_x, nclx.color_primary_blue_y,
+                             nclx.color_primary_white_x, nclx.color_primary_white_y};
+        std::copy(xy, xy + 8, color.primaries);
+    }
+
+    // The curve of the samples as encoded: reduced wide samples follow the reduction's
+    HdrMode mode = reduction ? reduction->mode : HdrMode::Clip;
+    int transfer = nclx.transfer_characteristics;
+    bool srgb_curve = false;
+    if (mode == HdrMode::ToneMap) {
+        srgb_curve = true;
+    } else if (mode == HdrMode::Gamma || transfer == heif_transfer_characteristic_ITU_R_BT_470_6_System_M) {
+        color.curve_type = 0;
+        color.curve[0] = 2.2f;
+    } else if (hdr_transfer(transfer)) {
+        return false;
+    } else if (transfer == heif_transfer_characteristic_ITU_R_BT_470_6_System_B_G) {
+        color.curve_type = 0;
+        color.curve[0] = 2.8f;
+    } else if (transfer == heif_transfer_characteristic_linear) {
+        color.curve_type = 0;
+        color.curve[0] = 1.0f;
+    } else {
+        srgb_curve = true;                  // Other SDR transfers, as to_linear() takes them
+    }
+    if (srgb_curve) {
+        if (bt709_primaries) return false;
+        color.curve_type = 3;
+        const float srgb[5] = {2.4f, 1 / 1.055f, 0.055f / 1.055f, 1 / 12.92f, 0.04045f};
+        std::copy(srgb, srgb + 5, color.curve);
+    }
+    return true;
+}
+
+// Big-endian writer for ICC profile data
+class IccWriter {
+public:
+    std::vector<uint8_t> data;
+
+    void u16(uint32_t value) {
+        data.push_back(static_cast<uint8_t>(value >> 8));
+        data.push_back(static_cast<uint8_t>(value));
+    }
+    void u32(uint32_t value) {
+        u16(value >> 16);
+        u16(value & 0xFFFF);
+    }
+    void tag(const char* signature) { data.insert(data.end(), signature, signature + 4); }
+    void s15f16(double value) { u32(static_cast<uint32_t>(static_cast<int32_t>(std::lround(value * 65536)))); }
+    void pad() {
+        while (data.size() % 4) data.push_back(0);
+    }
+    void put_u32(size_t offset, uint32_t value) {
+        for (int i = 0; i < 4; i++) data[offset + i] = static_cast<uint8_t>(value >> (24 - 8 * i));
+    }
+};
+
+void invert_3x3(const double m[9], double out[9]) {
+    double det = m[0] * (m[4] * m[8] - m[5] * m[7]) - m[1] * (m[3] * m[8] - m[5] * m[6]) +
+                 m[2] * (m[3] * m[7] - m[4] * m[6]);
+    out[0] = (m[4] * m[8] - m[5] * m[7]) / det;
+    out[1] = (m[2] * m[7] - m[1] * m[8]) / det;
+    out[2] = (m[1] * m[5] - m[2] * m[4]) / det;
+    out[3] = (m[5] * m[6] - m[3] * m[8]) / det;
+    out[4] = (m[0] * m[8] - m[2] * m[6]) / det;
+    out[5] = (m[2] * m[3] - m[0] * m[5]) / det;
+    out[6] = (m[3] * m[7] - m[4] * m[6]) / det;
+    out[7] = (m[1] * m[6] - m[0] * m[7]) / det;
+    out[8] = (m[0] * m[4] - m[1] * m[3]) / det;
+}
+
+void multiply_3x3(const double a[9], const double b[9], double out[9]) {
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            out[r * 3 + c] = a[r * 3] * b[c] + a[r * 3 + 1] * b[3 + c] + a[r * 3 + 2] * b[6 + c];
+        }
+    }
+}
+
+const double D50_WHITE[3] = {0.9642, 1.0, 0.8249};     // ICC profile connection space white
+
+// RGB to XYZ of primaries and white point given as x, y (rows X, Y, Z; white at Y = 1)
+void rgb_to_xyz(const float primaries[8], double out[9]) {
+    double p[9];
+    for (int i = 0; i < 3; i++) {
+        double x = primaries[2 * i], y = primaries[2 * i + 1];
+        p[i] = x / y;
+        p[3 + i] = 1;
+        p[6 + i] = (1 - x - y) / y;
+    }
+    double wx = primaries[6], wy = primaries[7];
+    double white[3] = {wx / wy, 1, (1 - wx - wy) / wy};
+    double inverse[9];
+    invert_3x3(p, inverse);
+    for (int i = 0; i < 3; i++) {
+        double scale = inverse[i * 3] * white[0] + inverse[i * 3 + 1] * white[1] + inverse[i * 3 + 2] * white[2];
+        for (int r = 0; r < 3; r++) out[r * 3 + i] = p[r * 3 + i] * scale;
+    }
+}
+
+// Bradford adaptation from the white point given as x, y to D50
+void bradford_to_d50(double white_x, double white_y, double out[9]) {
+    const double bradford[9] = {0.8951, 0.2664, -0.1614, -0.7502, 1.7135, 0.0367, 0.0389, -0.0685, 1.0296};
+    double white[3] = {white_x / white_y, 1, (1 - white_x - white_y) / white_y};
+    double scale[9] = {};
+    for (int i = 0; i < 3; i++) {
+        double source = bradford[i * 3] * white[0] + bradford[i * 3 + 1] * white[1] + bradford[i * 3 + 2] * white[2];
+        double target = bradford[i * 3] * D50_WHITE[0] + bradford[i * 3 + 1] * D50_WHITE[1] +
+                         bradford[i * 3 + 2] * D50_WHITE[2];
+        scale[i * 4] = target / source;
+    }
+    double inverse[9], scaled[9];
+    invert_3x3(bradford, inverse);
+    multiply_3x3(scale, bradford, scaled);
+    multiply_3x3(inverse, scaled, out);
+}
+
+// RGB to the connection space (D50 XYZ) for primaries and white point given as x, y
+void rgb_to_pcs(const float primaries[8], double out[9]) {
+    double to_xyz[9], adapt[9];
+    rgb_to_xyz(primaries, to_xyz);
+    bradford_to_d50(primaries[6], primaries[7], adapt);
+    multiply_3x3(adapt, to_xyz, out);
+}
+
+// ICC v4 display profile (matrix/TRC) for 'color'
+std::vector<uint8_t> build_icc_profile(const IccColor& color) {
+    std::string description;
+    switch (color.primaries_code) {
+        case heif_color_primaries_ITU_R_BT_709_5: description = "sRGB primaries"; break;
+        case heif_color_primaries_ITU_R_BT_2020_2_and_2100_0: description = "BT.2020"; break;
+        case heif_color_primaries_SMPTE_EG_432_1: description = "Display P3"; break;
+        default: description = "nclx primaries " + std::to_string(color.primaries_code); break;
+    }
+    if (color.curve_type == 0) {
+        char gamma[32];
+        snprintf(gamma, sizeof(gamma), ", gamma %.1f", color.curve[0]);
+        description += gamma;
+    }
+
+    double adapt[9], to_pcs[9];
+    bradford_to_d50(color.primaries[6], color.primaries[7], adapt);
+    rgb_to_pcs(color.primaries, to_pcs);
+
+    IccWriter icc;
+    icc.data.resize(128);                   // Header, filled in below
+    const char* tags[] = {"desc", "cprt", "wtpt", "chad", "rXYZ", "gXYZ", "bXYZ", "rTRC", "gTRC", "bTRC"};
+    const int tag_count = 10;
+    icc.u32(tag_count);
+    size_t table = icc.data.size();
+    icc.data.resize(table + tag_count * 12);
+
+    auto begin_tag = [&](int index) {
+        icc.pad();
+        std::memcpy(&icc.data[table + index * 12], tags[index], 4);
+        icc.put_u32(table + index * 12 + 4, static_cast<uint32_t>(icc.data.size()));
+        return icc.data.size();
+    };
+    auto end_tag = [&](int index, size_t start) {
+        icc.put_u32(table + index * 12 + 8, static_cast<uint32_t>(icc.data.size() - start));
+    };
+    auto text = [&](int index, const std::string& value) {
+        size_t start = begin_tag(index);
+        icc.tag("mluc");
+        icc.u32(0);
+        icc.u32(1);                         // One record
+        icc.u32(12);
+        icc.tag("enUS");
+        icc.u32(static_cast<uint32_t>(value.size() * 2));
+        icc.u32(28);
+        for (char c : value) icc.u16(static_cast<uint8_t>(c));
+        end_tag(index, start);
+    };
+    auto xyz = [&](int index, double x, double y, double z) {
+        size_t start = begin_tag(index);
+        icc.tag("XYZ ");
+        icc.u32(0);
+        icc.s15f16(x);
+        icc.s15f16(y);
+        icc.s15f16(z);
+        end_tag(index, start);
+    };
+
+    text(0, description);
+    text(1, "No copyright, use freely");
+    xyz(2, D50_WHITE[0], D50_WHITE[1], D50_WHITE[2]);
+    size_t chad = begin_tag(3);
+    icc.tag("sf32");
+    icc.u32(0);
+    for (double value : adapt) icc.s15f16(value);
+    end_tag(3, chad);
+    for (int i = 0; i < 3; i++) {
+        xyz(4 + i, to_pcs[i], to_pcs[3 + i], to_pcs[6 + i]);
+    }
+    size_t curve = begin_tag(7);
+    icc.tag("para");
+    icc.u32(0);
+    icc.u16(static_cast<uint32_t>(color.curve_type));
+    icc.u16(0);
+    for (int i = 0; i < (color.curve_type == 3 ? 5 : 1); i++) icc.s15f16(color.curve[i]);
+    end_tag(7, curve);
+    for (int i = 8; i < 10; i++) {          // The three channels share the curve
+        std::memcpy(&icc.data[table + i * 12], tags[i], 4);
+        std::memcpy(&icc.data[table + i * 12 + 4], &icc.data[table + 7 * 12 + 4], 8);
+    }
+    icc.pad();
+
+    // Header
+    icc.put_u32(0, static_cast<uint32_t>(icc.data.size()));
+    icc.put_u32(8, 0x04300000);             // Version 4.3
+    std::memcpy(&icc.data[12], "mntrRGB XYZ ", 12);
+    const uint8_t date[12] = {0x07, 0xE8, 0, 1, 0, 1};  // 2024-01-01, fixed for reproducible output
+    std::memcpy(&icc.data[24], date, sizeof(date));
+    std::memcpy(&icc.data[36], "acsp", 4);
+    IccWriter illuminant;
+    for (double value : D50_WHITE) illuminant.s15f16(value);
+    std::memcpy(&icc.data[68], illuminant.data.data(), 12);
+    return icc.data;
+}
+
+// APP2 payload of the profile synthesized for 'color', built on first use. Entries are never
+// removed, so the reference stays valid.
+const std::vector<uint8_t>& synthesized_icc_payload(const IccColor& color) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::vector<uint8_t>> payloads;
+    std::string key(reinterpret_cast<const char*>(&color), sizeof(color));
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = payloads.find(key);
+    if (it != payloads.end()) return it->second;
+
+    std::vector<uint8_t> profile = build_icc_profile(color);
+    std::vector<uint8_t> payload(ICC_MARKER_NAME, ICC_MARKER_NAME + sizeof(ICC_MARKER_NAME));
+    payload.push_back(1);
+    payload.push_back(1);
+    payload.insert(payload.end(), profile.begin(), profile.end());
+    return payloads.emplace(std::move(key), std::move(payload)).first->second;
+}
+
+// === Conversion to sRGB ===
+// For consumers that ignore ICC profiles, 'to_srgb' converts the colors themselves instead of
+// tagging them: through the connection space, with clipping of colors outside sRGB (relative
+// colorimetric). This covers the nclx descriptions (Display P3, BT.2020, ...) and embedded
+// profiles of the matrix/TRC kind, which is what cameras and phones write; other profiles
+// are still copied. A conversion is built once per distinct profile and kept for the
+// process as one table per channel with the curve and matrix folded in: per pixel it costs
+// three vector lookups and adds, and three lookups of the sRGB curve (convert_to_srgb(),
+// fused into the feed).
+
+// ICC parametricCurveType function 'type' with parameters g, a, b, c, d, e, f at 'x'
+double parametric_curve(int type, const double* p, double x) {
+    switch (type) {
+        case 0: return std::pow(x, p[0]);
+        case 1: return x >= -p[2] / p[1] ? std::pow(p[1] * x + p[2], p[0]) : 0;
+        case 2: return x >= -p[2] / p[1] ? std::pow(p[1] * x + p[2], p[0]) + p[3] : p[3];
+        case 3: return x >= p[4] ? std::pow(p[1] * x + p[2], p[0]) : p[3] * x;
+        default: return x >= p[4] ? std::pow(p[1] * x + p[2], p[0]) + p[5] : p[3] * x + p[6];
+    }
+}
+
+uint32_t icc_u32(const uint8_t* data) {
+    return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+double icc_s15f16(const uint8_t* data) {
+    return static_cast<int32_t>(icc_u32(data)) / 65536.0;
+}
+
+// Finds the tag 'signature' of at least 'minimum' bytes with type 'type' in 'profile'
+const uint8_t* find_icc_tag(const uint8_t* profile, size_t size, const char* signature, const char* type,
+                            uint32_t minimum, uint32_t& length) {
+    uint32_t count = icc_u32(profile + 128);
+    if (count > (size - 132) / 12) return nullptr;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* entry = profile + 132 + i * 12;
+        if (std::memcmp(entry, signature, 4) != 0) continue;
+        uint32_t offset = icc_u32(entry + 4);
+        length = icc_u32(entry + 8);
+        if (offset > size || length > size - offset || length < minimum) return nullptr;
+        if (type && std::memcmp(profile + offset, type, 4) != 0) return nullptr;
+        return profile + offset;
+    }
+    return nullptr;
+}
+
+// Code values of the curve tag (curv or para) 'signature' in linear light
+bool read_icc_curve(const uint8_t* profile, size_t size, const char* signature, float linear[256]) {
+    uint32_t length = 0;
+    const uint8_t* tag = find_icc_tag(profile, size, signature, nullptr, 12, length);
+    if (!tag) return false;
+    double p[7] = {};
+    int type = 0;
+    uint32_t points = 0;
+    if (std::memcmp(tag, "curv", 4) == 0) {
+        points = icc_u32(tag + 8);
+        if (points > (length - 12) / 2) return false;
+        p[0] = points == 1 ? ((tag[12] << 8) | tag[13]) / 256.0 : 1.0;
+    } else if (std::memcmp(tag, "para", 4) == 0) {
+        const uint32_t parameters[5] = {1, 3, 4, 5, 7};
+        type = (tag[8] << 8) | tag[9];
+        if (type > 4 || length < 12 + 4 * parameters[type]) return false;
+        for (uint32_t i = 0; i < parameters[type]; i++) p[i] = icc_s15f16(tag + 12 + 4 * i);
+    } else {
+        return false;
+    }
+
+    for (int code = 0; code < 256; code++) {
+        double x = code / 255.0, value;
+        if (points > 1) {
+            // Sampled curve, interpolated
+            double position = x * (points - 1);
+            uint32_t index = std::min(static_cast<uint32_t>(position), points - 2);
+            double low = (tag[12 + 2 * index] << 8) | tag[13 + 2 * index];
+            double high = (tag[14 + 2 * index] << 8) | tag[15 + 2 * index];
+            value = (low + (high - low) * (position - index)) / 65535;
+        } else {
+            value = parametric_curve(type, p, x);
+        }
+        linear[code] = value >= 0 ? static_cast<float>(value) : 0.0f;   // Also NaN
+    }
+    return true;
+}
+
+// Reads a matrix/TRC RGB profile: its matrix to the connection space and channel curves.
+// False for other kinds of profiles.
+bool read_icc_matrix_profile(const uint8_t* profile, size_t size, double to_pcs[9], float linear[3][256]) {
+    if (size < 132 || std::memcmp(profile + 16, "RGB ", 4) != 0 || std::memcmp(profile + 20, "XYZ ", 4) != 0) {
+        return false;
+    }
+    const char* columns[3] = {"rXYZ", "gXYZ", "bXYZ"};
+    const char* curves[3] = {"rTRC", "gTRC", "bTRC"};
+    for (int c = 0; c < 3; c++) {
+        uint32_t length = 0;
+        const uint8_t* tag = find_icc_tag(profile, size, columns[c], "XYZ ", 20, length);
+        if (!tag) return false;
+        for (int r = 0; r < 3; r++) to_pcs[r * 3 + c] = icc_s15f16(tag + 8 + 4 * r);
+        if (!read_icc_curve(profile, size, curves[c], linear[c])) return false;
+    }
+    return true;
+}
+
+// Builds 'gamut' for a source with matrix 'to_pcs' to the connection space and curves 'linear'
+void build_gamut_conversion(const double to_pcs[9], const float linear[3][256], GamutConversion& gamut) {
+    double srgb_to_pcs[9], from_pcs[9], matrix[9];
+    rgb_to_pcs(BT709_PRIMARIES, srgb_to_pcs);
+    invert_3x3(srgb_to_pcs, from_pcs);
+    multiply_3x3(from_pcs, to_pcs, matrix);
+
+    // Within rounding of the profile's fixed-point values of sRGB itself
+    gamut.needed = false;
+    for (int i = 0; i < 9; i++) {
+        gamut.needed |= std::abs(matrix[i] - (i % 4 == 0 ? 1 : 0)) > 2e-3;
+    }
+    for (int c = 0; c < 3; c++) {
+        for (int code = 0; code < 256; code++) {
+            gamut.needed |= std::abs(linear[c][code] - to_linear(code / 255.0, -1)) > 1e-3;
+            for (int r = 0; r < 3; r++) {
+                gamut.contribution[c][code][r] = static_cast<float>(matrix[r * 3 + c] * linear[c][code] *
+                                                                    (SRGB_TABLE_SIZE - 1));
+            }
+            gamut.contribution[c][code][3] = 0;
+        }
+    }
+}
+
+// Conversion of the source 'key' identifies, built on first use from what 'describe' fills
+// in: the matrix to the connection space and each channel's code values in linear light.
+// nullptr when 'describe' does not know the source. Entries are never removed, so the
+// pointer stays valid.
+const GamutConversion* cached_gamut_conversion(const std::string& key,
+                                               const std::function<bool(double*, float (*)[256])>& describe) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<GamutConversion>> conversions;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = conversions.find(key);
+    if (it != conversions.end()) return it->second.get();
+
+    std::unique_ptr<GamutConversion> gamut;
+    double to_pcs[9];
+    float linear[3][256];
+    if (describe(to_pcs, linear)) {
+        gamut = std::make_unique<GamutConversion>();
+        build_gamut_conversion(to_pcs, linear, *gamut);
+    }
+    return conversions.emplace(key, std::move(gamut)).first->second.get();
+}
+
+// Appends the color profile of the image to 'metadata_blocks', its storage in 'arena'.
+// 'reduction' is the reduction of wide samples, if any. With 'to_srgb' a profile that can be
+// converted is not written; its conversion is returned instead (nullptr when none is needed).
+const GamutConversion* extract_color_profile(heif_image_handle* handle, const SampleReduction* reduction,
+                                             bool to_srgb, const std::string& source, ScratchArena& arena,
+                                             std::vector<MetadataBlock>& metadata_blocks) {
+    heif_color_profile_type type = heif_image_handle_get_color_profile_type(handle);
+    if (type == heif_color_profile_type_prof || type == heif_color_profile_type_rICC) {
+        // Describes the decoded code values, which a curve-changing reduction no longer are
+        if (reduction && !reduction->shift) return nullptr;
+        size_t size = heif_image_handle_get_raw_color_profile_size(handle);
+        size_t chunks = (size + ICC_CHUNK_SIZE - 1) / ICC_CHUNK_SIZE;
+        if (size == 0) return nullptr;
+
+        // Read behind room for all chunk headers, then move each chunk down behind its own
+        uint8_t* buffer = arena.allocate(chunks * ICC_HEADER_SIZE + size);
+        const uint8_t* profile = buffer + chunks * ICC_HEADER_SIZE;
+        if (heif_image_handle_get_raw_color_profile(handle, buffer + chunks * ICC_HEADER_SIZE).code != heif_error_Ok) {
+            return nullptr;
+        }
+        if (to_srgb) {
+            const GamutConversion* gamut = cached_gamut_conversion(
+                "icc:" + std::string(reinterpret_cast<const char*>(profile), size),
+                [&](double* to_pcs, float (*linear)[256]) {
+                    return read_icc_matrix_profile(profile, size, to_pcs, linear);
+                });
+            if (gamut) return gamut->needed ? gamut : nullptr;
+        }
+        if (chunks > ICC_MAX_CHUNKS) {
+            thread_safe_print("Warning: Dropping ICC profile of '" + source + "' (" + std::to_string(size) +
+                              " bytes is too large for JPEG)");
+            return nullptr;
+        }
+        for (size_t i = 0; i < chunks; i++) {
+            uint8_t* block = buffer + i * (ICC_HEADER_SIZE + ICC_CHUNK_SIZE);
+            size_t length = std::min(ICC_CHUNK_SIZE, size - i * ICC_CHUNK_SIZE);
+            std::memmove(block + ICC_HEADER_SIZE, profile + i * ICC_CHUNK_SIZE, length);
+            std::memcpy(block, ICC_MARKER_NAME, sizeof(ICC_MARKER_NAME));
+            block[sizeof(ICC_MARKER_NAME)] = static_cast<uint8_t>(i + 1);
+            block[sizeof(ICC_MARKER_NAME) + 1] = static_cast<uint8_t>(chunks);
+            metadata_blocks.push_back({JPEG_APP0 + 2, block, ICC_HEADER_SIZE + length});
+        }
+        return nullptr;
+    }
+
+    heif_color_profile_nclx* nclx = nullptr;
+    if (heif_image_handle_get_nclx_color_profile(handle, &nclx).code != heif_error_Ok || !nclx) return nullptr;
+    IccColor color;
+    bool tagged = nclx_icc_color(*nclx, reduction, color);
+    heif_nclx_color_profile_free(nclx);
+    if (!tagged) return nullptr;
+    if (to_srgb) {
+        return cached_gamut_conversion("nclx:" + std::string(reinterpret_cast<const char*>(&color), sizeof(color)),
+                                       [&](double* to_pcs, float (*linear)[256]) {
+            rgb_to_pcs(color.primaries, to_pcs);
+            double p[7] = {};
+            std::copy(color.curve, color.curve + 5, p);
+            for (int c = 0; c < 3; c++) {
+                for (int code = 0; code < 256; code++) {
+                    linear[c][code] = static_cast<float>(parametric_curve(color.curve_type, p, code / 255.0));
+                }
+            }
+            return true;
+        });
+    }
+
+    const std::vector<uint8_t>& payload = synthesized_icc_payload(color);
+    uint8_t* block = arena.allocate(payload.size());
+    std::memcpy(block, payload.data(), payload.size());
+    metadata_blocks.push_back({JPEG_APP0 + 2, block, payload.size()});
+    return nullptr;
+}
+
+// === Target size / SSIM search ===
+// The image goes through color conversion, downsampling and the forward DCT once (see
+// compress_rows()), at quality 100: every quantizer is 1, so the coefficients are merely
+// rounded. Each search step requantizes the saved coefficients for a candidate quality and
+// only entropy-codes them, through jpeg_write_coefficients().
+
+// Rounds quality 100 coefficients (quantizer 1) to the quantizers of one table. The
+// reference values were already rounded, so a value exactly halfway is as likely to have
+// been below as above: such ties round toward zero, where rounding them up would inflate
+// the output. Float arithmetic vectorizes; with the half-step offset and |value| < 2^14
+// its error stays far below the 0.5 / quantizer margin to the next integer.
+struct Requantizer {
+    float bias[DCTSIZE2];
+    float reciprocal[DCTSIZE2];
+
+    explicit Requantizer(const UINT16* table) {
+        for (int k = 0; k < DCTSIZE2; k++) {
+            int quantizer = std::max<int>(1, table[k]);
+            bias[k] = static_cast<float>((quantizer - 1) / 2) + 0.5f;
+            reciprocal[k] = 1.0f / static_cast<float>(quantizer);
+        }
+    }
+
+    void block(const JCOEF* in, JCOEF* out) const {
+        for (int k = 0; k < DCTSIZE2; k++) {
+            int value = in[k];
+            int sign = value >> 31;         // 0 or -1; branchless, so the loop vectorizes
+            int level = static_cast<int>((static_cast<float>((value ^ sign) - sign) + bias[k]) * reciprocal[k]);
+            out[k] = static_cast<JCOEF>((level ^ sign) - sign);
+        }
+    }
+};
+
+// Mean SSIM of the luma channel over 8x8 blocks, computed in the DCT domain. The JPEG DCT
+// is orthonormal, so a block's mean is DC / 8 and its variance (and the covariance with the
+// requantized block) is the sum over the AC coefficients / 64.
+double luma_ssim(const JCOEF* blocks, size_t block_count, const UINT16* quantval) {
+    const float C1 = (0.01f * 255) * (0.01f * 255);
+    const float C2 = (0.03f * 255) * (0.03f * 255);
+    Requantizer requantize(quantval);
+    double total = 0;
+    for (size_t b = 0; b < block_count; b++) {
+        const JCOEF* x = blocks + b * DCTSIZE2;
+        JCOEF levels[DCTSIZE2];
+        requantize.block(x, levels);
+        float mean_x = x[0] / 8.0f + 128;
+        float mean_y = levels[0] * static_cast<float>(quantval[0]) / 8.0f + 128;
+        float var_x = 0, var_y = 0, covariance = 0;
+        for (int k = 1; k < DCTSIZE2; k++) {
+            float y = static_cast<float>(levels[k] * quantval[k]);
+            var_x += static_cast<float>(x[k]) * x[k];
+            var_y += y * y;
+            covariance += x[k] * y;
+        }
+        var_x /= DCTSIZE2;
+        var_y /= DCTSIZE2;
+        covariance /= DCTSIZE2;
+        total += ((2 * mean_x * mean_y + C1) * (2 * covariance + C2)) /
+                 ((mean_x * mean_x + mean_y * mean_y + C1) * (var_x + var_y + C2));
+    }
+    return block_count > 0 ? total / block_count : 1.0;
+}
+
+// Coefficient arrays for a width x height image from the configured compressor, sized as
+// libjpeg's own (rounded up to whole MCUs), and start writing them with
+// jpeg_write_coefficients(), which realizes them
+void start_coefficient_write(jpeg_compress_struct& cinfo, int width, int height, jvirt_barray_ptr* arrays) {
+    int max_h = 1, max_v = 1;
+    for (int c = 0; c < cinfo.num_components; c++) {
+        max_h = std::max(max_h, cinfo.comp_info[c].h_samp_factor);
+        max_v = std::max(max_v, cinfo.comp_info[c].v_samp_factor);
+    }
+    for (int c = 0; c < cinfo.num_components; c++) {
+        jpeg_component_info* component = &cinfo.comp_info[c];
+        long h = component->h_samp_factor, v = component->v_samp_factor;
+        long wide = (width * h + max_h * DCTSIZE - 1) / (max_h * DCTSIZE);
+        long high = (height * v + max_v * DCTSIZE - 1) / (max_v * DCTSIZE);
+        arrays[c] = (*cinfo.mem->request_virt_barray)(reinterpret_cast<j_common_ptr>(&cinfo), JPOOL_IMAGE, FALSE,
+                                                      static_cast<JDIMENSION>((wide + h - 1) / h * h),
+                                                      static_cast<JDIMENSION>((high + v - 1) / v * v),
+                                                      static_cast<JDIMENSION>(v));
+    }
+    jpeg_write_coefficients(&cinfo, arrays);
+}
+
+// One search step: requantize the saved coefficients for 'quality' and write them, with
+// the profile's entropy coding and the metadata, into 'out'
+void write_requantized(ConversionContext& context, int width, int height, int quality, Profile profile,
+                       std::vector<uint8_t>& out) {
+    jpeg_compress_struct& cinfo = context.cinfo;
+    configure_compressor(context, context.feed, height, quality, profile, false, out);
+    jvirt_barray_ptr arrays[MAX_COMPONENTS];
+    start_coefficient_write(cinfo, width, height, arrays);
+
+    const JCOEF* in = context.coefficients.data();
+    for (int c = 0; c < cinfo.num_components; c++) {
+        jpeg_component_info* component = &cinfo.comp_info[c];
+        Requantizer requantize(cinfo.quant_tbl_ptrs[component->quant_tbl_no]->quantval);
+        for (JDIMENSION row = 0; row < component->height_in_blocks; row++) {
+            JBLOCKARRAY blocks = (*cinfo.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&cinfo), arrays[c],
+                                                                  row, 1, TRUE);
+            for (JDIMENSION col = 0; col < component->width_in_blocks; col++) {
+                requantize.block(in, blocks[0][col]);
+                in += DCTSIZE2;
+            }
+        }
+    }
+
+    preserve_metadata(cinfo, context.metadata);
+    jpeg_finish_compress(&cinfo);
+}
+
+// Whether the quality is searched rather than given
+bool target_search(const Options& options) {
+    return options.target_size > 0 || options.target_ssim > 0;
+}
+
+// Whether the encode may go through saved DCT coefficients (target search, lossless rotation)
+bool saves_coefficients(const Options& options) {
+    return target_search(options) || options.lossless_rotate;
+}
+
+// Pick the quality for options.target_size / target_ssim (at most options.quality) and
+// encode at it into 'jpeg'. SSIM and size are taken as monotonic in quality, so both are
+// binary searches: the lowest quality reaching the SSIM target, then the highest quality
+// up to that whose output fits the size target. Runs under the caller's setjmp().
+bool encode_to_target(ConversionContext& context, int width, int height, const std::string& source,
+                      const Options& options, std::vector<uint8_t>& jpeg, std::string& error) {
+    jpeg_compress_struct& cinfo = context.cinfo;
+
+    // Transform once
+    compress_rows(context, height, 100, options.profile, true, context.candidate);
+    jvirt_barray_ptr arrays[MAX_COMPONENTS];
+    captured_arrays(context, arrays);
+    save_coefficients(context, arrays);
+    jpeg_abort_compress(&cinfo);
+    size_t luma_blocks = static_cast<size_t>(cinfo.comp_info[0].width_in_blocks) * cinfo.comp_info[0].height_in_blocks;
+
+    int steps = 0;
+    int high = std::max(1, std::min(options.quality, 100));
+    if (options.target_ssim > 0) {
+        int low = 1;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            jpeg_set_quality(&cinfo, middle, TRUE);
+            if (luma_ssim(context.coefficients.data(), luma_blocks, cinfo.quant_tbl_ptrs[0]->quantval) >= options.target_ssim) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+            steps++;
+        }
+    }
+
+    int quality = high;
+    if (options.target_size > 0) {
+        // The JPEG of the best fitting quality so far is kept in 'jpeg'.
+        // The highest allowed quality is tried first: it often fits already.
+        quality = 0;
+        int low = 1;
+        int top = high - 1;
+        write_requantized(context, width, height, high, options.profile, context.candidate);
+        steps++;
+        if (context.candidate.size() <= options.target_size) {
+            quality = high;
+            jpeg.swap(context.candidate);
+            low = high;
+        }
+        while (low <= top) {
+            int middle = (low + top) / 2;
+            write_requantized(context, width, height, middle, options.profile, context.candidate);
+            steps++;
+            if (context.candidate.size() <= options.target_size) {
+                quality = middle;
+                jpeg.swap(context.candidate);
+                low = middle + 1;
+            } else {
+                top = middle - 1;
+            }
+        }
+    } else {
+        write_requantized(context, width, height, quality, options.profile, jpeg);
+        steps++;
+    }
+
+    if (quality == 0) {
+        error = "Cannot fit '" + source + "' into " + std::to_string(options.target_size) +
+                " bytes (quality 1 needs " + std::to_string(context.candidate.size()) + ")";
+        return false;
+    }
+    if (log_enabled()) {
+        jpeg_set_quality(&cinfo, quality, TRUE);
+        double ssim = luma_ssim(context.coefficients.data(), luma_blocks, cinfo.quant_tbl_ptrs[0]->quantval);
+        std::stringstream log;
+        log << "Selected quality " << quality << " for '" << source << "': " << jpeg.size() << " bytes, SSIM "
+            << ssim << " (" << steps << " search steps)";
+        thread_safe_print(log.str());
+    }
+    return true;
+}
+
+// === Intra-image parallelism ===
+// Workers without a job lend their core: once the queue has run dry, the jobs still running
+// may spread their own work over that many helper threads. A huge image at the end of a batch
+// is then encoded in strips instead of keeping one core busy while the others wait.
+
+// Cores lent by idle workers. Goes negative while a waiting worker takes a new job whose
+// core is still borrowed; borrowing only takes what is above zero.
+std::atomic<int>& idle_cores() {
+    static std::atomic<int> idle{0};
+    return idle;
+}
+
+// Take up to 'wanted' idle cores; they are given back with return_idle_cores()
+int borrow_idle_cores(int wanted) {
+    std::atomic<int>& idle = idle_cores();
+    int available = idle.load();
+    while (available > 0 && wanted > 0) {
+        int taken = std::min(available, wanted);
+        if (idle.compare_exchange_weak(available, available - taken)) {
+            return taken;
+        }
+    }
+    return 0;
+}
+
+void return_idle_cores(int count) {
+    idle_cores() += count;
+}
+
+// Threads that run the subtasks of a job. They are started on first demand and then stay,
+// so their conversion contexts (compressor and memory pools) are reused.
+class HelperPool {
+private:
+    struct Batch {
+        const std::function<void(size_t)>* task;
+        size_t count;
+        std::atomic<size_t> next{0};    // Next unclaimed index
+        size_t finished = 0;            // Guarded by the pool mutex, as is 'active'
+        int active = 0;                 // Helpers inside this batch
+        size_t retention_limit = 0;     // The caller's context_retention_limit
+    };
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::deque<Batch*> tickets;         // One per helper asked to join a batch
+    unsigned int thread_count = 0;
+
+    // Claim and run indices of 'batch' until none are left; returns how many were run
+    static size_t drain(Batch& batch) {
+        size_t ran = 0;
+        for (size_t index = batch.next++; index < batch.count; index = batch.next++) {
+            (*batch.task)(index);
+            ran++;
+        }
+        return ran;
+    }
+
+    void helper_thread() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_cv.wait(lock, [this] { return !tickets.empty(); });
+            Batch* batch = tickets.front();
+            tickets.pop_front();
+            batch->active++;
+            lock.unlock();
+            size_t ran = drain(*batch);
+            size_t retention_limit = batch->retention_limit;
+            lock.lock();
+            batch->finished += ran;
+            batch->active--;
+            done_cv.notify_all();
+
+            // The batch may be gone now; trim what its subtasks left in this thread's context
+            lock.unlock();
+            context_retention_limit = retention_limit;
+            trim_conversion_context();
+            lock.lock();
+        }
+    }
+
+public:
+    static HelperPool& instance() {
+        // Never destroyed: the threads wait on it until the process exits
+        static HelperPool* pool = new HelperPool();
+        return *pool;
+    }
+
+    // Run task(0) .. task(count - 1) on the calling thread and up to 'helpers' pool threads.
+    // Returns when all have finished. Tasks must not throw.
+    void run(size_t count, unsigned int helpers, const std::function<void(size_t)>& task) {
+        Batch batch;
+        batch.task = &task;
+        batch.count = count;
+        batch.retention_limit = context_retention_limit;
+        helpers = static_cast<unsigned int>(std::min<size_t>(helpers, count > 0 ? count - 1 : 0));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (thread_count < helpers) {
+                std::thread(&HelperPool::helper_thread, this).detach();
+                thread_count++;
+            }
+            for (unsigned int i = 0; i < helpers; i++) {
+                tickets.push_back(&batch);
+            }
+        }
+        work_cv.notify_all();
+
+        size_t ran = drain(batch);
+
+        // Tickets nobody picked up must not outlive the batch
+        std::unique_lock<std::mutex> lock(mutex);
+        batch.finished += ran;
+        tickets.erase(std::remove(tickets.begin(), tickets.end(), &batch), tickets.end());
+        done_cv.wait(lock, [&batch] { return batch.finished == batch.count && batch.active == 0; });
+    }
+};
+
+// Fork-join over the cores lent by idle workers: runs task(0) .. task(count - 1) on the
+// calling thread plus up to 'helpers' borrowed cores.
+void run_parallel(size_t count, unsigned int helpers, const std::function<void(size_t)>& task) {
+    HelperPool::instance().run(count, helpers, task);
+}
+
+// === Downscaling ===
+// With 'fit', an image beyond max_width x max_height is downscaled to fit the box instead of
+// being rejected. The filter is separable and runs on the rows as they would be fed (see
+// fed_row()), vertically first: that pass weights whole rows, so it is vectorized across all
+// samples whatever the channel layout, and the horizontal pass then only sees one
+// intermediate row per output row. Weights are fixed point (Q14, intermediate rows Q6), and
+// the output rows are split into bands filtered in parallel on borrowed cores. Each band
+// prepares the source rows it needs in a ring of one filter window, so no full-size 8-bit
+// copy of a wide or transparent image is made. The result is an 8-bit RGB image that the
+// encoder then reads like a decoded one.
+
+const int RESIZE_BAND_ROWS = 16;            // Output rows per parallel task
+const int WEIGHT_BITS = 14;                 // Fixed-point filter weights
+const int INTERMEDIATE_BITS = 6;            // Fraction bits of vertically filtered samples
+const size_t RESAMPLE_ROW_PADDING = 8;      // Samples readable behind an intermediate row
+
+// Filter taps of each output position along one axis: source positions [start, start + taps)
+// with Q14 weights summing to one. All outputs have the same number of taps, unused ones
+// weighted zero.
+struct ResampleAxis {
+    int taps = 0;
+    std::vector<int> start;
+    std::vector<int16_t> weights;           // 'taps' per output position
+};
+
+double lanczos3(double x) {
+    x = std::abs(x);
+    if (x < 1e-9) return 1;
+    if (x >= 3) return 0;
+    const double pi = 3.14159265358979323846;
+    return 3 * std::sin(pi * x) * std::sin(pi * x / 3) / (pi * pi * x * x);
+}
+
+// Plans the filter from 'in_size' positions to 'out_size'. Upscaling (tensor output) keeps
+// the filter one source pixel wide.
+void plan_axis(int in_size, int out_size, ResizeFilter filter, ResampleAxis& axis) {
+    double scale = static_cast<double>(in_size) / out_size;
+    double width = std::max(scale, 1.0);
+    double support = filter == ResizeFilter::Lanczos ? 3 * width : width / 2;
+    axis.taps = std::min(in_size, static_cast<int>(std::ceil(support)) * 2 + 2);
+    axis.start.resize(out_size);
+    axis.weights.assign(static_cast<size_t>(out_size) * axis.taps, 0);
+
+    std::vector<double> weights(axis.taps);
+    for (int i = 0; i < out_size; i++) {
+        double center = (i + 0.5) * scale;
+        int first = std::max(0, static_cast<int>(std::floor(center - support)));
+        int last = std::min(in_size, static_cast<int>(std::ceil(center + support)));
+        first = std::max(0, std::min(first, in_size - axis.taps));
+        last = std::min(last, first + axis.taps);
+        double total = 0;
+        for (int j = first; j < first + axis.taps; j++) {
+            double weight = 0;
+            if (j < last) {
+                if (filter == ResizeFilter::Lanczos) {
+                    weight = lanczos3((j + 0.5 - center) / width);
+                } else {
+                    // Coverage of source pixel j by the output pixel's footprint
+                    weight = std::max(0.0, std::min(j + 1.0, center + support) - std::max<double>(j, center - support));
+                }
+            }
+            weights[j - first] = weight;
+            total += weight;
+        }
+
+        // Normalized and rounded; the rounding error goes to the largest tap
+        int16_t* out = &axis.weights[static_cast<size_t>(i) * axis.taps];
+        int sum = 0, largest = 0;
+        for (int k = 0; k < axis.taps; k++) {
+            out[k] = static_cast<int16_t>(std::lround(weights[k] / total * (1 << WEIGHT_BITS)));
+            sum += out[k];
+            if (out[k] > out[largest]) largest = k;
+        }
+        out[largest] = static_cast<int16_t>(out[largest] + (1 << WEIGHT_BITS) - sum);
+        axis.start[i] = first;
+    }
+}
+
+// Vertical pass: 'length' samples of the weighted sum of 'taps' rows, into Q6 'out'
+void filter_rows(const uint8_t* const* rows, const int16_t* weights, int taps, size_t length, int16_t* out) {
+    const int shift = WEIGHT_BITS - INTERMEDIATE_BITS;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // Two rows per multiply-add: their samples interleaved as 16-bit pairs (an odd last row
+    // is paired with itself, weighted zero)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    for (; i + 16 <= length; i += 16) {
+        __m128i sums[4] = {round, round, round, round};
+        for (int k = 0; k < taps; k += 2) {
+            int next = k + 1 < taps ? k + 1 : k;
+            uint16_t next_weight = k + 1 < taps ? static_cast<uint16_t>(weights[next]) : 0;
+            __m128i pair = _mm_set1_epi32(static_cast<int>((static_cast<uint32_t>(next_weight) << 16) |
+                                                           static_cast<uint16_t>(weights[k])));
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[next] + i));
+            __m128i a_low = _mm_unpacklo_epi8(a, zero), b_low = _mm_unpacklo_epi8(b, zero);
+            __m128i a_high = _mm_unpackhi_epi8(a, zero), b_high = _mm_unpackhi_epi8(b, zero);
+            sums[0] = _mm_add_epi32(sums[0], _mm_madd_epi16(_mm_unpacklo_epi16(a_low, b_low), pair));
+            sums[1] = _mm_add_epi32(sums[1], _mm_madd_epi16(_mm_unpackhi_epi16(a_low, b_low), pair));
+            sums[2] = _mm_add_epi32(sums[2], _mm_madd_epi16(_mm_unpacklo_epi16(a_high, b_high), pair));
+            sums[3] = _mm_add_epi32(sums[3], _mm_madd_epi16(_mm_unpackhi_epi16(a_high, b_high), pair));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                         _mm_packs_epi32(_mm_srai_epi32(sums[0], shift), _mm_srai_epi32(sums[1], shift)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8),
+                         _mm_packs_epi32(_mm_srai_epi32(sums[2], shift), _mm_srai_epi32(sums[3], shift)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= length; i += 16) {
+        int32x4_t sums[4] = {vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0)};
+        for (int k = 0; k < taps; k++) {
+            uint8x16_t samples = vld1q_u8(rows[k] + i);
+            int16x8_t low = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(samples)));
+            int16x8_t high = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(samples)));
+            sums[0] = vmlal_n_s16(sums[0], vget_low_s16(low), weights[k]);
+            sums[1] = vmlal_n_s16(sums[1], vget_high_s16(low), weights[k]);
+            sums[2] = vmlal_n_s16(sums[2], vget_low_s16(high), weights[k]);
+            sums[3] = vmlal_n_s16(sums[3], vget_high_s16(high), weights[k]);
+        }
+        vst1q_s16(out + i, vcombine_s16(vqrshrn_n_s32(sums[0], shift), vqrshrn_n_s32(sums[1], shift)));
+        vst1q_s16(out + i + 8, vcombine_s16(vqrshrn_n_s32(sums[2], shift), vqrshrn_n_s32(sums[3], shift)));
+    }
+#endif
+    for (; i < length; i++) {
+        int sum = 1 << (shift - 1);
+        for (int k = 0; k < taps; k++) sum += weights[k] * rows[k][i];
+        out[i] = static_cast<int16_t>(std::min(std::max(sum >> shift, -32768), 32767));
+    }
+}
+
+// Horizontal pass: one Q6 row of 'channels' samples per pixel to 'axis.start.size()' 8-bit
+// RGB pixels. 'in' has RESAMPLE_ROW_PADDING samples of room behind the row.
+void filter_columns(const int16_t* in, int channels, const ResampleAxis& axis, uint8_t* out) {
+    const int shift = WEIGHT_BITS + INTERMEDIATE_BITS;
+    const int round = 1 << (shift - 1);
+    const int16_t* weights = axis.weights.data();
+#if defined(__SSE2__)
+    // Two taps per multiply-add: a pixel's samples interleaved with the next one's (its
+    // unaligned load reaches into the padding for the last taps of the row)
+    const __m128i rounding = _mm_set1_epi32(round);
+    auto pair_taps = [](__m128i samples, int channels) {
+        return _mm_unpacklo_epi16(samples, channels == 4 ? _mm_srli_si128(samples, 8) : _mm_srli_si128(samples, 6));
+    };
+    for (size_t x = 0; x < axis.start.size(); x++, weights += axis.taps, out += 3) {
+        const int16_t* pixel = in + static_cast<size_t>(axis.start[x]) * channels;
+        __m128i sums = rounding;
+        int k = 0;
+        for (; k + 2 <= axis.taps; k += 2, pixel += 2 * channels) {
+            int32_t pair;
+            std::memcpy(&pair, weights + k, sizeof(pair));
+            __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixel));
+            sums = _mm_add_epi32(sums, _mm_madd_epi16(pair_taps(samples, channels), _mm_set1_epi32(pair)));
+        }
+        if (k < axis.taps) {
+            __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixel));
+            __m128i last = _mm_set1_epi32(static_cast<uint16_t>(weights[k]));
+            sums = _mm_add_epi32(sums, _mm_madd_epi16(pair_taps(samples, channels), last));
+        }
+        __m128i bytes = _mm_srai_epi32(sums, shift);
+        bytes = _mm_packus_epi16(_mm_packs_epi32(bytes, bytes), bytes);
+        uint32_t rgb = static_cast<uint32_t>(_mm_cvtsi128_si32(bytes));
+        std::memcpy(out, &rgb, 3);          // Little-endian: red first
+    }
+    return;
+#endif
+    for (size_t x = 0; x < axis.start.size(); x++, weights += axis.taps, out += 3) {
+        const int16_t* pixel = in + static_cast<size_t>(axis.start[x]) * channels;
+        int red = round, green = round, blue = round;
+        for (int k = 0; k < axis.taps; k++, pixel += channels) {
+            red += weights[k] * pixel[0];
+            green += weights[k] * pixel[1];
+            blue += weights[k] * pixel[2];
+        }
+        out[0] = static_cast<uint8_t>(std::min(std::max(red >> shift, 0), 255));
+        out[1] = static_cast<uint8_t>(std::min(std::max(green >> shift, 0), 255));
+        out[2] = static_cast<uint8_t>(std::min(std::max(blue >> shift, 0), 255));
+    }
+}
+
+// Dimensions of a 'width' x 'height' image fitted into the box of 'options' (unchanged when
+// it fits)
+void fit_dimensions(int width, int height, const Options& options, int& fit_width, int& fit_height) {
+    double scale = 1;
+    if (options.max_width > 0) scale = std::min(scale, static_cast<double>(options.max_width) / width);
+    if (options.max_height > 0) scale = std::min(scale, static_cast<double>(options.max_height) / height);
+    fit_width = std::max(1, static_cast<int>(std::lround(width * scale)));
+    fit_height = std::max(1, static_cast<int>(std::lround(height * scale)));
+    if (options.max_width > 0) fit_width = std::min(fit_width, options.max_width);
+    if (options.max_height > 0) fit_height = std::min(fit_height, options.max_height);
+}
+
+// Downscales the 'height' rows of 'feed' to 'out_width' x 'out_height' 8-bit RGB in 'out'
+void resize_image(const RowFeed& feed, int height, int out_width, int out_height, ResizeFilter filter,
+                  std::vector<uint8_t>& out) {
+    ResampleAxis columns, rows;
+    plan_axis(feed.width, out_width, filter, columns);
+    plan_axis(height, out_height, filter, rows);
+    out.resize(static_cast<size_t>(out_width) * out_height * 3);
+
+    int channels = fed_components(feed);
+    size_t row_samples = static_cast<size_t>(feed.width) * channels;
+    bool plain = plain_rows(feed);
+    int bands = (out_height + RESIZE_BAND_ROWS - 1) / RESIZE_BAND_ROWS;
+    auto band = [&](size_t index) {
+        ConversionContext& context = thread_conversion_context();
+        context.resample.resize(row_samples + RESAMPLE_ROW_PADDING);
+
+        // Source rows of the filter window, prepared into a ring of 'taps' rows when needed
+        std::vector<const uint8_t*> window(rows.taps);
+        if (!plain) context.band.resize(row_samples * rows.taps);
+        int prepared = 0;                   // Source rows before this one are in the ring
+        int first = static_cast<int>(index) * RESIZE_BAND_ROWS;
+        int last = std::min(out_height, first + RESIZE_BAND_ROWS);
+        for (int y = first; y < last; y++) {
+            int start = rows.start[y];
+            if (plain) {
+                for (int k = 0; k < rows.taps; k++) window[k] = feed.rows[start + k];
+            } else {
+                for (int source = std::max(prepared, start); source < start + rows.taps; source++) {
+                    fed_row(feed, feed.rows[source], context.band.data() + row_samples * (source % rows.taps));
+                }
+                prepared = start + rows.taps;
+                for (int k = 0; k < rows.taps; k++) {
+                    window[k] = context.band.data() + row_samples * ((start + k) % rows.taps);
+                }
+            }
+            filter_rows(window.data(), &rows.weights[static_cast<size_t>(y) * rows.taps], rows.taps, row_samples,
+                        context.resample.data());
+            filter_columns(context.resample.data(), channels, columns, &out[static_cast<size_t>(y) * out_width * 3]);
+        }
+    };
+
+    int helpers = borrow_idle_cores(bands - 1);
+    run_parallel(static_cast<size_t>(bands), static_cast<unsigned int>(helpers), band);
+    return_idle_cores(helpers);
+}
+
+// === Strip encoding ===
+// A large image is cut into horizontal strips of whole MCU rows, each encoded on its own
+// thread as a standalone baseline JPEG. The restart interval is one strip, so the strips'
+// entropy-coded data can be concatenated with RST markers in between (a restart resets the
+// DC predictors, which is what each strip started with). The first strip's headers serve
+// for the whole image, with the frame height patched. Decoded pixels are identical to a
+// single-threaded encode. Only possible with fixed Huffman tables and a single scan.
+
+const size_t STRIP_ENCODE_MIN_PIXELS = 8 * 1000 * 1000; // Smaller images encode fast enough
+const int STRIP_MIN_MCU_ROWS = 8;                       // No strips below 128 lines
+const int MCU_SIZE = 2 * DCTSIZE;   // jpeg_set_defaults() samples chroma 2x2 (4:2:0)
+const long MAX_RESTART_INTERVAL = 65535;                // DRI is a 16-bit count of MCUs
+
+// Whether the profile writes one baseline scan with the standard Huffman tables
+bool fixed_huffman_baseline(Profile profile) {
+#ifdef JPEG_C_PARAM_SUPPORTED
+    return profile == Profile::Fast;    // mozjpeg's default is progressive with optimized tables
+#else
+    return profile == Profile::Default || profile == Profile::Fast;
+#endif
+}
+
+// MCU rows per strip for splitting an image over 'threads' threads, or 0 when it cannot or
+// should not be split. Two strips per thread even out strips that code slower than others.
+// libjpeg only checks the size of each strip, so frames beyond the 16-bit SOF dimensions
+// are left to the serial encode, which rejects them.
+int plan_strip_rows(int width, int height, unsigned int threads) {
+    if (width > JPEG_MAX_DIMENSION || height > JPEG_MAX_DIMENSION) return 0;
+    long mcus_per_row = (width + MCU_SIZE - 1) / MCU_SIZE;
+    long mcu_rows = (height + MCU_SIZE - 1) / MCU_SIZE;
+    long strip_rows = std::max<long>(STRIP_MIN_MCU_ROWS, (mcu_rows + threads * 2 - 1) / (threads * 2));
+    strip_rows = std::min(strip_rows, MAX_RESTART_INTERVAL / mcus_per_row);
+    if (strip_rows <= 0 || strip_rows >= mcu_rows) return 0;
+    return static_cast<int>(strip_rows);
+}
+
+// Encode rows [first_row, first_row + row_count) of the image as a standalone JPEG with the
+// given restart interval, on the calling thread's compressor. Metadata goes into the first
+// strip only.
+bool encode_strip(const RowFeed& feed, int first_row, int row_count, const Options& options,
+                  unsigned int restart_interval, const std::vector<MetadataBlock>* metadata,
+                  std::vector<uint8_t>& out, std::string& error) {
+    TraceScope stage("strip");
+    ConversionContext& context = thread_conversion_context();
+    jpeg_compress_struct& cinfo = context.cinfo;
+    context.memory.reattach(reinterpret_cast<j_common_ptr>(&cinfo));
+
+    if (setjmp(context.jerr.setjmp_buffer)) {
+        error = libjpeg_error(context.jerr, "during compression");
+        jpeg_abort_compress(&cinfo);
+        return false;
+    }
+
+    configure_compressor(context, feed, row_count, options.quality, options.profile, false, out);
+    cinfo.restart_interval = restart_interval;
+    jpeg_start_compress(&cinfo, TRUE);
+    if (metadata) {
+        preserve_metadata(cinfo, *metadata);
+    }
+    feed_rows(cinfo, feed, first_row, context);
+    jpeg_finish_compress(&cinfo);
+    return true;
+}
+
+// Offsets of the frame header (SOF marker) and of the entropy-coded data following the scan
+// header in a JPEG written by libjpeg. False if the markers are not as expected.
+bool find_scan_data(const std::vector<uint8_t>& jpeg, size_t& sof_offset, size_t& data_offset) {
+    sof_offset = 0;
+    size_t pos = 2;     // After SOI
+    while (pos + 4 <= jpeg.size() && jpeg[pos] == 0xFF) {
+        uint8_t marker = jpeg[pos + 1];
+        size_t length = (static_cast<size_t>(jpeg[pos + 2]) << 8) | jpeg[pos + 3];
+        if (marker == 0xC0 || marker == 0xC1) {
+            sof_offset = pos;
+        } else if (marker == 0xDA) {
+            data_offset = pos + 2 + length;
+            return sof_offset != 0 && data_offset + 2 <= jpeg.size();
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+// Encode context.feed in strips on the calling thread and 'helpers' borrowed cores, and
+// stitch them into one JPEG in 'jpeg'
+bool encode_in_strips(ConversionContext& context, int width, int height, const Options& options,
+                      unsigned int helpers, int strip_rows, std::vector<uint8_t>& jpeg, std::string& error) {
+    long mcus_per_row = (width + MCU_SIZE - 1) / MCU_SIZE;
+    int strip_height = strip_rows * MCU_SIZE;
+    size_t strip_count = (height + strip_height - 1) / strip_height;
+    unsigned int restart_interval = static_cast<unsigned int>(mcus_per_row * strip_rows);
+
+    std::vector<std::vector<uint8_t>> strips(strip_count);
+    std::vector<std::string> strip_errors(strip_count);
+    std::atomic<bool> failed{false};
+    const RowFeed& feed = context.feed;
+    const std::vector<MetadataBlock>* metadata = &context.metadata;
+    run_parallel(strip_count, helpers, [&](size_t index) {
+        int first_row = static_cast<int>(index) * strip_height;
+        int row_count = std::min(strip_height, height - first_row);
+        std::vector<uint8_t>& out = index == 0 ? jpeg : strips[index];
+        if (!encode_strip(feed, first_row, row_count, options, restart_interval,
+                          index == 0 ? metadata : nullptr, out, strip_errors[index])) {
+            failed = true;
+        }
+    });
+    if (failed) {
+        for (const auto& strip_error : strip_errors) {
+            if (!strip_error.empty()) {
+                error = strip_error;
+                break;
+            }
+        }
+        return false;
+    }
+
+    // Headers and data of the first strip, then RSTn and data of each following strip
+    size_t sof_offset = 0, data_offset = 0;
+    if (!find_scan_data(jpeg, sof_offset, data_offset)) {
+        error = "Unexpected JPEG markers in encoded strip";
+        return false;
+    }
+    jpeg[sof_offset + 5] = static_cast<uint8_t>(height >> 8);  // Frame height
+    jpeg[sof_offset + 6] = static_cast<uint8_t>(height);
+    jpeg.resize(jpeg.size() - 2);                              // Drop EOI
+    for (size_t index = 1; index < strip_count; index++) {
+        const std::vector<uint8_t>& strip = strips[index];
+        size_t strip_sof = 0, strip_data = 0;
+        if (!find_scan_data(strip, strip_sof, strip_data)) {
+            error = "Unexpected JPEG markers in encoded strip";
+            return false;
+        }
+        jpeg.push_back(0xFF);
+        jpeg.push_back(static_cast<uint8_t>(JPEG_RST0 + (index - 1) % 8));
+        jpeg.insert(jpeg.end(), strip.begin() + strip_data, strip.end() - 2);
+    }
+    jpeg.push_back(0xFF);
+    jpeg.push_back(static_cast<uint8_t>(JPEG_EOI));
+    return true;
+}
+
+// === Lossless rotation ===
+// Instead of libheif rotating the decoded frame, the image is encoded as stored and the
+// Exif orientation is applied to its quantized DCT coefficients, as jpegtran does: each
+// block moves to its rotated position and is transposed, with the sign of the odd
+// frequencies flipped along mirrored axes (and the quantization tables transposed with
+// them). The result decodes to the stored encode, rotated. Mirroring an axis moves the
+// padding of a partial MCU into the image, so the stored size must fill whole MCUs along
+// mirrored axes; other images are rotated by libheif.
+
+const int ROTATE_MAX_HELPERS = 3;   // Memory bound: more cores stop helping
+const int ROTATE_TASK_MCU_ROWS = 8; // Output MCU rows per parallel task
+
+#if defined(__SSE2__)
+inline void transpose_block(__m128i* rows) {
+    __m128i a0 = _mm_unpacklo_epi16(rows[0], rows[1]), a1 = _mm_unpacklo_epi16(rows[2], rows[3]);
+    __m128i a2 = _mm_unpacklo_epi16(rows[4], rows[5]), a3 = _mm_unpacklo_epi16(rows[6], rows[7]);
+    __m128i a4 = _mm_unpackhi_epi16(rows[0], rows[1]), a5 = _mm_unpackhi_epi16(rows[2], rows[3]);
+    __m128i a6 = _mm_unpackhi_epi16(rows[4], rows[5]), a7 = _mm_unpackhi_epi16(rows[6], rows[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a1), b1 = _mm_unpackhi_epi32(a0, a1);
+    __m128i b2 = _mm_unpacklo_epi32(a2, a3), b3 = _mm_unpackhi_epi32(a2, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a5), b5 = _mm_unpackhi_epi32(a4, a5);
+    __m128i b6 = _mm_unpacklo_epi32(a6, a7), b7 = _mm_unpackhi_epi32(a6, a7);
+    rows[0] = _mm_unpacklo_epi64(b0, b2);
+    rows[1] = _mm_unpackhi_epi64(b0, b2);
+    rows[2] = _mm_unpacklo_epi64(b1, b3);
+    rows[3] = _mm_unpackhi_epi64(b1, b3);
+    rows[4] = _mm_unpacklo_epi64(b4, b6);
+    rows[5] = _mm_unpackhi_epi64(b4, b6);
+    rows[6] = _mm_unpacklo_epi64(b5, b7);
+    rows[7] = _mm_unpackhi_epi64(b5, b7);
+}
+#elif defined(__ARM_NEON)
+inline void transpose_block(int16x8_t* rows) {
+    int16x8x2_t t0 = vtrnq_s16(rows[0], rows[1]), t1 = vtrnq_s16(rows[2], rows[3]);
+    int16x8x2_t t2 = vtrnq_s16(rows[4], rows[5]), t3 = vtrnq_s16(rows[6], rows[7]);
+    int32x4x2_t u0 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[0]), vreinterpretq_s32_s16(t1.val[0]));
+    int32x4x2_t u1 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[1]), vreinterpretq_s32_s16(t1.val[1]));
+    int32x4x2_t u2 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[0]), vreinterpretq_s32_s16(t3.val[0]));
+    int32x4x2_t u3 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[1]), vreinterpretq_s32_s16(t3.val[1]));
+    auto column = [](int32x4_t top, int32x4_t bottom, bool high) {
+        return vreinterpretq_s16_s32(high ? vcombine_s32(vget_high_s32(top), vget_high_s32(bottom))
+                                          : vcombine_s32(vget_low_s32(top), vget_low_s32(bottom)));
+    };
+    rows[0] = column(u0.val[0], u2.val[0], false);
+    rows[1] = column(u1.val[0], u3.val[0], false);
+    rows[2] = column(u0.val[1], u2.val[1], false);
+    rows[3] = column(u1.val[1], u3.val[1], false);
+    rows[4] = column(u0.val[0], u2.val[0], true);
+    rows[5] = column(u1.val[0], u3.val[0], true);
+    rows[6] = column(u0.val[1], u2.val[1], true);
+    rows[7] = column(u1.val[1], u3.val[1], true);
+}
+#endif
+
+// The move of Exif orientation 'orientation' in stored coordinates: a mirrored axis and
+// a transpose from stored to displayed, with what it does inside an 8x8 coefficient block
+struct BlockTransform {
+    bool transpose = false;
+    bool flip_x = false;                    // Stored columns run right to left
+    bool flip_y = false;                    // Stored rows run bottom to top
+    uint8_t source[DCTSIZE2];               // Stored coefficient of each output coefficient
+    JCOEF negate[DCTSIZE2];                 // -1 where the output coefficient changes sign, else 0
+
+    explicit BlockTransform(int orientation) {
+        transpose = orientation >= 5;
+        flip_x = orientation == 2 || orientation == 3 || orientation == 7 || orientation == 8;
+        flip_y = orientation == 3 || orientation == 4 || orientation == 6 || orientation == 7;
+        for (int v = 0; v < DCTSIZE; v++) {
+            for (int u = 0; u < DCTSIZE; u++) {
+                int stored_u = transpose ? v : u;   // Horizontal frequency in the stored block
+                int stored_v = transpose ? u : v;
+                bool odd = (flip_x && (stored_u & 1)) != (flip_y && (stored_v & 1));
+                source[v * DCTSIZE + u] = static_cast<uint8_t>(stored_v * DCTSIZE + stored_u);
+                negate[v * DCTSIZE + u] = odd ? -1 : 0;
+            }
+        }
+    }
+
+    // One block; (value ^ mask) - mask negates where the mask is -1
+    void block(const JCOEF* in, JCOEF* out) const {
+#if defined(__SSE2__)
+        __m128i rows[DCTSIZE];
+        for (int v = 0; v < DCTSIZE; v++) {
+            rows[v] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + v * DCTSIZE));
+        }
+        if (transpose) transpose_block(rows);
+        for (int v = 0; v < DCTSIZE; v++) {
+            __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(negate + v * DCTSIZE));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + v * DCTSIZE),
+                             _mm_sub_epi16(_mm_xor_si128(rows[v], mask), mask));
+        }
+#elif defined(__ARM_NEON)
+        int16x8_t rows[DCTSIZE];
+        for (int v = 0; v < DCTSIZE; v++) {
+            rows[v] = vld1q_s16(in + v * DCTSIZE);
+        }
+        if (transpose) transpose_block(rows);
+        for (int v = 0; v < DCTSIZE; v++) {
+            int16x8_t mask = vld1q_s16(negate + v * DCTSIZE);
+            vst1q_s16(out + v * DCTSIZE, vsubq_s16(veorq_s16(rows[v], mask), mask));
+        }
+#else
+        for (int k = 0; k < DCTSIZE2; k++) {
+            JCOEF value = in[source[k]];
+            out[k] = static_cast<JCOEF>((value ^ negate[k]) - negate[k]);
+        }
+#endif
+    }
+};
+
+// Whether orientation 'orientation' of a width x height stored image can be applied to its
+// coefficients
+bool lossless_rotation_possible(int orientation, int width, int height) {
+    if (orientation < 2 || orientation > 8) return false;
+    BlockTransform transform(orientation);
+    return (!transform.flip_x || width % MCU_SIZE == 0) && (!transform.flip_y || height % MCU_SIZE == 0);
+}
+
+// Transform the captured coefficients ('stored' holds all rows of each component, in the
+// capturing compressor's layout) into context.coefficients, laid out as the rotated image's
+// rows one component after the other. A band of output MCU rows per task; blocks are visited
+// in the order they are stored. Touches no libjpeg state, so libjpeg errors cannot happen on
+// the helpers.
+void transform_coefficients(ConversionContext& context, const BlockTransform& transform, JBLOCKARRAY* stored,
+                            unsigned int helpers) {
+    TraceScope stage("rotate");
+    const jpeg_compress_struct& cinfo = context.cinfo;
+    JCOEF* outputs[MAX_COMPONENTS];
+    JCOEF* next = context.coefficients.data();
+    for (int c = 0; c < cinfo.num_components; c++) {
+        outputs[c] = next;
+        next += static_cast<size_t>(cinfo.comp_info[c].width_in_blocks) * cinfo.comp_info[c].height_in_blocks * DCTSIZE2;
+    }
+
+    // Sampling is the same both ways, so a transpose swaps the block counts
+    const jpeg_component_info* luma = &cinfo.comp_info[0];
+    JDIMENSION luma_rows = transform.transpose ? luma->width_in_blocks : luma->height_in_blocks;
+    JDIMENSION luma_band = static_cast<JDIMENSION>(ROTATE_TASK_MCU_ROWS * cinfo.max_v_samp_factor);
+    run_parallel((luma_rows + luma_band - 1) / luma_band, helpers, [&](size_t task) {
+        for (int c = 0; c < cinfo.num_components; c++) {
+            const jpeg_component_info* component = &cinfo.comp_info[c];
+            JDIMENSION stored_width = component->width_in_blocks, stored_height = component->height_in_blocks;
+            JDIMENSION out_width = transform.transpose ? stored_height : stored_width;
+            JDIMENSION out_height = transform.transpose ? stored_width : stored_height;
+            JDIMENSION band = static_cast<JDIMENSION>(ROTATE_TASK_MCU_ROWS * component->v_samp_factor);
+            JDIMENSION first = static_cast<JDIMENSION>(task) * band;
+            JDIMENSION last = std::min(first + band, out_height);
+            JCOEF* out = outputs[c];
+            if (transform.transpose) {
+                // Output column x is stored row x: walk it along the band
+                for (JDIMENSION x = 0; x < out_width; x++) {
+                    JBLOCKROW row = stored[c][transform.flip_y ? stored_height - 1 - x : x];
+                    for (JDIMENSION y = first; y < last; y++) {
+                        JDIMENSION stored_x = transform.flip_x ? stored_width - 1 - y : y;
+                        transform.block(row[stored_x], out + (static_cast<size_t>(y) * out_width + x) * DCTSIZE2);
+                    }
+                }
+            } else {
+                for (JDIMENSION y = first; y < last; y++) {
+                    JBLOCKROW row = stored[c][transform.flip_y ? stored_height - 1 - y : y];
+                    for (JDIMENSION x = 0; x < out_width; x++) {
+                        JDIMENSION stored_x = transform.flip_x ? stored_width - 1 - x : x;
+                        transform.block(row[stored_x], out + (static_cast<size_t>(y) * out_width + x) * DCTSIZE2);
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Encode the decoded, stored image in context.feed with orientation 'orientation' applied
+// losslessly, into 'out'. Idle cores are borrowed for the coefficient transform. The objects
+// with destructors stay in transform_coefficients(), which calls no libjpeg function that
+// can fail.
+bool encode_rotated(ConversionContext& context, int width, int height, int orientation, const Options& options,
+                    std::vector<uint8_t>& out, std::string& error) {
+    jpeg_compress_struct& cinfo = context.cinfo;
+    BlockTransform transform(orientation);
+    int helpers = borrow_idle_cores(ROTATE_MAX_HELPERS);
+
+    if (setjmp(context.jerr.setjmp_buffer)) {
+        error = libjpeg_error(context.jerr, "during compression");
+        jpeg_abort_compress(&cinfo);
+        return_idle_cores(helpers);
+        return false;
+    }
+
+    // Forward DCT and quantization of the stored image, at the output's quality, then
+    // straight from libjpeg's buffer into the rotated layout
+    compress_rows(context, height, options.quality, options.profile, true, context.candidate);
+    jvirt_barray_ptr captured[MAX_COMPONENTS];
+    captured_arrays(context, captured);
+    JBLOCKARRAY stored[MAX_COMPONENTS];
+    size_t total_blocks = 0;
+    for (int c = 0; c < cinfo.num_components; c++) {
+        jpeg_component_info* component = &cinfo.comp_info[c];
+        if (transform.transpose && component->h_samp_factor != component->v_samp_factor) {
+            ERREXIT(&cinfo, JERR_CONVERSION_NOTIMPL);
+        }
+        // All rows at once: the pooled arrays are in memory, and the helpers must not call libjpeg
+        stored[c] = (*cinfo.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&cinfo), captured[c], 0,
+                                                     component->height_in_blocks, FALSE);
+        total_blocks += static_cast<size_t>(component->width_in_blocks) * component->height_in_blocks;
+    }
+    context.coefficients.resize(total_blocks * DCTSIZE2);
+    transform_coefficients(context, transform, stored, static_cast<unsigned int>(helpers));
+    jpeg_abort_compress(&cinfo);
+
+    configure_compressor(context, context.feed, height, options.quality, options.profile, false, out);
+    int out_width = transform.transpose ? height : width;
+    int out_height = transform.transpose ? width : height;
+    cinfo.image_width = static_cast<JDIMENSION>(out_width);
+    cinfo.image_height = static_cast<JDIMENSION>(out_height);
+    if (transform.transpose) {
+        // The quantized coefficients move with their quantizers
+        for (JQUANT_TBL* table : cinfo.quant_tbl_ptrs) {
+            if (!table) continue;
+            for (int v = 0; v < DCTSIZE; v++) {
+                for (int u = v + 1; u < DCTSIZE; u++) {
+                    std::swap(table->quantval[v * DCTSIZE + u], table->quantval[u * DCTSIZE + v]);
+                }
+            }
+        }
+    }
+    jvirt_barray_ptr arrays[MAX_COMPONENTS];
+    start_coefficient_write(cinfo, out_width, out_height, arrays);
+    JCOEF* next = context.coefficients.data();
+    for (int c = 0; c < cinfo.num_components; c++) {
+        jpeg_component_info* component = &cinfo.comp_info[c];
+        PooledJpegMemory::adopt_block_rows(arrays[c], reinterpret_cast<JBLOCKROW>(next), component->width_in_blocks,
+                                           component->height_in_blocks);
+        next += static_cast<size_t>(component->width_in_blocks) * component->height_in_blocks * DCTSIZE2;
+    }
+
+    preserve_metadata(cinfo, context.metadata);
+    jpeg_finish_compress(&cinfo);
+    return_idle_cores(helpers);
+    return true;
+}
+
+// Encodes the rows in context.feed as the image's JPEG into 'jpeg': rotated in the DCT
+// domain by the 'stored' orientation with 'rotate', else in strips on idle cores, by target
+// search or in one pass
+bool encode_feed(ConversionContext& context, int width, int height, bool rotate, int stored,
+                 const std::string& source, const Options& options, std::vector<uint8_t>& jpeg, std::string& error) {
+    // === JPEG Encoding ===
+    // The thread's compressor is reused; it is idle here (finished or aborted)
+    jpeg_compress_struct& cinfo = context.cinfo;
+    TraceScope encode_stage(STAGE_ENCODE);
+    context.memory.reattach(reinterpret_cast<j_common_ptr>(&cinfo));
+
+    if (rotate) {
+        return encode_rotated(context, width, height, stored, options, jpeg, error);
+    }
+
+    // A large image while other workers are idle is encoded in strips on their cores
+    if (!target_search(options) && fixed_huffman_baseline(options.profile) &&
+        static_cast<size_t>(width) * height >= STRIP_ENCODE_MIN_PIXELS) {
+        unsigned int wanted = static_cast<unsigned int>((height / MCU_SIZE) / STRIP_MIN_MCU_ROWS);
+        int helpers = borrow_idle_cores(static_cast<int>(std::max(1u, wanted) - 1));
+        int strip_rows = helpers > 0 ? plan_strip_rows(width, height, helpers + 1) : 0;
+        if (strip_rows > 0) {
+            bool encoded = encode_in_strips(context, width, height, options, helpers, strip_rows, jpeg, error);
+            return_idle_cores(helpers);
+            return encoded;
+        }
+        return_idle_cores(helpers);
+    }
+
+    // Setup custom error handling
+    if (setjmp(context.jerr.setjmp_buffer)) {
+        // Handle error - resources are automatically cleaned up by RAII guards
+        error = libjpeg_error(context.jerr, "during compression");
+        jpeg_abort_compress(&cinfo);
+        return false;
+    }
+
+    if (target_search(options)) {
+        return encode_to_target(context, width, height, source, options, jpeg, error);
+    }
+    compress_rows(context, height, options.quality, options.profile, false, jpeg);
+    return true;
+}
+
+// === Renditions ===
+// The renditions of Options::renditions are smaller JPEGs of the image, made from its one
+// decode. The fed rows (reduced, converted and composited) are downscaled into a pyramid,
+// largest rendition first and each level from the one before, which is cheaper than
+// filtering the full image for every size and keeps a level's filter short. The main image
+// is then encoded on this thread while borrowed cores encode the renditions. Full-size
+// renditions are encoded from the fed rows themselves.
+
+// A rendition of the image being converted, encoded into 'jpeg'
+struct RenditionOutput {
+    const Rendition* rendition;
+    fs::path path;
+    const RowFeed* feed = nullptr;      // Rows at the rendition's size
+    std::vector<uint8_t> jpeg;
+};
+
+// Output of 'rendition' for the image written to 'jpeg_path': name_<rendition>.jpg
+fs::path rendition_path(const fs::path& jpeg_path, const Rendition& rendition) {
+    return jpeg_path.parent_path() / (jpeg_path.stem().string() + "_" + rendition.name + jpeg_path.extension().string());
+}
+
+// Downscales 'feed' into the pyramid levels of 'context' and points every output at the rows
+// of its size
+void build_rendition_feeds(ConversionContext& context, const RowFeed& feed, ResizeFilter filter,
+                           std::vector<RenditionOutput>& outputs) {
+    int width = feed.width;
+    int height = static_cast<int>(feed.rows.size());
+    std::vector<std::pair<int, int>> sizes(outputs.size());
+    for (size_t i = 0; i < outputs.size(); i++) {
+        Options box;
+        box.max_width = box.max_height = outputs[i].rendition->max_side;
+        fit_dimensions(width, height, box, sizes[i].first, sizes[i].second);
+    }
+    std::vector<size_t> order(outputs.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a].first > sizes[b].first; });
+
+    std::vector<std::vector<uint8_t>>& levels = context.pyramid;
+    std::vector<RowFeed>& level_feeds = context.pyramid_feeds;
+    if (levels.size() < outputs.size()) levels.resize(outputs.size());
+    if (level_feeds.size() < outputs.size()) level_feeds.resize(outputs.size());
+    const RowFeed* previous = &feed;
+    size_t count = 0;
+    for (size_t i : order) {
+        int level_width = sizes[i].first, level_height = sizes[i].second;
+        if (level_width != previous->width || level_height != static_cast<int>(previous->rows.size())) {
+            std::vector<uint8_t>& pixels = levels[count];
+            resize_image(*previous, static_cast<int>(previous->rows.size()), level_width, level_height, filter, pixels);
+            RowFeed& level = level_feeds[count++];
+            level.rows.resize(level_height);
+            for (int y = 0; y < level_height; y++) {
+                level.rows[y] = &pixels[static_cast<size_t>(y) * level_width * 3];
+            }
+            level.width = level_width;
+            level.reduction = nullptr;
+            level.gamut = nullptr;
+            level.alpha = false;
+            level.gray = false;
+            level.premultiplied = false;
+            previous = &level;
+        }
+        outputs[i].feed = previous;
+    }
+}
+
+// Encodes a rendition with the image's metadata. Runs under setjmp(), so it holds no
+// objects with destructors.
+bool encode_rendition(ConversionContext& context, RenditionOutput& output, const std::vector<MetadataBlock>& metadata,
+                      Profile profile, std::string& error) {
+    jpeg_compress_struct& cinfo = context.cinfo;
+    context.memory.reattach(reinterpret_cast<j_common_ptr>(&cinfo));
+
+    if (setjmp(context.jerr.setjmp_buffer)) {
+        error = libjpeg_error(context.jerr, "while encoding rendition '" + output.rendition->name + "'");
+        jpeg_abort_compress(&cinfo);
+        return false;
+    }
+
+    const RowFeed& feed = *output.feed;
+    configure_compressor(context, feed, static_cast<int>(feed.rows.size()), output.rendition->quality, profile, false,
+                         output.jpeg);
+    jpeg_start_compress(&cinfo, TRUE);
+    preserve_metadata(cinfo, metadata);
+    feed_rows(cinfo, feed, 0, context);
+    jpeg_finish_compress(&cinfo);
+    return true;
+}
+
+// Runs 'encode_main' on this thread and encodes the renditions on borrowed cores, or here
+// after the main image when none are idle (see convert_image_to_jpeg())
+bool encode_with_renditions(std::vector<RenditionOutput>& outputs, const std::vector<MetadataBlock>& metadata,
+                            Profile profile, const std::function<bool()>& encode_main, std::string& error) {
+    int helpers = borrow_idle_cores(static_cast<int>(outputs.size()));
+    std::thread::id caller = std::this_thread::get_id();
+    bool main_done = false;
+    bool encoded = false;
+    std::atomic<size_t> next_rendition{0};
+    std::atomic<bool> renditions_encoded{true};
+    std::vector<std::string> rendition_errors(outputs.size());
+    run_parallel(outputs.size() + 1, static_cast<unsigned int>(helpers), [&](size_t) {
+        if (std::this_thread::get_id() == caller && !main_done) {
+            main_done = true;
+            encoded = encode_main();
+            return;
+        }
+        size_t index = next_rendition++;
+        if (index >= outputs.size()) return;
+        TraceScope stage("rendition", outputs[index].path);
+        if (!encode_rendition(thread_conversion_context(), outputs[index], metadata, profile,
+                              rendition_errors[index])) {
+            renditions_encoded = false;
+        }
+    });
+    if (!main_done) {
+        encoded = encode_main();
+    }
+    return_idle_cores(helpers);
+    if (encoded && !renditions_encoded) {
+        for (const auto& rendition_error : rendition_errors) {
+            if (!rendition_error.empty()) {
+                error = rendition_error;
+                break;
+            }
+        }
+        return false;
+    }
+    return encoded;
+}
+
+// Handle of an image of a parsed HEIF context, the primary one when 'image_id' is 0
+heif_error get_image_handle(heif_context* ctx, heif_item_id image_id, heif_image_handle** handle) {
+    return image_id ? heif_context_get_image_handle(ctx, image_id, handle)
+                    : heif_context_get_primary_image_handle(ctx, handle);
+}
+
+// Decodes an image of a parsed HEIF context (the primary one when 'image_id' is 0) into
+// this thread's context.feed, whose rows point into 'img' (or its downscaled copy with
+// 'fit'), and collects its metadata. With 'rotatable' the pixels may be left as stored for
+// a lossless rotation by the 'stored' orientation, which sets 'rotate' (see encode_feed()).
+// 'source' names the input in error messages.
+bool decode_to_feed(heif_context* ctx, heif_item_id image_id, const std::string& source, const Options& options,
+                    bool rotatable, HeifImageGuard& img, bool& rotate, int& stored, std::string& error) {
+    // Get the image handle (the primary image unless an ID is given)
+    HeifImageHandleGuard handle;
+    heif_image_handle* temp_handle = nullptr;
+    heif_error err = get_image_handle(ctx, image_id, &temp_handle);
+    handle.reset(temp_handle);
+    
+    if (err.code != heif_error_Ok || !handle) {
+        error = "Failed to get " + std::string(image_id ? "image" : "primary image") + " handle from '" + source +
+                "': " + (err.code ? err.message : "No such image");
+        return false;
+    }
+
+    // Check image dimensions if max dimensions specified; with 'fit' a larger image is
+    // downscaled to fit instead
+    bool resize = false;
+    int fit_width = 0, fit_height = 0;
+    if (options.max_width > 0 || options.max_height > 0) {
+        int width = heif_image_handle_get_width(handle.get());
+        int height = heif_image_handle_get_height(handle.get());
+        if ((options.max_width > 0 && width > options.max_width) ||
+            (options.max_height > 0 && height > options.max_height)) {
+            if (!options.fit) {
+                error = "Image dimensions (" + std::to_string(width) + "x" + std::to_string(height) +
+                        ") exceed maximum allowed (" + std::to_string(options.max_width) + "x" +
+                        std::to_string(options.max_height) + ")";
+                return false;
+            }
+            resize = true;
+            fit_dimensions(width, height, options, fit_width, fit_height);
+        }
+    }
+    
+    // Check memory requirement if max memory specified
+    if (options.max_memory_mb > 0) {
+        size_t estimated_mem = estimate_image_memory(handle.get(), saves_coefficients(options), options.renditions);
+        if (estimated_mem > options.max_memory_mb) {
+            error = "Estimated memory requirement (" + std::to_string(estimated_mem) + 
+                    "MB) exceeds maximum allowed (" + std::to_string(options.max_memory_mb) + "MB)";
+            return false;
+        }
+    }
+
+    ConversionContext& context = thread_conversion_context();
+    context.arena.reset();
+
+    // Extract metadata
+    ExifOrientation orientation;
+    {
+        TraceScope stage(STAGE_METADATA);
+        extract_metadata(handle.get(), source, context.arena, context.metadata_ids, context.metadata);
+        orientation = find_exif_orientation(context.metadata);
+    }
+
+    // libheif rotates, mirrors and crops the decoded image as the container says, after
+    // which the Exif orientation no longer applies. With 'keep_orientation' the pixels are
+    // encoded as stored when the tag describes them, leaving the rotation to the viewer; with
+    // 'lossless_rotate' they are encoded as stored and rotated in the DCT domain.
+    stored = stored_orientation(ctx, handle.get(), orientation);
+    bool as_stored = options.keep_orientation && stored > 0;
+    rotate = !as_stored && options.lossless_rotate && !target_search(options) && !resize && rotatable &&
+                  lossless_rotation_possible(stored, heif_image_handle_get_ispe_width(handle.get()),
+                                             heif_image_handle_get_ispe_height(handle.get()));
+    if (orientation.value && !as_stored) {
+        orientation.set(1);
+    }
+    std::unique_ptr<heif_decoding_options, decltype(&heif_decoding_options_free)> decoding(
+        heif_decoding_options_alloc(), heif_decoding_options_free);
+    if (!decoding) {
+        error = "Failed to allocate decoding options";
+        return false;
+    }
+    decoding->ignore_transformations = as_stored || rotate ? 1 : 0;
+
+    // Decode image to RGB (HEVC decode and color conversion happen inside libheif).
+    // Sources above 8 bits keep their depth and are reduced while they are encoded; the alpha
+    // plane is decoded only when there is one, and composited while encoding.
+    bool wide = heif_image_handle_get_luma_bits_per_pixel(handle.get()) > 8;
+    bool alpha = heif_image_handle_has_alpha_channel(handle.get()) != 0;
+    heif_chroma chroma = wide ? (alpha ? WIDE_RGBA_CHROMA : WIDE_RGB_CHROMA)
+                              : (alpha ? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB);
+    heif_image* temp_img = nullptr;
+    {
+        TraceScope stage(STAGE_DECODE);
+        err = heif_decode_image(handle.get(), &temp_img, heif_colorspace_RGB, chroma, decoding.get());
+    }
+    img.reset(temp_img);
+    
+    if (err.code != heif_error_Ok || !img) {
+        error = "Failed to decode HEIF image '" + source + "': " + (err.code ? err.message : "Decoding failed");
+        return false;
+    }
+
+    // Get image dimensions
+    int decoded_width = heif_image_get_width(img.get(), heif_channel_interleaved);
+    int decoded_height = heif_image_get_height(img.get(), heif_channel_interleaved);
+    current_job_timing().megapixels = static_cast<double>(decoded_width) * decoded_height / 1e6;
+    int stride = 0; // Row stride (bytes)
+    const uint8_t* planar_data = heif_image_get_plane_readonly(img.get(), heif_channel_interleaved, &stride);
+
+    if (!planar_data) {
+        error = "Failed to get pixel data from decoded HEIF image '" + source + "'";
+        return false;
+    }
+
+    // All row pointers up front; libjpeg takes as many as it can per call
+    RowFeed& feed = context.feed;
+    feed.rows.resize(decoded_height);
+    for (int y = 0; y < decoded_height; y++) {
+        feed.rows[y] = const_cast<JSAMPROW>(&planar_data[static_cast<size_t>(y) * stride]);
+    }
+    feed.width = decoded_width;
+    feed.reduction = nullptr;
+    feed.gamut = nullptr;
+    feed.alpha = alpha;
+    feed.gray = false;
+    feed.premultiplied = alpha && heif_image_is_premultiplied_alpha(img.get());
+    feed.background[0] = static_cast<uint8_t>(options.background >> 16);
+    feed.background[1] = static_cast<uint8_t>(options.background >> 8);
+    feed.background[2] = static_cast<uint8_t>(options.background);
+    if (wide) {
+        int bits = heif_image_get_bits_per_pixel_range(img.get(), heif_channel_interleaved);
+        if (bits < 9 || bits > 16) {
+            error = "Unsupported bit depth " + std::to_string(bits) + " in '" + source + "'";
+            return false;
+        }
+        prepare_reduction(context.reduction, bits, options.hdr_mode, transfer_characteristics(handle.get()));
+        feed.reduction = &context.reduction;
+    }
+    {
+        TraceScope stage(STAGE_METADATA);
+        feed.gamut = extract_color_profile(handle.get(), feed.reduction, options.to_srgb, source, context.arena,
+                                           context.metadata);
+    }
+
+    // Downscaled into context.resized, which is then fed instead. Pixels kept as stored for
+    // the Exif orientation fit the box once rotated.
+    if (resize) {
+        TraceScope stage("resize");
+        if (as_stored && stored >= 5) {
+            std::swap(fit_width, fit_height);
+        }
+        resize_image(feed, decoded_height, fit_width, fit_height, options.resize_filter, context.resized);
+        feed.rows.resize(fit_height);
+        for (int y = 0; y < fit_height; y++) {
+            feed.rows[y] = &context.resized[static_cast<size_t>(y) * fit_width * 3];
+        }
+        feed.width = fit_width;
+        feed.reduction = nullptr;
+        feed.gamut = nullptr;
+        feed.alpha = false;
+    }
+    return true;
+}
+
+// Decodes an image of a parsed HEIF context (the primary one when 'image_id' is 0) and
+// encodes it as JPEG into 'jpeg', and as each of 'renditions' when given. 'source' names the
+// input in error messages.
+bool encode_heif_to_jpeg(heif_context* ctx, heif_item_id image_id, const std::string& source, const Options& options,
+                         std::vector<uint8_t>& jpeg, std::string& error,
+                         std::vector<RenditionOutput>* renditions = nullptr) {
+    HeifImageGuard img;
+    bool rotate = false;
+    int stored = 0;
+    if (!decode_to_feed(ctx, image_id, source, options, !renditions || renditions->empty(), img, rotate, stored,
+                        error)) {
+        return false;
+    }
+
+    ConversionContext& context = thread_conversion_context();
+    const RowFeed& feed = context.feed;
+    int width = feed.width;
+    int height = static_cast<int>(feed.rows.size());
+    if (!renditions || renditions->empty()) {
+        return encode_feed(context, width, height, rotate, stored, source, options, jpeg, error);
+    }
+
+    {
+        TraceScope stage("renditions");
+        build_rendition_feeds(context, feed, options.resize_filter, *renditions);
+    }
+    return encode_with_renditions(*renditions, context.metadata, options.profile, [&]() {
+        return encode_feed(context, width, height, rotate, stored, source, options, jpeg, error);
+    }, error);
+}
+
+// A name next to 'path' for writing it in full before it is renamed into place. Renaming
+// replaces the directory entry, so a hardlinked output (--dedup) gets a file of its own instead
+// of rewriting every copy, and an interrupted write never leaves a partial output behind.
+// A killed process leaves its temporary files; batch runs remove them (see stale_temporary()).
+fs::path temporary_output_path(const fs::path& path) {
+    static const std::string process = std::to_string(getpid());   // Not a syscall per output
+    static std::atomic<unsigned> counter{0};
+    return path.parent_path() / ("." + path.filename().string() + ".tmp" + process + "." +
+                                 std::to_string(counter.fetch_add(1)));
+}
+
+// Whether 'name' is a temporary_output_path() name of a process that no longer runs
+bool stale_temporary(const std::string& name) {
+    // "." + name + ".tmp" + pid + "." + counter
+    size_t dot = name.rfind('.');
+    if (name[0] != '.' || dot == std::string::npos || dot == 0 || dot + 1 == name.size()) return false;
+    size_t tmp = name.rfind(".tmp", dot - 1);
+    if (tmp == std::string::npos || tmp == 0 || tmp + 4 >= dot || dot - tmp - 4 > 9) return false;
+    auto digits = [&](size_t from, size_t to) {
+        return std::all_of(name.begin() + static_cast<std::ptrdiff_t>(from),
+                           name.begin() + static_cast<std::ptrdiff_t>(to),
+                           [](unsigned char c) { return std::isdigit(c) != 0; });
+    };
+    if (!digits(tmp + 4, dot) || !digits(dot + 1, name.size())) return false;
+    pid_t pid = static_cast<pid_t>(std::stoi(name.substr(tmp + 4, dot - tmp - 4)));
+    return pid > 0 && pid != getpid() && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+// The file that writing 'path' replaces, and its status in 'existing' (false when there is
+// none). A symlinked output is written through the link, as writing in place did, rather
+// than replacing the link with a file.
+fs::path replaced_output(const fs::path& path, struct stat& st, bool& existing) {
+    existing = lstat(path.c_str(), &st) == 0;
+    if (!existing || !S_ISLNK(st.st_mode)) return path;
+    std::error_code ec;
+    fs::path resolved = fs::weakly_canonical(path, ec);
+    if (ec) return path;
+    existing = stat(resolved.c_str(), &st) == 0;
+    return resolved;
+}
+
+// Give the replacement of an existing output that output's mode and, where permitted, owner
+void keep_output_attributes(const fs::path& temp, const struct stat& st) {
+    chmod(temp.c_str(), st.st_mode & 07777);
+    if (st.st_uid != geteuid() || st.st_gid != getegid()) {
+        if (chown(temp.c_str(), st.st_uid, st.st_gid) != 0) {
+            // Only root may give files away; the file stays ours
+        }
+    }
+}
+
+// Write an encoded JPEG to 'jpeg_path' (binary write to a temporary file, then rename)
+bool write_output_file(const fs::path& jpeg_path, const std::vector<uint8_t>& jpeg, std::string& error) {
+    struct stat existing_st;
+    bool existing = false;
+    fs::path target = replaced_output(jpeg_path, existing_st, existing);
+    fs::path temp_path = temporary_output_path(target);
+    FILE* outfile_ptr = fopen(temp_path.c_str(), "wb");
+    if (!outfile_ptr) {
+        error = "Cannot open output file '" + jpeg_path.string() + "' for writing.";
+        return false;
+    }
+    
+    bool written = fwrite(jpeg.data(), 1, jpeg.size(), outfile_ptr) == jpeg.size() && fflush(outfile_ptr) == 0;
+    int write_error = errno;
+    if (fclose(outfile_ptr) != 0 && written) {
+        written = false;
+        write_error = errno;
+    }
+    if (!written) {
+        error = "Failed to write output file '" + jpeg_path.string() + "': " + std::strerror(write_error);
+        unlink(temp_path.c_str());
+        return false;
+    }
+    if (existing) keep_output_attributes(temp_path, existing_st);
+    if (rename(temp_path.c_str(), target.c_str()) != 0) {
+        error = "Failed to write output file '" + jpeg_path.string() + "': " + std::strerror(errno);
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Encodes one image of a parsed HEIF file and writes it to 'jpeg_path', and its renditions
+// next to it
+bool write_image_jpeg(heif_context* ctx, heif_item_id image_id, const fs::path& heif_path, const fs::path& jpeg_path,
+                      const Options& options, uint64_t& output_size, std::string& error) {
+    std::vector<uint8_t>& jpeg = thread_conversion_context().output;
+    std::vector<RenditionOutput> renditions;
+    for (const auto& rendition : options.renditions) {
+        renditions.push_back({&rendition, rendition_path(jpeg_path, rendition), nullptr, {}});
+    }
+    if (!encode_heif_to_jpeg(ctx, image_id, heif_path.string(), options, jpeg, error, &renditions)) {
+        return false;
+    }
+
+    TraceScope write_stage(STAGE_WRITE);
+    if (!write_output_file(jpeg_path, jpeg, error)) {
+        return false;
+    }
+    output_size = jpeg.size();
+
+    if (log_enabled()) {
+        thread_safe_print("Successfully saved '" + jpeg_path.string() + "'");
+    }
+    for (const auto& rendition : renditions) {
+        if (!write_output_file(rendition.path, rendition.jpeg, error)) {
+            return false;
+        }
+        if (log_enabled()) {
+            thread_safe_print("Successfully saved '" + rendition.path.string() + "'");
+        }
+    }
+    return true;
+}
+
+// === Auxiliary images ===
+// Depth maps and the other auxiliary images of an image (portrait mattes, gain maps; alpha
+// planes are composited instead) are written next to its output as grayscale JPEGs,
+// name_depth.jpg and name_aux_N.jpg. They are small, so they are decoded and encoded on
+// borrowed cores while the main image is, not after it.
+
+using HandlePtr = std::unique_ptr<heif_image_handle, decltype(&heif_image_handle_release)>;
+
+// An auxiliary image and the output it is written to
+struct AuxiliaryOutput {
+    HandlePtr handle;
+    fs::path path;
+};
+
+// The depth and auxiliary images of 'main', with outputs named after 'jpeg_path'
+std::vector<AuxiliaryOutput> list_auxiliary_outputs(heif_image_handle* main, const fs::path& jpeg_path) {
+    std::vector<AuxiliaryOutput> outputs;
+    std::string stem = (jpeg_path.parent_path() / jpeg_path.stem()).string();
+    std::string extension = jpeg_path.extension().string();
+
+    int depth_count = heif_image_handle_get_number_of_depth_images(main);
+    std::vector<heif_item_id> ids(static_cast<size_t>(std::max(depth_count, 0)));
+    depth_count = heif_image_handle_get_list_of_depth_image_IDs(main, ids.data(), depth_count);
+    for (int i = 0; i < depth_count; i++) {
+        heif_image_handle* handle = nullptr;
+        if (heif_image_handle_get_depth_image_handle(main, ids[i], &handle).code != heif_error_Ok || !handle) continue;
+        std::string suffix = i == 0 ? "_depth" : "_depth_" + std::to_string(i + 1);
+        outputs.push_back({HandlePtr(handle, heif_image_handle_release), stem + suffix + extension});
+    }
+
+    const int filter = LIBHEIF_AUX_IMAGE_FILTER_OMIT_ALPHA | LIBHEIF_AUX_IMAGE_FILTER_OMIT_DEPTH;
+    int aux_count = heif_image_handle_get_number_of_auxiliary_images(main, filter);
+    ids.resize(static_cast<size_t>(std::max(aux_count, 0)));
+    aux_count = heif_image_handle_get_list_of_auxiliary_image_IDs(main, filter, ids.data(), aux_count);
+    for (int i = 0; i < aux_count; i++) {
+        heif_image_handle* handle = nullptr;
+        if (heif_image_handle_get_auxiliary_image_handle(main, ids[i], &handle).code != heif_error_Ok || !handle) continue;
+        outputs.push_back({HandlePtr(handle, heif_image_handle_release),
+                           stem + "_aux_" + std::to_string(i + 1) + extension});
+    }
+    return outputs;
+}
+
+// Encodes the grayscale rows in context.feed into 'out', without metadata
+bool encode_auxiliary(ConversionContext& context, int height, const Options& options, std::vector<uint8_t>& out) {
+    jpeg_compress_struct& cinfo = context.cinfo;
+    context.memory.reattach(reinterpret_cast<j_common_ptr>(&cinfo));
+
+    if (setjmp(context.jerr.setjmp_buffer)) {
+        jpeg_abort_compress(&cinfo);
+        return false;
+    }
+
+    configure_compressor(context, context.feed, height, options.quality, options.profile, false, out);
+    jpeg_start_compress(&cinfo, TRUE);
+    feed_rows(cinfo, context.feed, 0, context);
+    jpeg_finish_compress(&cinfo);
+    return true;
+}
+
+// Decodes an auxiliary image as grayscale and writes it as JPEG. Samples above 8 bits are
+// clipped: depth and mattes are linear data, not light to be tone mapped.
+bool extract_auxiliary_image(const AuxiliaryOutput& output, const Options& options, std::string& error) {
+    TraceScope stage("auxiliary", output.path);
+    heif_image* temp_img = nullptr;
+    heif_error err = heif_decode_image(output.handle.get(), &temp_img, heif_colorspace_monochrome,
+                                       heif_chroma_monochrome, nullptr);
+    HeifImageGuard img(temp_img);
+    if (err.code != heif_error_Ok || !img) {
+        error = std::string("Failed to decode: ") + (err.code ? err.message : "Decoding failed");
+        return false;
+    }
+
+    int width = heif_image_get_width(img.get(), heif_channel_Y);
+    int height = heif_image_get_height(img.get(), heif_channel_Y);
+    int stride = 0;
+    const uint8_t* plane = heif_image_get_plane_readonly(img.get(), heif_channel_Y, &stride);
+    if (!plane || width <= 0 || height <= 0) {
+        error = "No grayscale plane";
+        return false;
+    }
+
+    ConversionContext& context = thread_conversion_context();
+    RowFeed& feed = context.feed;
+    feed.rows.resize(height);
+    for (int y = 0; y < height; y++) {
+        feed.rows[y] = const_cast<JSAMPROW>(&plane[static_cast<size_t>(y) * stride]);
+    }
+    feed.width = width;
+    feed.reduction = nullptr;
+    feed.gamut = nullptr;
+    feed.alpha = false;
+    feed.gray = true;
+    feed.premultiplied = false;
+    int bits = heif_image_get_bits_per_pixel_range(img.get(), heif_channel_Y);
+    if (bits > 8) {
+        if (bits > 16) {
+            error = "Unsupported bit depth " + std::to_string(bits);
+            return false;
+        }
+        prepare_reduction(context.reduction, bits, HdrMode::Clip, -1);
+        feed.reduction = &context.reduction;
+    }
+
+    std::vector<uint8_t> jpeg;
+    if (!encode_auxiliary(context, height, options, jpeg)) {
+        error = libjpeg_error(context.jerr, "during compression");
+        return false;
+    }
+    return write_output_file(output.path, jpeg, error);
+}
+
+// Converts one image of a parsed HEIF file (the primary one when 'image_id' is 0) and
+// writes it to 'jpeg_path'. With 'extract_auxiliary' its depth and auxiliary images are
+// written too; failing to extract them is reported but does not fail the conversion.
+bool convert_image_to_jpeg(heif_context* ctx, heif_item_id image_id, const fs::path& heif_path,
+                           const fs::path& jpeg_path, const Options& options, uint64_t& output_size,
+                           std::string& error) {
+    if (log_enabled()) {
+        std::stringstream log;
+        log << "Converting '" << heif_path << "' to '" << jpeg_path << "'...";
+        thread_safe_print(log.str());
+    }
+
+    std::vector<AuxiliaryOutput> auxiliary;
+    if (options.extract_auxiliary) {
+        heif_image_handle* main = nullptr;
+        if (get_image_handle(ctx, image_id, &main).code == heif_error_Ok && main) {
+            auxiliary = list_auxiliary_outputs(main, jpeg_path);
+        }
+        if (main) heif_image_handle_release(main);
+    }
+    if (auxiliary.empty()) {
+        return write_image_jpeg(ctx, image_id, heif_path, jpeg_path, options, output_size, error);
+    }
+
+    // The main image stays on this thread, whose job timing it feeds; the auxiliary images are
+    // claimed by borrowed cores, or run here after it when none are idle. Should the helpers
+    // claim every task first, the main image runs once they are done.
+    int helpers = borrow_idle_cores(static_cast<int>(auxiliary.size()));
+    std::thread::id caller = std::this_thread::get_id();
+    bool main_done = false;
+    bool converted = false;
+    std::atomic<size_t> next_auxiliary{0};
+    run_parallel(auxiliary.size() + 1, static_cast<unsigned int>(helpers), [&](size_t) {
+        if (std::this_thread::get_id() == caller && !main_done) {
+            main_done = true;
+            converted = write_image_jpeg(ctx, image_id, heif_path, jpeg_path, options, output_size, error);
+            return;
+        }
+        size_t index = next_auxiliary++;
+        if (index >= auxiliary.size()) return;
+        std::string aux_error;
+        if (extract_auxiliary_image(auxiliary[index], options, aux_error)) {
+            if (log_enabled()) {
+                thread_safe_print("Successfully saved '" + auxiliary[index].path.string() + "'");
+            }
+        } else {
+            thread_safe_print("Warning: Failed to extract '" + auxiliary[index].path.string() + "': " + aux_error);
+        }
+    });
+    if (!main_done) {
+        converted = write_image_jpeg(ctx, image_id, heif_path, jpeg_path, options, output_size, error);
+    }
+    return_idle_cores(helpers);
+    return converted;
+}
+
+// Converts HEIF file to JPEG with dimension checks
+bool convert_heif_to_jpeg(const fs::path& heif_path, const fs::path& jpeg_path, const Options& options,
+                          uint64_t& output_size, std::string& error) {
+    // === HEIF Decoding with RAII ===
+    // The container is parsed once; limits are checked on the parsed handle
+    HeifContextGuard ctx;
+    if (!ctx) {
+        error = "Failed to allocate libheif context.";
+        return false;
+    }
+
+    heif_error err;
+    {
+        TraceScope stage(STAGE_READ);
+        err = heif_context_read_from_file(ctx.get(), heif_path.c_str(), nullptr);
+    }
+    if (err.code != heif_error_Ok) {
+        error = "Failed to read HEIF file '" + heif_path.string() + "': " + err.message;
+        return false;
+    }
+
+    return convert_image_to_jpeg(ctx.get(), 0, heif_path, jpeg_path, options, output_size, error);
+}
+
+// === Tensor output ===
+// For ML ingestion the decoded pixels are written as uint8 RGB arrays instead of JPEGs, all
+// images of a batch into one shard file that a data loader maps and indexes without parsing.
+// Little-endian layout:
+//   0       header, 64 bytes: magic "H2JTNSR1", u32 version (1), u32 layout (0 = NHWC,
+//           1 = CHW), u32 channels (3), u32 record count, u64 index offset, u64 names
+//           offset, u64 names size
+//   4096    the records, each at a 64-byte aligned offset, in completion order
+//   index   a 32-byte entry per input, in input order: u64 offset, u64 size (0 = failed),
+//           u32 width, u32 height, u32 name offset, u32 name size
+//   names   the input paths, UTF-8, unterminated
+// A worker reserves its record's range with an atomic add and writes it with pwrite(), so
+// records go out concurrently without a lock. The index and names follow the last record and
+// the header is written last: the shard of an interrupted run has no magic.
+
+const char TENSOR_MAGIC[8] = {'H', '2', 'J', 'T', 'N', 'S', 'R', '1'};
+const uint64_t TENSOR_DATA_OFFSET = 4096;
+const uint64_t TENSOR_ALIGNMENT = 64;
+const size_t TENSOR_HEADER_SIZE = 64;
+
+// Appends the 'bytes' low bytes of 'value' to 'out', little-endian
+void put_le(std::vector<uint8_t>& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+// Writes all of 'data' at 'offset' of 'fd'
+bool pwrite_all(int fd, const uint8_t* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+class TensorShard {
+private:
+    struct Record {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::string name;
+    };
+    int fd = -1;
+    TensorLayout layout = TensorLayout::NHWC;
+    std::vector<Record> records;            // Added before the run; each job fills its own
+    std::atomic<uint64_t> end{TENSOR_DATA_OFFSET};
+
+public:
+    TensorShard() = default;
+    ~TensorShard() { if (fd >= 0) close(fd); }
+    // Prevent copying
+    TensorShard(const TensorShard&) = delete;
+    TensorShard& operator=(const TensorShard&) = delete;
+
+    // Create (or truncate) the shard file
+    bool open(const fs::path& path, TensorLayout tensor_layout, std::string& error) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        layout = tensor_layout;
+        return true;
+    }
+
+    bool is_open() const { return fd >= 0; }
+
+    // Add the record of an input; returns its number
+    size_t add(const fs::path& input_path) {
+        records.emplace_back();
+        records.back().name = input_path.string();
+        return records.size() - 1;
+    }
+
+    // Write the pixels of record 'index' (once per record, from any worker)
+    bool write(size_t index, const std::vector<uint8_t>& pixels, int width, int height, std::string& error) {
+        uint64_t reserved = (pixels.size() + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+        uint64_t offset = end.fetch_add(reserved);
+        if (!pwrite_all(fd, pixels.data(), pixels.size(), offset)) {
+            error = std::string("Failed to write tensor shard: ") + std::strerror(errno);
+            return false;
+        }
+        Record& record = records[index];
+        record.offset = offset;
+        record.size = pixels.size();
+        record.width = static_cast<uint32_t>(width);
+        record.height = static_cast<uint32_t>(height);
+        return true;
+    }
+
+    // Write the index, the names and then the header, once all workers are done
+    bool finish(std::string& error) {
+        uint64_t index_offset = end.load();
+        std::vector<uint8_t> tail;
+        std::string names;
+        for (const auto& record : records) {
+            put_le(tail, record.offset, 8);
+            put_le(tail, record.size, 8);
+            put_le(tail, record.width, 4);
+            put_le(tail, record.height, 4);
+            put_le(tail, names.size(), 4);
+            put_le(tail, record.name.size(), 4);
+            names += record.name;
+        }
+        uint64_t names_offset = index_offset + tail.size();
+        tail.insert(tail.end(), names.begin(), names.end());
+
+        std::vector<uint8_t> header(TENSOR_MAGIC, TENSOR_MAGIC + sizeof(TENSOR_MAGIC));
+        put_le(header, 1, 4);
+        put_le(header, layout == TensorLayout::CHW ? 1 : 0, 4);
+        put_le(header, 3, 4);
+        put_le(header, records.size(), 4);
+        put_le(header, index_offset, 8);
+        put_le(header, names_offset, 8);
+        put_le(header, names.size(), 8);
+        header.resize(TENSOR_HEADER_SIZE);
+
+        // The header only once the rest is on disk
+        if (!pwrite_all(fd, tail.data(), tail.size(), index_offset) || fdatasync(fd) != 0 ||
+            !pwrite_all(fd, header.data(), header.size(), 0) || close(fd) != 0) {
+            error = std::strerror(errno);
+            fd = -1;
+            return false;
+        }
+        fd = -1;
+        return true;
+    }
+};
+
+// Copies 'width' pixels of an RGB row of 'channels' bytes per pixel (alpha rows are RGBX)
+// into 'out': interleaved, or into the three planes of 'plane_size' bytes for CHW
+void pack_tensor_row(const uint8_t* row, int channels, int width, TensorLayout layout, size_t plane_size,
+                     uint8_t* out) {
+    if (layout == TensorLayout::NHWC) {
+        if (channels == 3) {
+            std::memcpy(out, row, static_cast<size_t>(width) * 3);
+            return;
+        }
+        for (int x = 0; x < width; x++, row += channels, out += 3) {
+            out[0] = row[0];
+            out[1] = row[1];
+            out[2] = row[2];
+        }
+        return;
+    }
+    uint8_t* red = out;
+    uint8_t* green = out + plane_size;
+    uint8_t* blue = out + 2 * plane_size;
+    for (int x = 0; x < width; x++, row += channels) {
+        red[x] = row[0];
+        green[x] = row[1];
+        blue[x] = row[2];
+    }
+}
+
+// Decodes the primary image of 'heif_path' and writes its pixels as record 'record' of
+// 'shard': upright, reduced to 8 bits and composited like a JPEG's, then scaled to cover
+// tensor.width x tensor.height and center-cropped when a size is given
+bool convert_heif_to_tensor(const fs::path& heif_path, TensorShard& shard, size_t record, const Options& options,
+                            const TensorOptions& tensor, uint64_t& output_size, std::string& error) {
+    HeifContextGuard ctx;
+    if (!ctx) {
+        error = "Failed to allocate libheif context.";
+        return false;
+    }
+    heif_error err;
+    {
+        TraceScope stage(STAGE_READ);
+        err = heif_context_read_from_file(ctx.get(), heif_path.c_str(), nullptr);
+    }
+    if (err.code != heif_error_Ok) {
+        error = "Failed to read HEIF file '" + heif_path.string() + "': " + err.message;
+        return false;
+    }
+
+    // Pixels are rotated as the container says: a tensor has no orientation tag
+    Options decode_options = options;
+    decode_options.keep_orientation = false;
+    HeifImageGuard img;
+    bool rotate = false;
+    int stored = 0;
+    if (!decode_to_feed(ctx.get(), 0, heif_path.string(), decode_options, false, img, rotate, stored, error)) {
+        return false;
+    }
+
+    ConversionContext& context = thread_conversion_context();
+    const RowFeed* feed = &context.feed;
+    int width = feed->width;
+    int height = static_cast<int>(feed->rows.size());
+    int out_width = tensor.width > 0 ? tensor.width : width;
+    int out_height = tensor.height > 0 ? tensor.height : height;
+    RowFeed scaled;
+    if (out_width != width || out_height != height) {
+        TraceScope stage("resize");
+        double scale = std::max(static_cast<double>(out_width) / width, static_cast<double>(out_height) / height);
+        int cover_width = std::max(out_width, static_cast<int>(std::lround(width * scale)));
+        int cover_height = std::max(out_height, static_cast<int>(std::lround(height * scale)));
+        if (context.pyramid.empty()) context.pyramid.resize(1);
+        std::vector<uint8_t>& pixels = context.pyramid[0];
+        resize_image(*feed, height, cover_width, cover_height, options.resize_filter, pixels);
+        scaled.rows.resize(cover_height);
+        for (int y = 0; y < cover_height; y++) {
+            scaled.rows[y] = &pixels[static_cast<size_t>(y) * cover_width * 3];
+        }
+        scaled.width = cover_width;
+        feed = &scaled;
+        width = cover_width;
+        height = cover_height;
+    }
+
+    // The centered crop, prepared row by row where the feed needs it
+    TraceScope pack_stage("tensor");
+    int left = (width - out_width) / 2;
+    int top = (height - out_height) / 2;
+    int channels = fed_components(*feed);
+    size_t plane_size = static_cast<size_t>(out_width) * out_height;
+    size_t row_bytes = static_cast<size_t>(out_width) * (tensor.layout == TensorLayout::NHWC ? 3 : 1);
+    std::vector<uint8_t>& pixels = context.output;
+    pixels.resize(plane_size * 3);
+    context.band.resize(static_cast<size_t>(feed->width) * channels);
+    for (int y = 0; y < out_height; y++) {
+        const uint8_t* row = fed_row(*feed, feed->rows[top + y], context.band.data());
+        pack_tensor_row(row + static_cast<size_t>(left) * channels, channels, out_width, tensor.layout, plane_size,
+                        &pixels[static_cast<size_t>(y) * row_bytes]);
+    }
+    pack_stage.end();
+
+    TraceScope write_stage(STAGE_WRITE);
+    if (!shard.write(record, pixels, out_width, out_height, error)) {
+        return false;
+    }
+    output_size = pixels.size();
+    if (log_enabled()) {
+        thread_safe_print("Successfully wrote '" + heif_path.string() + "' (" + std::to_string(out_width) + "x" +
+                          std::to_string(out_height) + ") to the tensor shard");
+    }
+    return true;
+}
+
+// Maps and parses a HEIF file whose images are converted as separate jobs (--all-images)
+std::shared_ptr<SharedHeif> open_shared_heif(const fs::path& heif_path, std::string& error) {
+    TraceScope stage(STAGE_READ);
+    int fd = open(heif_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "Failed to read HEIF file '" + heif_path.string() + "': " + std::strerror(errno);
+        return nullptr;
+    }
+    struct stat st;
+    size_t size = 0;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = static_cast<size_t>(st.st_size);
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        error = "Failed to map HEIF file '" + heif_path.string() + "'";
+        return nullptr;
+    }
+
+    auto shared = std::make_shared<SharedHeif>(data, size);
+    if (!shared->ctx) {
+        error = "Failed to allocate libheif context.";
+        return nullptr;
+    }
+    heif_error err = heif_context_read_from_memory_without_copy(shared->ctx.get(), data, size, nullptr);
+    if (err.code != heif_error_Ok) {
+        error = "Failed to read HEIF file '" + heif_path.string() + "': " + err.message;
+        return nullptr;
+    }
+    return shared;
+}
+
+// Converts HEIF data read from a descriptor and writes the JPEG to another descriptor.
+// The input is read into memory, never mapped: the descriptor belongs to the caller (a
+// daemon client, say), and a mapped file truncated during decoding would raise SIGBUS.
+bool convert_descriptor_to_jpeg(int input_fd, int output_fd, const std::string& source, const Options& options,
+                                uint64_t& output_size, std::string& error) {
+    TraceScope read_stage(STAGE_READ);
+    struct stat st;
+    if (fstat(input_fd, &st) != 0) {
+        error = "Cannot read input '" + source + "': " + std::strerror(errno);
+        return false;
+    }
+
+    // Regular files are read whole from offset 0 into a buffer of their size (one byte more
+    // to see the end without growing it); pipes from where they are, growing as needed
+    bool regular = S_ISREG(st.st_mode);
+    std::vector<uint8_t> buffer(regular ? static_cast<size_t>(st.st_size) + 1 : 1 << 16);
+    size_t size = 0;
+    for (;;) {
+        if (size == buffer.size()) buffer.resize(buffer.size() * 2);
+        ssize_t n = regular ? pread(input_fd, buffer.data() + size, buffer.size() - size, static_cast<off_t>(size))
+                            : read(input_fd, buffer.data() + size, buffer.size() - size);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error = "Cannot read input '" + source + "': " + std::strerror(errno);
+            return false;
+        }
+        size += static_cast<size_t>(n);
+    }
+    const uint8_t* data = buffer.data();
+
+    HeifContextGuard ctx;
+    if (!ctx) {
+        error = "Failed to allocate libheif context.";
+        return false;
+    }
+    heif_error err = heif_context_read_from_memory_without_copy(ctx.get(), data, size, nullptr);
+    if (err.code != heif_error_Ok) {
+        error = "Failed to read HEIF data of '" + source + "': " + err.message;
+        return false;
+    }
+    read_stage.end();
+
+    std::vector<uint8_t>& jpeg = thread_conversion_context().output;
+    if (!encode_heif_to_jpeg(ctx.get(), 0, source, options, jpeg, error)) {
+        return false;
+    }
+
+    TraceScope write_stage(STAGE_WRITE);
+    size_t written = 0;
+    while (written < jpeg.size()) {
+        ssize_t n = write(output_fd, jpeg.data() + written, jpeg.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error = "Failed to write output of '" + source + "': " + std::strerror(errno);
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    output_size = jpeg.size();
+    return true;
+}
+
+// Type, size and modification time of a file, read with a single stat() call
+struct FileStat {
+    bool is_regular = false;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+};
+
+bool stat_file(const fs::path& path, FileStat& out) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    out.is_regular = S_ISREG(st.st_mode);
+    out.size = static_cast<uint64_t>(st.st_size);
+#ifdef __APPLE__
+    out.mtime_ns = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    out.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+// 64-bit FNV-1a hash (used to fingerprint conversion options)
+uint64_t fnv1a_64(const std::string& data, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// XXH64 hash of a memory block (little-endian reads; hashes are only compared locally)
+uint64_t xxh64(const uint8_t* p, size_t len, uint64_t seed = 0) {
+    const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL;
+    const uint64_t P3 = 1609587929392839161ULL, P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto read64 = [](const uint8_t* q) { uint64_t v; memcpy(&v, q, 8); return v; };
+    auto read32 = [](const uint8_t* q) { uint32_t v; memcpy(&v, q, 4); return v; };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+    auto merge = [&](uint64_t acc, uint64_t val) { return (acc ^ round(0, val)) * P1 + P4; };
+
+    const uint8_t* end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        const uint8_t* limit = end - 32;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end) { h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3; p += 4; }
+    for (; p < end; p++) h = rotl(h ^ (*p * P5), 11) * P1;
+
+    h ^= h >> 33; h *= P2;
+    h ^= h >> 29; h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Hash the contents of a file through a read-only memory mapping
+bool hash_file_contents(const fs::path& path, uint64_t& hash, uint64_t& size_out) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    size_out = size;
+    if (size == 0) {
+        close(fd);
+        hash = xxh64(nullptr, 0);
+        return true;
+    }
+
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    madvise(data, size, MADV_SEQUENTIAL);
+    hash = xxh64(static_cast<const uint8_t*>(data), size);
+    munmap(data, size);
+    return true;
+}
+
+// Make 'target' share 'source' contents: hardlink, then reflink clone, then plain copy. The
+// link is made under a temporary name and renamed over 'target', so an existing output is only
+// replaced once its new contents are in place. A clone or copy keeps the replaced output's
+// mode; a hardlink has the mode of 'source'.
+bool link_output(const fs::path& source, const fs::path& output, std::string& error) {
+    std::error_code ec;
+    if (fs::equivalent(source, output, ec)) return true;   // Already the same file
+
+    struct stat existing_st;
+    bool existing = false;
+    fs::path target = replaced_output(output, existing_st, existing);
+    fs::path temp = temporary_output_path(target);
+    bool hardlinked = false;
+    bool linked = false;
+    ec.clear();
+    fs::create_hard_link(source, temp, ec);
+    linked = hardlinked = !ec;
+
+#ifdef __APPLE__
+    if (!linked) linked = clonefile(source.c_str(), temp.c_str(), 0) == 0;
+#elif defined(FICLONE)
+    if (!linked) {
+        int src_fd = open(source.c_str(), O_RDONLY);
+        if (src_fd >= 0) {
+            int dst_fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (dst_fd >= 0) {
+                linked = ioctl(dst_fd, FICLONE, src_fd) == 0;
+                close(dst_fd);
+                if (!linked) fs::remove(temp, ec);
+            }
+            close(src_fd);
+        }
+    }
+#endif
+
+    if (!linked) {
+        ec.clear();
+        fs::copy_file(source, temp, ec);
+        if (ec) {
+            error = ec.message();
+            fs::remove(temp, ec);
+            return false;
+        }
+    }
+
+    if (existing && !hardlinked) keep_output_attributes(temp, existing_st);
+    if (rename(temp.c_str(), target.c_str()) != 0) {
+        error = std::strerror(errno);
+        fs::remove(temp, ec);
+        return false;
+    }
+    return true;
+}
+
+// One completed conversion as recorded in the journal
+struct JournalEntry {
+    uint64_t input_size = 0;
+    int64_t input_mtime_ns = 0;
+    uint64_t content_hash = 0;   // 0 when the input content was not hashed
+    uint64_t options_hash = 0;
+    uint64_t output_size = 0;
+    std::string output_path;
+};
+
+// Append-only completion journal for resumable runs.
+// Each finished job appends one line:
+//   <input size> <mtime ns> <content hash> <options hash> <output size> <input path> <output path>
+// (tab-separated, paths last). On startup the file is loaded into a hash index so
+// already-converted inputs are skipped without probing outputs or parsing HEIF files.
+// A torn last line from a crashed run is ignored, and later lines win over earlier ones.
+// Records with a content hash also form a persistent content -> output index for dedup.
+class CompletionJournal {
+private:
+    std::unordered_map<std::string, JournalEntry> index;
+    std::unordered_map<uint64_t, std::string> content_index;  // content/options key -> input key
+    std::mutex write_mutex;
+    FILE* file = nullptr;
+
+    static uint64_t content_key(uint64_t content_hash, uint64_t input_size, uint64_t options_hash) {
+        return content_hash ^ (input_size * 0x9e3779b97f4a7c15ULL) ^ (options_hash * 0xc2b2ae3d27d4eb4fULL);
+    }
+
+    static bool parse_line(const std::string& line, std::string& key, JournalEntry& entry) {
+        char* end = nullptr;
+        const char* p = line.c_str();
+        uint64_t fields[5];
+        for (int i = 0; i < 5; i++) {
+            errno = 0;
+            fields[i] = (i == 2 || i == 3) ? strtoull(p, &end, 16) : strtoull(p, &end, 10);
+            if (end == p || *end != '\t' || errno != 0) return false;
+            p = end + 1;
+        }
+        const char* separator = strchr(p, '\t');
+        if (!separator || separator == p || separator[1] == '\0') return false;
+        entry.input_size = fields[0];
+        entry.input_mtime_ns = static_cast<int64_t>(fields[1]);
+        entry.content_hash = fields[2];
+        entry.options_hash = fields[3];
+        entry.output_size = fields[4];
+        key.assign(p, separator);
+        entry.output_path = separator + 1;
+        return true;
+    }
+
+public:
+    CompletionJournal() = default;
+    ~CompletionJournal() { if (file) fclose(file); }
+    // Prevent copying
+    CompletionJournal(const CompletionJournal&) = delete;
+    CompletionJournal& operator=(const CompletionJournal&) = delete;
+
+    // Load existing records and open the journal for appending
+    bool open(const fs::path& path, std::string& error) {
+        FILE* in = fopen(path.c_str(), "rb");
+        if (in) {
+            FileGuard in_guard(in);
+            std::string contents;
+            char buffer[1 << 16];
+            size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+                contents.append(buffer, n);
+            }
+
+            size_t start = 0;
+            size_t newline;
+            while ((newline = contents.find('\n', start)) != std::string::npos) {
+                std::string line = contents.substr(start, newline - start);
+                start = newline + 1;
+                if (line.empty() || line[0] == '#') continue;
+
+                std::string key;
+                JournalEntry entry;
+                if (parse_line(line, key, entry)) {
+                    if (entry.content_hash != 0) {
+                        content_index[content_key(entry.content_hash, entry.input_size, entry.options_hash)] = key;
+                    }
+                    index[key] = std::move(entry);
+                }
+            }
+        }
+
+        file = fopen(path.c_str(), "ab");
+        if (!file) {
+            error = std::strerror(errno);
+            return false;
+        }
+        if (ftell(file) == 0) {
+            fputs("# heif2jpeg journal v1\n", file);
+            fflush(file);
+        }
+        return true;
+    }
+
+    size_t size() const { return index.size(); }
+
+    // Look up a previous record; only called while the job queue is being built
+    const JournalEntry* find(const std::string& key) const {
+        auto it = index.find(key);
+        return it == index.end() ? nullptr : &it->second;
+    }
+
+    // Find an earlier conversion of byte-identical content with the same options
+    const JournalEntry* find_content(uint64_t content_hash, uint64_t input_size, uint64_t options_hash) const {
+        auto it = content_index.find(content_key(content_hash, input_size, options_hash));
+        if (it == content_index.end()) return nullptr;
+        const JournalEntry* entry = find(it->second);
+        // The input may have been re-recorded with other contents since
+        if (!entry || entry->content_hash != content_hash || entry->options_hash != options_hash) return nullptr;
+        return entry;
+    }
+
+    // Append a record for a finished job (thread-safe)
+    void record(const std::string& key, const JournalEntry& entry) {
+        char prefix[128];
+        snprintf(prefix, sizeof(prefix), "%" PRIu64 "\t%" PRId64 "\t%016" PRIx64 "\t%016" PRIx64 "\t%" PRIu64 "\t",
+                 entry.input_size, entry.input_mtime_ns, entry.content_hash, entry.options_hash, entry.output_size);
+
+        std::lock_guard<std::mutex> lock(write_mutex);
+        fputs(prefix, file);
+        fputs(key.c_str(), file);
+        fputc('\t', file);
+        fputs(entry.output_path.c_str(), file);
+        fputc('\n', file);
+        fflush(file);  // A crash must not lose records of finished jobs
+    }
+};
+
+// Run-wide view of the output directories. Each directory is read with one
+// opendir/readdir pass the first time it is needed; after that, output existence
+// checks are hash lookups and each missing directory is created at most once.
+// Outputs written during the run are added so the view stays current. The pass also
+// removes temporary outputs left by killed runs.
+class OutputDirectoryCache {
+private:
+    struct Directory {
+        std::mutex mutex;
+        bool listed = false;
+        bool exists = false;
+        std::unordered_set<std::string> names;
+    };
+
+    std::mutex map_mutex;
+    std::unordered_map<std::string, std::unique_ptr<Directory>> directories;
+    bool live = false;
+
+    // Find or create the entry for a directory and list it on first use.
+    // Returns with the directory's mutex held by 'lock'.
+    Directory& lookup(const fs::path& dir, std::unique_lock<std::mutex>& lock) {
+        Directory* entry;
+        {
+            std::lock_guard<std::mutex> map_lock(map_mutex);
+            auto& slot = directories[dir.string()];
+            if (!slot) slot = std::make_unique<Directory>();
+            entry = slot.get();
+        }
+
+        lock = std::unique_lock<std::mutex>(entry->mutex);
+        if (!entry->listed) {
+            entry->listed = true;
+            DIR* handle = opendir(dir.empty() ? "." : dir.c_str());
+            if (handle) {
+                entry->exists = true;
+                while (dirent* item = readdir(handle)) {
+                    if (item->d_name[0] == '.' && stale_temporary(item->d_name) &&
+                        unlinkat(dirfd(handle), item->d_name, 0) == 0) {
+                        continue;
+                    }
+                    entry->names.insert(item->d_name);
+                }
+                closedir(handle);
+            }
+        }
+        return *entry;
+    }
+
+public:
+    // Long-running processes cannot trust a snapshot: probe the filesystem every time
+    void disable_snapshot() { live = true; }
+
+    bool file_exists(const fs::path& file) {
+        if (live) {
+            FileStat st;
+            return stat_file(file, st);
+        }
+        std::unique_lock<std::mutex> lock;
+        Directory& dir = lookup(file.parent_path(), lock);
+        return dir.names.count(file.filename().string()) > 0;
+    }
+
+    void mark_written(const fs::path& file) {
+        if (live) return;
+        std::unique_lock<std::mutex> lock;
+        Directory& dir = lookup(file.parent_path(), lock);
+        dir.names.insert(file.filename().string());
+    }
+
+    // Create a directory unless it exists (thread-safe, at most once per directory)
+    bool ensure_directory(const fs::path& path, std::string& error) {
+        if (path.empty()) return true;
+        if (live) {
+            std::error_code ec;
+            fs::create_directories(path, ec);
+            if (ec) error = ec.message();
+            return !ec;
+        }
+
+        std::unique_lock<std::mutex> lock;
+        Directory& dir = lookup(path, lock);
+        if (dir.exists) return true;
+
+        std::error_code ec;
+        fs::create_directories(path, ec);
+        if (ec) {
+            error = ec.message();
+            return false;
+        }
+        dir.exists = true;
+        thread_safe_print("Created output directory: " + path.string());
+        return true;
+    }
+};
+
+// Batch processor for memory-efficient processing
+class BatchProcessor {
+private:
+    std::priority_queue<ImageJob> job_queue;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    
+    // Long-running mode: workers wait for new jobs instead of exiting on an empty queue
+    bool serving = false;
+    
+    // Jobs being processed (guarded by queue_mutex). A running job may queue more (the images
+    // of a multi-image file), so workers only exit once the queue is empty and none run.
+    int running_jobs = 0;
+    std::vector<std::thread> workers;
+    std::atomic<int> success_count{0};
+    std::atomic<int> fail_count{0};
+    std::atomic<int> skip_count{0};
+    std::atomic<int> dedup_count{0};
+    Options options;
+    bool force_overwrite;
+    size_t memory_per_thread_mb;
+    size_t retained_context_bytes = 0;  // Each worker's context_retention_limit
+    unsigned int thread_count;
+    CompletionCallback on_complete;
+    CompletionJournal* journal = nullptr;
+    uint64_t options_hash = 0;
+    fs::path working_directory;
+    
+    // Output directory listings and created directories, shared by all workers
+    OutputDirectoryCache output_dirs;
+    
+    // Convert every top-level image of multi-image files, to name_N.jpg
+    bool all_images = false;
+    
+    // Raw pixel output: each job writes its record of the shard instead of a JPEG
+    TensorShard* shard = nullptr;
+    TensorOptions tensor;
+    
+    // Deduplication: representatives are held back until process_all() so that
+    // later byte-identical inputs can still be attached to them
+    bool dedup = false;
+    std::vector<ImageJob> pending_jobs;
+    std::unordered_map<uint64_t, size_t> representative_by_content;
+    
+    // Count a finished job and notify the caller
+    void finish(const ImageJob& job, JobStatus status, const std::string& message = std::string(),
+                uint64_t output_size = 0) {
+        switch (status) {
+            case JobStatus::Converted: success_count++; mark_job_converted(output_size); break;
+            case JobStatus::Linked:    dedup_count++;   break;
+            case JobStatus::Skipped:   skip_count++;    break;
+            case JobStatus::Failed:    fail_count++;    break;
+        }
+        if (on_complete) {
+            JobResult result{job.input_path, job.output_path, status, message};
+            result.tag = job.tag;
+            result.output_size = output_size;
+            on_complete(result);
+        }
+    }
+    
+    // Finish a job together with the duplicates riding on it
+    void finish_all(const ImageJob& job, JobStatus status, const std::string& message) {
+        finish(job, status, message);
+        for (const auto& duplicate : job.duplicates) {
+            finish(duplicate, status, message);
+        }
+    }
+    
+    // Absolute, normalized path without a getcwd() call per job
+    std::string absolute_key(const fs::path& path) const {
+        return (path.is_absolute() ? path : working_directory / path).lexically_normal().string();
+    }
+    
+    // Append a journal record for a finished output
+    void record_completion(const ImageJob& job, uint64_t output_size) {
+        if (!journal) return;
+        JournalEntry entry;
+        entry.input_size = job.input_size;
+        entry.input_mtime_ns = job.input_mtime_ns;
+        entry.content_hash = job.content_hash;
+        entry.options_hash = options_hash;
+        entry.output_size = output_size;
+        entry.output_path = absolute_key(job.output_path);
+        journal->record(job.journal_key, entry);
+    }
+    
+    // Link the renditions of an output linked to 'source' as well
+    bool link_renditions(const fs::path& source, const fs::path& target, std::string& error) {
+        for (const auto& rendition : options.renditions) {
+            if (!link_output(rendition_path(source, rendition), rendition_path(target, rendition), error)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Create the outputs of byte-identical inputs by linking them to the converted output
+    void link_duplicates(const ImageJob& job, uint64_t output_size) {
+        for (const auto& duplicate : job.duplicates) {
+            if (duplicate.output_path == job.output_path) {
+                finish(duplicate, JobStatus::Skipped, "Same output as " + job.input_path.string());
+                continue;
+            }
+            if (output_dirs.file_exists(duplicate.output_path) && !may_replace_output(duplicate)) {
+                thread_safe_print("Warning: Output file " + duplicate.output_path.string() + " already exists. Skipping conversion for " + duplicate.input_path.string());
+                finish(duplicate, JobStatus::Skipped, "Output already exists");
+                continue;
+            }
+            
+            std::string error;
+            if (output_dirs.ensure_directory(duplicate.output_path.parent_path(), error) &&
+                link_output(job.output_path, duplicate.output_path, error) &&
+                link_renditions(job.output_path, duplicate.output_path, error)) {
+                output_dirs.mark_written(duplicate.output_path);
+                thread_safe_print("Linked '" + duplicate.output_path.string() + "' to identical '" + job.output_path.string() + "'");
+                record_completion(duplicate, output_size);
+                finish(duplicate, JobStatus::Linked, std::string(), output_size);
+            } else {
+                thread_safe_print("Error: Failed to link '" + duplicate.output_path.string() + "': " + error);
+                finish(duplicate, JobStatus::Failed, error);
+            }
+        }
+    }
+    
+    // An existing output may be replaced without -f only if the journal records it as this
+    // job's output; any other file at that path belongs to the user
+    bool may_replace_output(const ImageJob& job) const {
+        if (force_overwrite) return true;
+        if (!journal) return false;
+        const JournalEntry* done = journal->find(job.journal_key);
+        return done && done->output_path == absolute_key(job.output_path);
+    }
+    
+    // Unchanged input already converted to the same output with the same options
+    bool journaled_as_current(const ImageJob& job) const {
+        if (!journal || force_overwrite) return false;
+        const JournalEntry* done = journal->find(job.journal_key);
+        return done && done->input_size == job.input_size && done->input_mtime_ns == job.input_mtime_ns &&
+               done->options_hash == options_hash && done->output_path == absolute_key(job.output_path);
+    }
+    
+    // Link to an earlier run's output of the same content (persistent dedup index)
+    bool reuse_previous_output(const ImageJob& job) {
+        if (!journal || force_overwrite) return false;
+        
+        const JournalEntry* previous = journal->find_content(job.content_hash, job.input_size, options_hash);
+        if (!previous) return false;
+        
+        // The earlier output must still be there and unchanged
+        FileStat output_stat;
+        if (!stat_file(previous->output_path, output_stat) || output_stat.size != previous->output_size) {
+            return false;
+        }
+        
+        if (previous->output_path == absolute_key(job.output_path)) {
+            // Input was only touched; its output is already current
+            record_completion(job, previous->output_size);
+            finish(job, JobStatus::Skipped, "Output already current");
+            return true;
+        }
+        
+        // Not over a file the journal does not know; the conversion path reports it
+        if (output_dirs.file_exists(job.output_path) && !may_replace_output(job)) return false;
+        
+        std::string error;
+        if (!output_dirs.ensure_directory(job.output_path.parent_path(), error) ||
+            !link_renditions(previous->output_path, job.output_path, error) ||
+            !link_output(previous->output_path, job.output_path, error)) {
+            return false;
+        }
+        output_dirs.mark_written(job.output_path);
+        
+        thread_safe_print("Linked '" + job.output_path.string() + "' to earlier output '" + previous->output_path + "'");
+        record_completion(job, previous->output_size);
+        finish(job, JobStatus::Linked, std::string(), previous->output_size);
+        return true;
+    }
+    
+    // Job on caller-provided descriptors: no path checks, the caller opened both ends
+    void process_descriptors(const ImageJob& job, size_t max_memory_mb) {
+        Options job_options = options;
+        job_options.max_memory_mb = max_memory_mb;
+        uint64_t output_size = 0;
+        std::string error;
+        if (convert_descriptor_to_jpeg(job.input_fd, job.output_fd, job.input_path.string(), job_options,
+                                       output_size, error)) {
+            finish(job, JobStatus::Converted, std::string(), output_size);
+        } else {
+            thread_safe_print("Error: " + error);
+            finish(job, JobStatus::Failed, error);
+        }
+    }
+    
+    // Queue a job and wake an idle worker
+    void push_job(ImageJob job) {
+        job.queued_ns = monotonic_ns();
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            job_queue.push(std::move(job));
+        }
+        queue_cv.notify_one();
+    }
+    
+    // Queue a job per top-level image of a multi-image file, all sharing its parsed container,
+    // so the images decode concurrently on the pool. Returns false for single-image files,
+    // which are converted to the usual output name.
+    bool queue_images(const ImageJob& job, const std::shared_ptr<SharedHeif>& container) {
+        heif_context* ctx = container->ctx.get();
+        int count = heif_context_get_number_of_top_level_images(ctx);
+        if (count < 2) return false;
+        std::vector<heif_item_id> ids(static_cast<size_t>(count));
+        count = heif_context_get_list_of_top_level_image_IDs(ctx, ids.data(), count);
+        
+        // Byte-identical inputs get outputs for each of their images too: convert them on their own
+        for (const auto& duplicate : job.duplicates) {
+            push_job(duplicate);
+        }
+        
+        fs::path stem = job.output_path.parent_path() / job.output_path.stem();
+        std::string extension = job.output_path.extension().string();
+        for (int i = 0; i < count; i++) {
+            std::string number = std::to_string(i + 1);
+            ImageJob image;
+            image.input_path = job.input_path;
+            image.output_path = stem.string() + "_" + number + extension;
+            image.tag = job.tag;
+            image.input_size = job.input_size;
+            image.input_mtime_ns = job.input_mtime_ns;
+            if (!job.journal_key.empty()) {
+                image.journal_key = job.journal_key + "#" + number;
+            }
+            image.container = container;
+            image.image_id = ids[static_cast<size_t>(i)];
+            if (journaled_as_current(image)) {
+                finish(image, JobStatus::Skipped, "Already converted (journal)");
+                continue;
+            }
+            
+            heif_image_handle* handle = nullptr;
+            if (heif_context_get_image_handle(ctx, image.image_id, &handle).code == heif_error_Ok && handle) {
+                image.estimated_memory_mb = estimate_image_memory(handle, saves_coefficients(options), options.renditions);
+            }
+            if (handle) heif_image_handle_release(handle);
+            push_job(std::move(image));
+        }
+        return true;
+    }
+    
+    // Worker function for processing a single file with memory and dimension limits
+    void process_file(const ImageJob& job, size_t max_memory_mb) {
+        if (job.input_fd >= 0) {
+            process_descriptors(job, max_memory_mb);
+            return;
+        }
+        
+        const fs::path& input_path = job.input_path;
+        const fs::path& output_path = job.output_path;
+        
+        // Check file existence and type (one stat call)
+        FileStat input_stat;
+        if (!stat_file(input_path, input_stat)) {
+            thread_safe_print("Error: Input file not found: " + input_path.string());
+            finish_all(job, JobStatus::Failed, "Input file not found");
+            return;
+        }
+        if (!input_stat.is_regular) {
+            thread_safe_print("Error: Input is not a regular file: " + input_path.string());
+            finish_all(job, JobStatus::Failed, "Input is not a regular file");
+            return;
+        }
+        
+        // Check file extension (.heic/.heif)
+        std::string ext = input_path.extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        if (ext != ".heic" && ext != ".heif") {
+            thread_safe_print("Warning: Skipping non-HEIC/HEIF file: " + input_path.string());
+            finish_all(job, JobStatus::Skipped, "Not a HEIC/HEIF file");
+            return;
+        }
+        
+        // Tensor output has no output file of its own to check or create
+        std::string error;
+        if (shard) {
+            Options job_options = options;
+            job_options.max_memory_mb = max_memory_mb;
+            uint64_t output_size = 0;
+            if (convert_heif_to_tensor(input_path, *shard, job.record, job_options, tensor, output_size, error)) {
+                finish(job, JobStatus::Converted, std::string(), output_size);
+            } else {
+                thread_safe_print("Error: " + error);
+                finish(job, JobStatus::Failed, error);
+            }
+            return;
+        }
+        
+        // With --all-images the container is parsed here, once, and a multi-image file is
+        // replaced by a job per image
+        std::shared_ptr<SharedHeif> container = job.container;
+        if (all_images && !container) {
+            container = open_shared_heif(input_path, error);
+            if (!container) {
+                thread_safe_print("Error: " + error);
+                finish_all(job, JobStatus::Failed, error);
+                return;
+            }
+            if (queue_images(job, container)) return;
+        }
+        
+        // Check if output exists. Outputs journaled for this input are redone when the input or
+        // the options changed (current ones were skipped while building the queue); outputs are
+        // renamed into place, so a crashed run leaves no partial file to redo.
+        if (output_dirs.file_exists(output_path) && !may_replace_output(job)) {
+            thread_safe_print("Warning: Output file " + output_path.string() + " already exists. Skipping conversion for " + input_path.string());
+            finish(job, JobStatus::Skipped, "Output already exists");
+            if (!job.duplicates.empty()) {
+                std::error_code ec;
+                uint64_t existing_size = fs::file_size(output_path, ec);
+                link_duplicates(job, ec ? 0 : existing_size);
+            }
+            return;
+        }
+        
+        // Create output directory if it doesn't exist
+        if (!output_dirs.ensure_directory(output_path.parent_path(), error)) {
+            error = "Failed to create output directory '" + output_path.parent_path().string() + "': " + error;
+            thread_safe_print("Error: " + error);
+            finish_all(job, JobStatus::Failed, error);
+            return;
+        }
+        
+        // Convert the file with dimension and memory limits
+        Options job_options = options;
+        job_options.max_memory_mb = max_memory_mb;
+        uint64_t output_size = 0;
+        bool converted = container ? convert_image_to_jpeg(container->ctx.get(), job.image_id, input_path, output_path,
+                                                           job_options, output_size, error)
+                                   : convert_heif_to_jpeg(input_path, output_path, job_options, output_size, error);
+        if (converted) {
+            output_dirs.mark_written(output_path);
+            record_completion(job, output_size);
+            finish(job, JobStatus::Converted, std::string(), output_size);
+            link_duplicates(job, output_size);
+        } else {
+            thread_safe_print("Error: " + error);
+            finish_all(job, JobStatus::Failed, error);
+        }
+    }
+    
+public:
+    BatchProcessor(const Options& options, bool force_overwrite, size_t memory_budget_mb,
+                   unsigned int thread_count, CompletionCallback on_complete = nullptr)
+        : options(options), force_overwrite(force_overwrite), thread_count(thread_count),
+          on_complete(std::move(on_complete)) {
+        // Divide memory budget by thread count. Part of each share is left for the buffers a
+        // thread keeps between images; ensure at least 100MB per thread for the images
+        size_t share_mb = memory_budget_mb / thread_count;
+        retained_context_bytes = retained_context_mb(share_mb) * 1024 * 1024;
+        memory_per_thread_mb = std::max<size_t>(100, share_mb - retained_context_mb(share_mb));
+        std::error_code ec;
+        working_directory = fs::current_path(ec);
+    }
+    
+    // Enable resumable runs; options_hash fingerprints every setting that affects output
+    void set_journal(CompletionJournal* completion_journal, uint64_t hash) {
+        journal = completion_journal;
+        options_hash = hash;
+    }
+    
+    // Hash inputs before queueing so byte-identical files are decoded only once
+    void enable_dedup() { dedup = true; }
+    
+    // Convert every top-level image of multi-image files instead of the primary one
+    void enable_all_images() { all_images = true; }
+    
+    // Check output existence against the live filesystem (long-running processes)
+    void disable_output_snapshot() { output_dirs.disable_snapshot(); }
+    
+    // Write the pixels of every job added from now on to 'tensor_shard'
+    void set_tensor_output(TensorShard* tensor_shard, const TensorOptions& tensor_options) {
+        shard = tensor_shard;
+        tensor = tensor_options;
+    }
+    
+    void add_job(const BatchItem& item) {
+        const fs::path& input_path = item.input_path;
+        const fs::path& output_path = item.output_path;
+        ImageJob job;
+        job.input_path = input_path;
+        job.output_path = output_path;
+        job.input_fd = item.input_fd;
+        job.output_fd = item.output_fd;
+        job.tag = item.tag;
+        if (shard) {
+            job.record = shard->add(input_path);
+        }
+        
+        // Descriptor jobs bypass the journal and dedup; the size is unknown until mapped
+        if (job.input_fd >= 0) {
+            push_job(std::move(job));
+            return;
+        }
+        
+        if (journal) {
+            job.journal_key = absolute_key(input_path);
+            
+            FileStat input_stat;
+            if (stat_file(input_path, input_stat)) {
+                job.input_size = input_stat.size;
+                job.input_mtime_ns = input_stat.mtime_ns;
+                
+                // Skip without touching the output or parsing the HEIF container
+                if (journaled_as_current(job)) {
+                    finish(job, JobStatus::Skipped, "Already converted (journal)");
+                    return;
+                }
+            }
+        }
+        
+        // Which auxiliary outputs an image has is only known once it is converted, so with
+        // extract_auxiliary every copy is converted instead of linked
+        bool hashed = false;
+        if (dedup && !options.extract_auxiliary) {
+            TraceScope stage("hash", input_path);
+            hashed = hash_file_contents(input_path, job.content_hash, job.input_size);
+        }
+        if (hashed) {
+            if (reuse_previous_output(job)) return;
+            
+            // Same content earlier in this run: link to that job's output once it is done
+            uint64_t content_key = job.content_hash ^ (job.input_size * 0x9e3779b97f4a7c15ULL);
+            auto it = representative_by_content.find(content_key);
+            if (it != representative_by_content.end()) {
+                pending_jobs[it->second].duplicates.push_back(std::move(job));
+                return;
+            }
+            representative_by_content[content_key] = pending_jobs.size();
+            
+            job.estimated_memory_mb = traced_estimate(input_path);
+            pending_jobs.push_back(std::move(job));
+            return;
+        }
+        
+        job.estimated_memory_mb = traced_estimate(input_path);
+        push_job(std::move(job));
+    }
+    
+    // Memory estimate (parses the container) on the thread that queues the job
+    size_t traced_estimate(const fs::path& input_path) const {
+        TraceScope stage("estimate", input_path);
+        return estimate_memory_requirement(input_path, nullptr, saves_coefficients(options), options.renditions);
+    }
+    
+    // Start workers that stay up and wait for jobs until stop()
+    void start() {
+        serving = true;
+        note_worker_count(thread_count);
+        for (unsigned int i = 0; i < thread_count; i++) {
+            workers.emplace_back(&BatchProcessor::worker_thread, this);
+        }
+    }
+    
+    // Let the workers drain the queue, then join them
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            serving = false;
+        }
+        queue_cv.notify_all();
+        for (auto& thread : workers) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        return_idle_cores(-static_cast<int>(workers.size()));
+        workers.clear();
+    }
+    
+    size_t queued() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        return job_queue.size();
+    }
+    
+    void process_all() {
+        std::vector<std::thread> thread_pool;
+        
+        // Queue deduplicated representatives
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            uint64_t now_ns = monotonic_ns();
+            for (auto& job : pending_jobs) {
+                job.queued_ns = now_ns;
+                job_queue.push(std::move(job));
+            }
+            pending_jobs.clear();
+            representative_by_content.clear();
+        }
+        
+        // Start worker threads
+        note_worker_count(thread_count);
+        for (unsigned int i = 0; i < thread_count; i++) {
+            thread_pool.emplace_back(&BatchProcessor::worker_thread, this);
+        }
+        
+        // Wait for all threads to complete
+        for (auto& thread : thread_pool) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        return_idle_cores(-static_cast<int>(thread_count));
+    }
+    
+    void worker_thread() {
+        context_retention_limit = retained_context_bytes;
+        while (true) {
+            // Get next job from queue
+            ImageJob current_job;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                if (job_queue.empty() && (serving || running_jobs > 0)) {
+                    // Lend the core to running jobs while waiting
+                    return_idle_cores(1);
+                    queue_cv.wait(lock, [this] { return !job_queue.empty() || (!serving && running_jobs == 0); });
+                    return_idle_cores(-1);
+                }
+                if (job_queue.empty()) {
+                    return_idle_cores(1);   // Taken back when all workers are joined
+                    return; // No more work
+                }
+                
+                current_job = job_queue.top();
+                job_queue.pop();
+                running_jobs++;
+            }
+            record_queue_wait(current_job.queued_ns);
+            
+            TraceScope job_scope(STAGE_JOB, current_job.input_path);
+            
+            // Check if job exceeds memory limit for this thread
+            if (current_job.estimated_memory_mb > memory_per_thread_mb) {
+                thread_safe_print("Warning: Image " + current_job.input_path.string() + 
+                                 " requires " + std::to_string(current_job.estimated_memory_mb) + 
+                                 "MB which exceeds per-thread limit of " + 
+                                 std::to_string(memory_per_thread_mb) + "MB");
+                
+                // Try processing with reduced memory constraint anyway
+                process_file(current_job, memory_per_thread_mb);
+            } else {
+                // Process normally
+                process_file(current_job, memory_per_thread_mb);
+            }
+            trim_conversion_context();
+            
+            // The last running job wakes the waiting workers once nothing is left to do
+            bool drained;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                running_jobs--;
+                drained = running_jobs == 0 && job_queue.empty();
+            }
+            if (drained) {
+                queue_cv.notify_all();
+            }
+        }
+    }
+    
+    // Get results
+    int get_success_count() const { return success_count.load(); }
+    int get_fail_count() const { return fail_count.load(); }
+    int get_skip_count() const { return skip_count.load(); }
+    int get_dedup_count() const { return dedup_count.load(); }
+};
+
+// Function to get the number of performance cores on macOS
+unsigned int performance_core_count() {
+    unsigned int performance_cores = 0;
+    
+#ifdef __APPLE__
+    // Try to get the number of performance cores (Apple-specific)
+    int perf_cores = 0;
+    size_t size = sizeof(perf_cores);
+    
+    // Try to read performance core count
+    if (sysctlbyname("hw.perflevel0.physicalcpu", &perf_cores, &size, NULL, 0) == 0 && perf_cores > 0) {
+        performance_cores = perf_cores;
+        thread_safe_print("Detected " + std::to_string(performance_cores) + " performance cores");
+    } else {
+        // Fallback: try to get total physical CPU count
+        if (sysctlbyname("hw.physicalcpu", &perf_cores, &size, NULL, 0) == 0 && perf_cores > 0) {
+            // On non-hybrid architectures, use half of physical cores as an approximation
+            performance_cores = (perf_cores + 1) / 2;
+            thread_safe_print("Using " + std::to_string(performance_cores) + " threads (half of " + 
+                             std::to_string(perf_cores) + " physical cores)");
+        }
+    }
+#endif
+
+    // If we couldn't determine the performance core count, use a reasonable default
+    if (performance_cores == 0) {
+        // Use half of available logical cores or at least 2
+        performance_cores = std::max(2u, std::thread::hardware_concurrency() / 2);
+        thread_safe_print("Using default of " + std::to_string(performance_cores) + " threads");
+    }
+    
+    return performance_cores;
+}
+
+// Fingerprint of every option that changes the produced JPEG (for the journal)
+uint64_t options_fingerprint(const Options& options) {
+    std::stringstream fingerprint;
+    fingerprint << "q=" << options.quality << ";w=" << options.max_width << ";h=" << options.max_height;
+    // Only non-default settings are added, so existing journals stay valid
+    if (options.profile != Profile::Default) {
+        fingerprint << ";p=" << static_cast<int>(options.profile);
+    }
+    if (options.target_size > 0) {
+        fingerprint << ";ts=" << options.target_size;
+    }
+    if (options.target_ssim > 0) {
+        fingerprint << ";ss=" << options.target_ssim;
+    }
+    if (options.hdr_mode != HdrMode::Auto) {
+        fingerprint << ";hdr=" << static_cast<int>(options.hdr_mode);
+    }
+    if (options.background != 0xFFFFFF) {
+        fingerprint << ";bg=" << options.background;
+    }
+    if (options.keep_orientation) {
+        fingerprint << ";ko";
+    }
+    if (options.lossless_rotate) {
+        fingerprint << ";lr";
+    }
+    if (options.extract_auxiliary) {
+        fingerprint << ";aux";
+    }
+    if (options.to_srgb) {
+        fingerprint << ";srgb";
+    }
+    if (options.fit) {
+        fingerprint << ";fit=" << static_cast<int>(options.resize_filter);
+    } else if (!options.renditions.empty() && options.resize_filter != ResizeFilter::Lanczos) {
+        fingerprint << ";rf=" << static_cast<int>(options.resize_filter);
+    }
+    for (const auto& rendition : options.renditions) {
+        fingerprint << ";r=" << rendition.name << ':' << rendition.max_side << ':' << rendition.quality;
+    }
+    return fnv1a_64(fingerprint.str());
+}
+
+Converter::Converter(unsigned int threads, size_t memory_budget_mb)
+    : threads(threads > 0 ? threads : performance_core_count()),
+      memory_budget(memory_budget_mb > 0 ? memory_budget_mb : available_memory_mb() * 3 / 4) {}
+
+std::vector<uint8_t> Converter::convert(const uint8_t* heif_data, size_t heif_size, const Options& options) const {
+    TraceScope job_scope(STAGE_JOB, "<memory>");
+    HeifContextGuard ctx;
+    if (!ctx) {
+        throw ConversionError("Failed to allocate libheif context.");
+    }
+
+    heif_error err = heif_context_read_from_memory_without_copy(ctx.get(), heif_data, heif_size, nullptr);
+    if (err.code != heif_error_Ok) {
+        throw ConversionError(std::string("Failed to read HEIF data: ") + err.message);
+    }
+
+    // The calling thread keeps the buffers of a worker's share of the budget at most
+    context_retention_limit = retained_context_mb(memory_budget / threads) * 1024 * 1024;
+    std::vector<uint8_t> jpeg;
+    std::string error;
+    bool encoded = encode_heif_to_jpeg(ctx.get(), 0, "<memory>", options, jpeg, error);
+    trim_conversion_context();
+    if (!encoded) {
+        throw ConversionError(error);
+    }
+    mark_job_converted(jpeg.size());
+    return jpeg;
+}
+
+std::vector<uint8_t> Converter::convert(const std::vector<uint8_t>& heif_data, const Options& options) const {
+    return convert(heif_data.data(), heif_data.size(), options);
+}
+
+BatchSummary Converter::convert_batch(const std::vector<BatchItem>& items, const BatchOptions& options,
+                                      const CompletionCallback& on_complete) const {
+    BatchProcessor processor(options.image, options.force_overwrite, memory_budget, threads, on_complete);
+    
+    // Open the completion journal (resumable runs)
+    CompletionJournal journal;
+    if (!options.journal_path.empty()) {
+        std::string journal_error;
+        if (!journal.open(options.journal_path, journal_error)) {
+            throw std::runtime_error("Failed to open journal '" + options.journal_path.string() + "': " + journal_error);
+        }
+        thread_safe_print("Loaded " + std::to_string(journal.size()) + " journal records from " +
+                          options.journal_path.string());
+        processor.set_journal(&journal, options_fingerprint(options.image));
+    }
+    if (options.dedup) {
+        processor.enable_dedup();
+    }
+    if (options.all_images) {
+        processor.enable_all_images();
+    }
+    
+    // Raw pixel output into one shard for the whole batch
+    TensorShard shard;
+    if (!options.tensor.shard_path.empty()) {
+        if (!options.journal_path.empty() || options.dedup || options.all_images) {
+            throw std::runtime_error("Tensor output cannot be combined with the journal, dedup or all_images");
+        }
+        std::string shard_error;
+        if (!shard.open(options.tensor.shard_path, options.tensor.layout, shard_error)) {
+            throw std::runtime_error("Failed to open tensor shard '" + options.tensor.shard_path.string() + "': " +
+                                     shard_error);
+        }
+        processor.set_tensor_output(&shard, options.tensor);
+    }
+    
+    // Prepare all jobs
+    for (const auto& item : items) {
+        processor.add_job(item);
+    }
+    
+    // Process all images
+    processor.process_all();
+    
+    if (shard.is_open()) {
+        std::string shard_error;
+        if (!shard.finish(shard_error)) {
+            throw std::runtime_error("Failed to write tensor shard '" + options.tensor.shard_path.string() + "': " +
+                                     shard_error);
+        }
+    }
+    
+    BatchSummary summary;
+    summary.converted = processor.get_success_count();
+    summary.linked = processor.get_dedup_count();
+    summary.skipped = processor.get_skip_count();
+    summary.failed = processor.get_fail_count();
+    return summary;
+}
+
+struct ConversionService::Impl {
+    BatchProcessor processor;
+    
+    Impl(const Converter& converter, const BatchOptions& options, CompletionCallback on_complete)
+        : processor(options.image, options.force_overwrite, converter.memory_budget_mb(),
+                    converter.thread_count(), std::move(on_complete)) {}
+};
+
+ConversionService::ConversionService(const Converter& converter, const BatchOptions& options,
+                                     CompletionCallback on_complete)
+    : impl(std::make_unique<Impl>(converter, options, std::move(on_complete))) {
+    impl->processor.disable_output_snapshot();
+    impl->processor.start();
+}
+
+ConversionService::~ConversionService() {
+    impl->processor.stop();
+}
+
+void ConversionService::submit(const BatchItem& item) {
+    impl->processor.add_job(item);
+}
+
+size_t ConversionService::queued() const {
+    return impl->processor.queued();
+}
+
+BatchSummary ConversionService::summary() const {
+    BatchSummary summary;
+    summary.converted = impl->processor.get_success_count();
+    summary.linked = impl->processor.get_dedup_count();
+    summary.skipped = impl->processor.get_skip_count();
+    summary.failed = impl->processor.get_fail_count();
+    return summary;
+}
+
+} // namespace heif2jpeg
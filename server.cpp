@@ -0,0 +1,628 @@
+#include "server.h"
+
+#include <string>         // std::string
+#include <vector>         // std::vector
+#include <deque>          // Received descriptors waiting for their request
+#include <unordered_map>  // Requests in flight, by tag
+#include <memory>         // std::shared_ptr
+#include <mutex>          // std::mutex
+#include <condition_variable> // Backpressure and connection draining
+#include <thread>         // One reader thread per client
+#include <atomic>         // std::atomic
+#include <csignal>        // SIGINT/SIGTERM shutdown, SIGPIPE
+#include <cstring>        // memcpy, strerror
+#include <cerrno>         // errno
+
+#include <sys/socket.h>   // socket, sendmsg, recvmsg, SCM_RIGHTS
+#include <sys/un.h>       // sockaddr_un
+#include <sys/stat.h>     // lstat, umask for the socket file
+#include <sys/time.h>     // timeval for SO_SNDTIMEO
+#include <poll.h>         // poll on the listening socket
+#include <fcntl.h>        // open, fcntl
+#include <unistd.h>       // close, unlink
+
+// Console output, shared with main()
+void thread_safe_print(const std::string& message);
+
+namespace {
+
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;         // SIGPIPE is ignored instead (macOS)
+#endif
+
+#ifdef MSG_CMSG_CLOEXEC
+const int RECV_FLAGS = MSG_CMSG_CLOEXEC;
+#else
+const int RECV_FLAGS = 0;
+#endif
+
+const size_t MAX_LINE = 64 * 1024;  // Longest accepted request line
+const int MAX_FDS_PER_MESSAGE = 16;
+
+// Send a whole buffer, optionally attaching descriptors to the first chunk
+bool send_all(int fd, const std::string& data, const int* fds = nullptr, int fd_count = 0) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        iovec iov;
+        iov.iov_base = const_cast<char*>(data.data() + sent);
+        iov.iov_len = data.size() - sent;
+
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+        if (fd_count > 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+        }
+
+        ssize_t n = sendmsg(fd, &msg, SEND_FLAGS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+        fd_count = 0;  // Descriptors travel with the first byte only
+    }
+    return true;
+}
+
+// Whether the process at the other end of 'fd' runs as this process's user (or root)
+bool peer_is_own_user(int fd) {
+#if defined(SO_PEERCRED)
+    ucred credentials = {};
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) return false;
+    uid_t uid = credentials.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) != 0) return false;
+#endif
+    return uid == geteuid() || uid == 0;
+}
+
+// Reads newline-terminated lines and collects the descriptors passed along with them. A
+// descriptor belongs to the line whose bytes it arrived with (the sender attaches it to the
+// first byte); whatever that line does not take is closed before the next line is read.
+class LineReader {
+private:
+    int fd;
+    std::string buffer;
+    uint64_t buffer_offset = 0;   // Stream offset of buffer[0]
+    std::deque<std::pair<uint64_t, int>> received_fds;  // Stream offset they arrived at
+    std::deque<int> line_fds;     // Descriptors of the last line returned
+
+    void close_line_fds() {
+        for (int received : line_fds) close(received);
+        line_fds.clear();
+    }
+
+public:
+    explicit LineReader(int fd) : fd(fd) {}
+    ~LineReader() {
+        close_line_fds();
+        for (const auto& received : received_fds) close(received.second);
+    }
+    // Prevent copying
+    LineReader(const LineReader&) = delete;
+    LineReader& operator=(const LineReader&) = delete;
+
+    // Returns false on end of stream, error, or an over-long line
+    bool read_line(std::string& line) {
+        close_line_fds();
+        while (true) {
+            size_t newline = buffer.find('\n');
+            if (newline != std::string::npos) {
+                line.assign(buffer, 0, newline);
+                uint64_t line_end = buffer_offset + newline;
+                while (!received_fds.empty() && received_fds.front().first <= line_end) {
+                    line_fds.push_back(received_fds.front().second);
+                    received_fds.pop_front();
+                }
+                buffer.erase(0, newline + 1);
+                buffer_offset = line_end + 1;
+                return true;
+            }
+            if (buffer.size() > MAX_LINE) return false;
+
+            char data[4096];
+            iovec iov;
+            iov.iov_base = data;
+            iov.iov_len = sizeof(data);
+
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            ssize_t n = recvmsg(fd, &msg, RECV_FLAGS);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (size_t i = 0; i < count; i++) {
+                    int received;
+                    memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+                    fcntl(received, F_SETFD, FD_CLOEXEC);
+#endif
+                    received_fds.emplace_back(buffer_offset + buffer.size(), received);
+                }
+            }
+            buffer.append(data, static_cast<size_t>(n));
+        }
+    }
+
+    // Take the next descriptor received with the last line (-1 if none)
+    int take_fd() {
+        if (line_fds.empty()) return -1;
+        int next = line_fds.front();
+        line_fds.pop_front();
+        return next;
+    }
+};
+
+std::vector<std::string> split_fields(const std::string& line) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t tab = line.find('\t', start);
+        fields.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+        if (tab == std::string::npos) break;
+        start = tab + 1;
+    }
+    return fields;
+}
+
+// Messages go on one protocol line: no tabs or newlines
+std::string single_line(std::string text) {
+    for (char& c : text) {
+        if (c == '\t' || c == '\n' || c == '\r') c = ' ';
+    }
+    return text;
+}
+
+void close_if_open(int fd) {
+    if (fd >= 0) close(fd);
+}
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop_signal(int) {
+    stop_requested = 1;
+}
+
+// One connected client
+struct Connection {
+    int fd;
+    std::mutex write_mutex;           // Replies come from several worker threads
+    std::mutex state_mutex;
+    std::condition_variable drained;
+    int in_flight = 0;                // Submitted requests not yet answered
+
+    explicit Connection(int fd) : fd(fd) {}
+
+    void reply(const std::string& line) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        send_all(fd, line + "\n");    // A client that went away just misses its replies
+    }
+};
+
+struct PendingRequest {
+    std::shared_ptr<Connection> connection;
+    std::string id;
+    int input_fd = -1;
+    int output_fd = -1;
+};
+
+class Server {
+private:
+    const heif2jpeg::Converter& converter;
+    heif2jpeg::BatchOptions options;
+    size_t max_queued;
+    std::unique_ptr<heif2jpeg::ConversionService> service;
+
+    // Requests in flight, keyed by BatchItem::tag
+    std::mutex pending_mutex;
+    std::condition_variable slot_free;
+    std::unordered_map<uint64_t, PendingRequest> pending;
+    uint64_t next_tag = 1;
+    bool stopping = false;
+
+    // Connected clients, so shutdown can stop their readers and wait for them
+    std::mutex clients_mutex;
+    std::condition_variable clients_done;
+    std::vector<std::shared_ptr<Connection>> clients;
+
+    void on_complete(const heif2jpeg::JobResult& result) {
+        PendingRequest request;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            auto it = pending.find(result.tag);
+            if (it == pending.end()) return;
+            request = std::move(it->second);
+            pending.erase(it);
+        }
+        slot_free.notify_one();
+        close_if_open(request.input_fd);
+        close_if_open(request.output_fd);
+
+        switch (result.status) {
+            case heif2jpeg::JobStatus::Converted:
+            case heif2jpeg::JobStatus::Linked:
+                request.connection->reply(request.id + "\tOK\t" + std::to_string(result.output_size));
+                break;
+            case heif2jpeg::JobStatus::Skipped:
+                request.connection->reply(request.id + "\tSKIPPED\t" + single_line(result.message));
+                break;
+            case heif2jpeg::JobStatus::Failed:
+                request.connection->reply(request.id + "\tERROR\t" + single_line(result.message));
+                break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(request.connection->state_mutex);
+            request.connection->in_flight--;
+        }
+        request.connection->drained.notify_all();
+    }
+
+    // Queue one request, waiting for a free slot first (backpressure)
+    void submit(const std::shared_ptr<Connection>& connection, const std::string& id, heif2jpeg::BatchItem item) {
+        uint64_t tag;
+        {
+            std::unique_lock<std::mutex> lock(pending_mutex);
+            slot_free.wait(lock, [this] { return pending.size() < max_queued || stopping; });
+            if (stopping) {
+                lock.unlock();
+                close_if_open(item.input_fd);
+                close_if_open(item.output_fd);
+                connection->reply(id + "\tERROR\tServer shutting down");
+                return;
+            }
+            tag = next_tag++;
+            PendingRequest& request = pending[tag];
+            request.connection = connection;
+            request.id = id;
+            request.input_fd = item.input_fd;
+            request.output_fd = item.output_fd;
+        }
+        {
+            std::lock_guard<std::mutex> lock(connection->state_mutex);
+            connection->in_flight++;
+        }
+        item.tag = tag;
+        service->submit(item);
+    }
+
+    void serve_client(std::shared_ptr<Connection> connection) {
+        LineReader reader(connection->fd);
+        std::string line;
+        while (reader.read_line(line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty()) continue;
+
+            std::vector<std::string> fields = split_fields(line);
+            std::string id = fields.size() > 1 ? fields[1] : "-";
+            heif2jpeg::BatchItem item;
+
+            if (fields[0] == "CONVERT" && fields.size() == 4 && !fields[2].empty() && !fields[3].empty()) {
+                item.input_path = fields[2];
+                item.output_path = fields[3];
+            } else if (fields[0] == "CONVERTFD" && fields.size() == 3) {
+                item.input_fd = reader.take_fd();
+                item.output_fd = reader.take_fd();
+                if (item.input_fd < 0 || item.output_fd < 0) {
+                    close_if_open(item.input_fd);
+                    close_if_open(item.output_fd);
+                    connection->reply(id + "\tERROR\tExpected input and output descriptors");
+                    continue;
+                }
+                item.input_path = fields[2];
+                item.output_path = fields[2];
+            } else {
+                connection->reply(id + "\tERROR\tMalformed request");
+                continue;
+            }
+            submit(connection, id, std::move(item));
+        }
+
+        // Answer everything already accepted before hanging up
+        {
+            std::unique_lock<std::mutex> lock(connection->state_mutex);
+            connection->drained.wait(lock, [&connection] { return connection->in_flight == 0; });
+        }
+
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        close(connection->fd);
+        for (auto it = clients.begin(); it != clients.end(); ++it) {
+            if (*it == connection) {
+                clients.erase(it);
+                break;
+            }
+        }
+        clients_done.notify_all();
+    }
+
+public:
+    Server(const heif2jpeg::Converter& converter, const heif2jpeg::BatchOptions& options, size_t max_queued)
+        : converter(converter), options(options), max_queued(max_queued) {}
+
+    int run(const fs::path& socket_path) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socket_path.string().size() >= sizeof(address.sun_path)) {
+            thread_safe_print("Error: Socket path too long: " + socket_path.string());
+            return 1;
+        }
+        strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+            thread_safe_print(std::string("Error: Cannot create socket: ") + strerror(errno));
+            return 1;
+        }
+        fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+        // Replace a stale socket file, but never steal the socket of a running server
+        if (connect(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            thread_safe_print("Error: A server is already listening on " + socket_path.string());
+            close(listen_fd);
+            return 1;
+        }
+        close(listen_fd);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+            thread_safe_print(std::string("Error: Cannot create socket: ") + strerror(errno));
+            return 1;
+        }
+        fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+        // Only a stale socket is removed; any other file at the path is the user's
+        struct stat existing;
+        if (lstat(socket_path.c_str(), &existing) == 0) {
+            if (!S_ISSOCK(existing.st_mode)) {
+                thread_safe_print("Error: " + socket_path.string() + " exists and is not a socket");
+                close(listen_fd);
+                return 1;
+            }
+            unlink(socket_path.c_str());
+        }
+
+        // Requests read and write files with the server's privileges: only its own user may
+        // connect. The socket file is created owner-only (no window with the umask's mode),
+        // and the peer's uid is checked on every connection as well.
+        mode_t previous_umask = umask(0177);
+        int bound = bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        umask(previous_umask);
+        if (bound != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+            thread_safe_print("Error: Cannot listen on " + socket_path.string() + ": " + strerror(errno));
+            close(listen_fd);
+            return 1;
+        }
+
+        // Stop on SIGINT/SIGTERM; interrupt poll() instead of restarting it
+        struct sigaction action = {};
+        action.sa_handler = handle_stop_signal;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+
+        service = std::make_unique<heif2jpeg::ConversionService>(
+            converter, options, [this](const heif2jpeg::JobResult& result) { on_complete(result); });
+        thread_safe_print("Listening on " + socket_path.string() + " (queue limit " +
+                          std::to_string(max_queued) + ")");
+
+        while (!stop_requested) {
+            pollfd pfd = {listen_fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, 1000);
+            if (ready <= 0) continue;
+
+            int client_fd = accept(listen_fd, nullptr, nullptr);
+            if (client_fd < 0) continue;
+            fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+            if (!peer_is_own_user(client_fd)) {
+                thread_safe_print("Warning: Rejected a connection from another user");
+                close(client_fd);
+                continue;
+            }
+#ifdef SO_NOSIGPIPE
+            int one = 1;
+            setsockopt(client_fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+            // A client that stops reading must not hold a worker thread forever
+            timeval timeout = {10, 0};
+            setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            auto connection = std::make_shared<Connection>(client_fd);
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                clients.push_back(connection);
+            }
+            std::thread(&Server::serve_client, this, connection).detach();
+        }
+
+        thread_safe_print("Shutting down: finishing accepted requests ...");
+        close(listen_fd);
+        unlink(socket_path.c_str());
+
+        // Stop reading new requests, release submitters waiting for a slot,
+        // and wait until every client has been answered
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            stopping = true;
+        }
+        slot_free.notify_all();
+        {
+            std::unique_lock<std::mutex> lock(clients_mutex);
+            for (const auto& connection : clients) {
+                shutdown(connection->fd, SHUT_RD);
+            }
+            clients_done.wait(lock, [this] { return clients.empty(); });
+        }
+
+        heif2jpeg::BatchSummary summary = service->summary();
+        service.reset();
+
+        thread_safe_print("Server stopped. Converted: " + std::to_string(summary.converted) +
+                          ", skipped: " + std::to_string(summary.skipped) +
+                          ", failed: " + std::to_string(summary.failed));
+        return 0;
+    }
+};
+
+} // namespace
+
+int run_server(const fs::path& socket_path, const heif2jpeg::Converter& converter,
+               const heif2jpeg::BatchOptions& options, size_t max_queued) {
+    Server server(converter, options, max_queued > 0 ? max_queued : 1);
+    return server.run(socket_path);
+}
+
+int run_client(const fs::path& socket_path, const std::vector<heif2jpeg::BatchItem>& items,
+               bool pass_fds, bool force_overwrite) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.string().size() >= sizeof(address.sun_path)) {
+        thread_safe_print("Error: Socket path too long: " + socket_path.string());
+        return 1;
+    }
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        thread_safe_print("Error: Cannot connect to " + socket_path.string() + ": " + strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::atomic<int> converted{0};
+    std::atomic<int> skipped{0};
+    std::atomic<int> failed{0};
+    std::vector<char> answered(items.size(), 0);
+    std::vector<char> created_output(items.size(), 0);  // Outputs this client created (descriptor mode)
+
+    // Replies arrive while requests are still being sent; read them on their own thread
+    // so a full socket buffer in either direction cannot deadlock the two sides
+    std::thread reply_reader([&] {
+        LineReader reader(fd);
+        std::string line;
+        while (reader.read_line(line)) {
+            std::vector<std::string> fields = split_fields(line);
+            if (fields.size() < 3) continue;
+            size_t index;
+            try {
+                index = std::stoul(fields[0]);
+            } catch (const std::exception&) {
+                thread_safe_print("Error from server: " + line);
+                continue;
+            }
+            if (index >= items.size() || answered[index]) continue;
+            answered[index] = 1;
+
+            const heif2jpeg::BatchItem& item = items[index];
+            if (fields[1] == "OK") {
+                converted++;
+                thread_safe_print("Converted '" + item.input_path.string() + "' to '" + item.output_path.string() +
+                                  "' (" + fields[2] + " bytes)");
+            } else if (fields[1] == "SKIPPED") {
+                skipped++;
+                thread_safe_print("Skipped '" + item.input_path.string() + "': " + fields[2]);
+            } else {
+                failed++;
+                thread_safe_print("Error: '" + item.input_path.string() + "': " + fields[2]);
+                if (created_output[index]) {
+                    unlink(item.output_path.c_str());
+                }
+            }
+        }
+    });
+
+    for (size_t i = 0; i < items.size(); i++) {
+        const heif2jpeg::BatchItem& item = items[i];
+        std::string id = std::to_string(i);
+
+        if (!pass_fds) {
+            std::error_code ec;
+            std::string input = fs::absolute(item.input_path, ec).lexically_normal().string();
+            std::string output = fs::absolute(item.output_path, ec).lexically_normal().string();
+            if (input.find_first_of("\t\n") != std::string::npos || output.find_first_of("\t\n") != std::string::npos) {
+                thread_safe_print("Error: Path contains a tab or newline: " + item.input_path.string());
+                answered[i] = 1;
+                failed++;
+                continue;
+            }
+            if (!send_all(fd, "CONVERT\t" + id + "\t" + input + "\t" + output + "\n")) break;
+            continue;
+        }
+
+        // Descriptor mode: the server needs no access to our paths
+        int descriptors[2];
+        descriptors[0] = open(item.input_path.c_str(), O_RDONLY);
+        if (descriptors[0] < 0) {
+            thread_safe_print("Error: Cannot open input '" + item.input_path.string() + "': " + strerror(errno));
+            answered[i] = 1;
+            failed++;
+            continue;
+        }
+        // An existing output is unlinked rather than truncated, so a hardlinked copy (--dedup)
+        // keeps its contents
+        if (force_overwrite) unlink(item.output_path.c_str());
+        descriptors[1] = open(item.output_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (descriptors[1] < 0) {
+            int open_error = errno;
+            close(descriptors[0]);
+            answered[i] = 1;
+            if (open_error == EEXIST) {
+                thread_safe_print("Warning: Output file " + item.output_path.string() + " already exists. Skipping conversion for " + item.input_path.string());
+                skipped++;
+            } else {
+                thread_safe_print("Error: Cannot open output '" + item.output_path.string() + "': " + strerror(open_error));
+                failed++;
+            }
+            continue;
+        }
+        created_output[i] = 1;
+
+        bool ok = send_all(fd, "CONVERTFD\t" + id + "\t" + single_line(item.input_path.filename().string()) + "\n",
+                           descriptors, 2);
+        close(descriptors[0]);   // The server holds its own copies now
+        close(descriptors[1]);
+        if (!ok) break;
+    }
+
+    // No more requests: the server answers what it accepted, then closes the connection
+    shutdown(fd, SHUT_WR);
+    reply_reader.join();
+    close(fd);
+
+    for (size_t i = 0; i < items.size(); i++) {
+        if (!answered[i]) {
+            failed++;
+            thread_safe_print("Error: No reply for '" + items[i].input_path.string() + "'");
+            if (created_output[i]) unlink(items[i].output_path.c_str());
+        }
+    }
+
+    thread_safe_print("----------------------------------------");
+    thread_safe_print("Processing finished (server " + socket_path.string() + ").");
+    thread_safe_print("  Successful conversions: " + std::to_string(converted.load()));
+    thread_safe_print("  Skipped:                " + std::to_string(skipped.load()));
+    thread_safe_print("  Failed conversions:     " + std::to_string(failed.load()));
+    return failed > 0 ? 1 : 0;
+}
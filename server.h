@@ -0,0 +1,36 @@
+// Daemon mode: conversion requests over a Unix domain socket
+//
+// Protocol: one request per line, fields separated by tabs. Replies are sent in
+// completion order (not request order) and carry the request id.
+//
+//   CONVERT <id> <input path> <output path>    Paths are resolved by the server
+//   CONVERTFD <id> <name>                      Sent with SCM_RIGHTS carrying two
+//                                              descriptors: input, then output
+//
+//   <id> OK <output bytes>
+//   <id> SKIPPED <reason>
+//   <id> ERROR <reason>
+//
+// The input descriptor may be a regular file, a memfd (both are mapped, not copied)
+// or a pipe. The JPEG is written at the output descriptor's current offset.
+
+#pragma once
+
+#include "heif2jpeg.h"
+
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Serve requests on a warm worker pool until SIGINT/SIGTERM. At most 'max_queued'
+// requests are accepted but unfinished; beyond that the server stops reading from
+// clients, so they block in send(). Returns the process exit code.
+int run_server(const fs::path& socket_path, const heif2jpeg::Converter& converter,
+               const heif2jpeg::BatchOptions& options, size_t max_queued);
+
+// Send the items to a running server and wait for all replies. With pass_fds the
+// client opens the files itself and passes the descriptors. Returns the process exit code.
+int run_client(const fs::path& socket_path, const std::vector<heif2jpeg::BatchItem>& items,
+               bool pass_fds, bool force_overwrite);